@@ -0,0 +1,78 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Benchmark.Frames.h"
+
+#include <Image.Debayer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+const std::vector<CSensorInfo>& KnownSensors()
+{
+    static const std::vector<CSensorInfo> sensors = {
+        { "IMX178", 3096, 2080 },
+        { "IMX294", 4144, 2822 },
+        { "IMX455", 9576, 6388 },
+        { "IMX571", 6248, 4176 }
+    };
+    return sensors;
+}
+
+std::shared_ptr<CRawU16Image> CreateSyntheticFrame( const char* name, int width, int height, int bitDepth, unsigned int seed )
+{
+    ImageInfo info;
+    info.Width = width;
+    info.Height = height;
+    info.BitDepth = bitDepth;
+    info.Camera = name;
+    info.CFA = "RGGB";
+
+    auto frame = std::make_shared<CRawU16Image>( info );
+
+    const int maxValue = ( 1 << bitDepth ) - 1;
+    // Background at ~6% of the range, noise sigma ~0.3% of the range (typical for a short sub-exposure)
+    const double background = maxValue / 16.0;
+    const double sigma = std::max( 1.0, maxValue / 300.0 );
+    // Color response of the channels (R, G1, G2, B)
+    const double gain[4] = { 0.8, 1.0, 1.0, 0.7 };
+
+    std::mt19937 random( seed );
+    std::normal_distribution<float> noise( 0, sigma );
+
+    std::vector<float> values( width );
+    for( int y = 0; y < height; y++ ) {
+        unsigned short* line = frame->ScanLine( y );
+        for( int x = 0; x < width; x++ ) {
+            double gradient = 1.0 + 0.2 * x / width;
+            values[x] = gain[CFA_CHANNEL_AT( x, y )] * background * gradient + noise( random );
+        }
+        for( int x = 0; x < width; x++ ) {
+            line[x] = std::clamp( static_cast<int>( values[x] ), 0, maxValue );
+        }
+    }
+
+    // Gaussian stars with exponentially distributed brightness, ~1 in 20 of them saturated
+    const int starsCount = std::max( 100, width / 10 );
+    std::uniform_real_distribution<double> position( 0, 1 );
+    std::exponential_distribution<double> brightness( 1.0 );
+    for( int i = 0; i < starsCount; i++ ) {
+        double cx = position( random ) * width;
+        double cy = position( random ) * height;
+        double peak = std::min( 1.5, brightness( random ) / 3 ) * maxValue;
+        double s = 1.2 + position( random );
+        int r = static_cast<int>( std::ceil( 4 * s ) );
+        for( int y = std::max( 0, int( cy ) - r ); y <= std::min( height - 1, int( cy ) + r ); y++ ) {
+            unsigned short* line = frame->ScanLine( y );
+            for( int x = std::max( 0, int( cx ) - r ); x <= std::min( width - 1, int( cx ) + r ); x++ ) {
+                double dx = x - cx;
+                double dy = y - cy;
+                double v = line[x] + gain[CFA_CHANNEL_AT( x, y )] * peak * std::exp( -( dx * dx + dy * dy ) / ( 2 * s * s ) );
+                line[x] = static_cast<unsigned short>( std::min<double>( v, maxValue ) );
+            }
+        }
+    }
+
+    return frame;
+}
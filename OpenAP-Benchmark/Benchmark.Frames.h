@@ -0,0 +1,22 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <Image.RawImage.h>
+
+#include <memory>
+#include <vector>
+
+struct CSensorInfo {
+    const char* Name;
+    int Width;
+    int Height;
+};
+
+// Full frame sizes of the sensors commonly used with the app
+const std::vector<CSensorInfo>& KnownSensors();
+
+// Synthetic RGGB frame: sky background with shot/read noise, a few hundred stars (some of them saturated)
+// and a slight gradient. The same seed always produces the same frame
+std::shared_ptr<CRawU16Image> CreateSyntheticFrame( const char* name, int width, int height, int bitDepth, unsigned int seed = 1 );
@@ -0,0 +1,96 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Benchmark.h"
+
+#include <QTextStream>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cassert>
+
+// Nearest-rank percentile of sorted values
+static double percentile( const std::vector<double>& sorted, double p )
+{
+    size_t rank = static_cast<size_t>( std::ceil( p / 100 * sorted.size() ) );
+    return sorted[std::min( std::max<size_t>( rank, 1 ), sorted.size() ) - 1];
+}
+
+CBenchmarkResult CBenchmark::Run( const std::string& caseName, const CBenchmarkFrame& frame, const std::function<void()>& func ) const
+{
+    for( int i = 0; i < warmup; i++ ) {
+        func();
+    }
+
+    std::vector<double> latencies;
+    latencies.reserve( iterations );
+    for( int i = 0; i < iterations; i++ ) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto end = std::chrono::steady_clock::now();
+        latencies.push_back( std::chrono::duration<double, std::milli>( end - start ).count() );
+    }
+
+    CBenchmarkResult result;
+    result.Case = caseName;
+    result.Frame = frame.Name;
+    result.Width = frame.Width;
+    result.Height = frame.Height;
+    result.BitDepth = frame.BitDepth;
+    result.Iterations = iterations;
+    if( latencies.empty() ) {
+        return result;
+    }
+
+    double sum = 0;
+    for( auto latency : latencies ) {
+        sum += latency;
+    }
+    std::sort( latencies.begin(), latencies.end() );
+    result.MeanMs = sum / latencies.size();
+    result.MinMs = latencies.front();
+    result.P50Ms = percentile( latencies, 50 );
+    result.P90Ms = percentile( latencies, 90 );
+    result.P99Ms = percentile( latencies, 99 );
+    result.MaxMs = latencies.back();
+    if( result.MeanMs > 0 ) {
+        result.MPixPerSecond = ( double( frame.Width ) * frame.Height / 1e6 ) / ( result.MeanMs / 1000 );
+    }
+    return result;
+}
+
+static QString jsonString( const std::string& value )
+{
+    QString escaped = QString::fromStdString( value );
+    escaped.replace( '\\', "\\\\" );
+    escaped.replace( '"', "\\\"" );
+    return '"' + escaped + '"';
+}
+
+void CBenchmarkReport::Add( const CBenchmarkResult& r )
+{
+    auto number = []( double value ) { return QString::number( value, 'f', 3 ); };
+
+    if( format == RF_Csv ) {
+        if( not hasHeader ) {
+            out << "case,frame,width,height,bit_depth,iterations,mean_ms,min_ms,p50_ms,p90_ms,p99_ms,max_ms,mpix_per_s\n";
+            hasHeader = true;
+        }
+        out << QString::fromStdString( r.Case ) << ',' << QString::fromStdString( r.Frame ) << ','
+            << r.Width << ',' << r.Height << ',' << r.BitDepth << ',' << r.Iterations << ','
+            << number( r.MeanMs ) << ',' << number( r.MinMs ) << ',' << number( r.P50Ms ) << ','
+            << number( r.P90Ms ) << ',' << number( r.P99Ms ) << ',' << number( r.MaxMs ) << ','
+            << number( r.MPixPerSecond ) << '\n';
+    } else {
+        assert( format == RF_JsonLines );
+        out << "{\"case\":" << jsonString( r.Case ) << ",\"frame\":" << jsonString( r.Frame ) << ","
+            << "\"width\":" << r.Width << ",\"height\":" << r.Height << ",\"bit_depth\":" << r.BitDepth << ","
+            << "\"iterations\":" << r.Iterations << ","
+            << "\"mean_ms\":" << number( r.MeanMs ) << ",\"min_ms\":" << number( r.MinMs ) << ","
+            << "\"p50_ms\":" << number( r.P50Ms ) << ",\"p90_ms\":" << number( r.P90Ms ) << ","
+            << "\"p99_ms\":" << number( r.P99Ms ) << ",\"max_ms\":" << number( r.MaxMs ) << ","
+            << "\"mpix_per_s\":" << number( r.MPixPerSecond ) << "}\n";
+    }
+    out.flush();
+}
@@ -0,0 +1,65 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class QTextStream;
+
+struct CBenchmarkResult {
+    std::string Case;
+    std::string Frame;
+    int Width = 0;
+    int Height = 0;
+    int BitDepth = 0;
+    int Iterations = 0;
+    // Latency of a single call in milliseconds
+    double MeanMs = 0;
+    double MinMs = 0;
+    double P50Ms = 0;
+    double P90Ms = 0;
+    double P99Ms = 0;
+    double MaxMs = 0;
+    // Throughput in megapixels of the source frame per second
+    double MPixPerSecond = 0;
+};
+
+struct CBenchmarkFrame {
+    std::string Name;
+    int Width;
+    int Height;
+    int BitDepth;
+};
+
+class CBenchmark {
+public:
+    CBenchmark( int _iterations, int _warmup ) : iterations( _iterations ), warmup( _warmup ) {}
+
+    // Times the function (warm-up calls are not measured)
+    CBenchmarkResult Run( const std::string& caseName, const CBenchmarkFrame& frame, const std::function<void()>& func ) const;
+
+private:
+    int iterations;
+    int warmup;
+};
+
+enum TReportFormat {
+    RF_JsonLines,
+    RF_Csv
+};
+
+// Machine readable report. JSON lines (one object per result) or CSV with a header row
+class CBenchmarkReport {
+public:
+    CBenchmarkReport( QTextStream& _out, TReportFormat _format ) : out( _out ), format( _format ) {}
+
+    void Add( const CBenchmarkResult& );
+
+private:
+    QTextStream& out;
+    TReportFormat format;
+    bool hasHeader = false;
+};
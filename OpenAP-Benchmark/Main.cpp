@@ -0,0 +1,290 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QFileInfo>
+#include <QEventLoop>
+#include <QTimer>
+#include <QTextStream>
+
+#include <algorithm>
+#include <cmath>
+
+#include <Image.Debayer.Binned.h>
+#include <Image.Debayer.CFA.h>
+#include <Image.Debayer.HalfRes.h>
+#include <Image.Debayer.HQLinear.h>
+#include <Image.Math.Advanced.h>
+#include <Image.PhaseCorrelation.h>
+#include <Image.PsfFitting.h>
+#include <Image.Qt.h>
+#include <Image.Warp.h>
+#include <Preview.Client.h>
+#include <Preview.Server.h>
+#include <Renderer.h>
+#include <Renderer.TileCache.h>
+
+#include "Benchmark.h"
+#include "Benchmark.Frames.h"
+
+// Runs all benchmark cases on the frame. Output buffers are allocated once outside of the measured calls
+static void runFrame( const CBenchmark& benchmark, CBenchmarkReport& report, const QString& filter,
+    const CBenchmarkFrame& frame, const std::shared_ptr<const CRawU16Image>& image )
+{
+    const ushort* raw = image->RawPixels();
+    const int width = frame.Width;
+    const int height = frame.Height;
+    const int bitDepth = frame.BitDepth;
+
+    std::vector<uint> hr( 256 ), hg( 256 ), hb( 256 );
+    std::vector<uchar> rgb8;
+    std::vector<ushort> rgb16;
+
+    auto isSelected = [&]( const char* caseName ) { return filter.isEmpty() || QString( caseName ).contains( filter ); };
+    auto run = [&]( const char* caseName, const std::function<void()>& func ) {
+        if( not isSelected( caseName ) ) {
+            return;
+        }
+        qInfo( "%s %s %dx%d %d-bit", caseName, frame.Name.c_str(), width, height, bitDepth );
+        report.Add( benchmark.Run( caseName, frame, func ) );
+    };
+
+    rgb8.resize( 3 * width * height );
+    run( "debayer.hqlinear.rgb8", [&]() {
+        CDebayer_RawU16_HQLinear debayer( raw, width, height, bitDepth );
+        debayer.ToRgbU8( rgb8.data(), 3 * width, 0, 0, width, height, hr.data(), hg.data(), hb.data() );
+    } );
+    run( "debayer.cfa.rgb8", [&]() {
+        CDebayer_RawU16_CFA debayer( raw, width, height, bitDepth );
+        debayer.ToRgbU8( rgb8.data(), 3 * width, 0, 0, width, height, hr.data(), hg.data(), hb.data() );
+    } );
+    run( "debayer.halfres.rgb8", [&]() {
+        CDebayer_RawU16_HalfRes debayer( raw, width, height, bitDepth );
+        debayer.ToRgbU8( rgb8.data(), 3 * ( width / 2 ), 0, 0, width / 2, height / 2, hr.data(), hg.data(), hb.data() );
+    } );
+    for( int factor : { 4, 8 } ) {
+        run( factor == 4 ? "debayer.binned4.rgb8" : "debayer.binned8.rgb8", [&]() {
+            CDebayer_RawU16_Binned debayer( raw, width, height, bitDepth, factor );
+            debayer.ToRgbU8( rgb8.data(), 3 * ( width / factor ), 0, 0, width / factor, height / factor, hr.data(), hg.data(), hb.data() );
+        } );
+    }
+    rgb8 = std::vector<uchar>();
+
+    rgb16.resize( 3 * width * height );
+    run( "debayer.hqlinear.rgb16", [&]() {
+        CDebayer_RawU16_HQLinear debayer( raw, width, height, bitDepth );
+        debayer.ToRgbU16( rgb16.data(), 3 * width, 0, 0, width, height );
+    } );
+    run( "debayer.hqlinear.gray16", [&]() {
+        CDebayer_RawU16_HQLinear debayer( raw, width, height, bitDepth );
+        debayer.ToGrayU16( rgb16.data(), width, 0, 0, width, height );
+    } );
+    run( "debayer.halfres.gray16", [&]() {
+        CDebayer_RawU16_HalfRes debayer( raw, width, height, bitDepth );
+        debayer.ToGrayU16( rgb16.data(), width / 2, 0, 0, width / 2, height / 2 );
+    } );
+    rgb16 = std::vector<ushort>();
+
+    CRawU16 rawU16( image.get() );
+    run( "stats.exact", [&]() { rawU16.EstimateStretchParams( 0, 0, width, height, SM_Exact ); } );
+    run( "stats.strided", [&]() { rawU16.EstimateStretchParams( 0, 0, width, height, SM_Strided ); } );
+    run( "stats.random", [&]() { rawU16.EstimateStretchParams( 0, 0, width, height, SM_Random ); } );
+    // Stars are detected once, only fitting is measured
+    if( isSelected( "psf.gaussian" ) || isSelected( "psf.moffat" ) ) {
+        auto detection = rawU16.DetectStars( 0, 0, width, height );
+        qInfo( "psf: %d stars", static_cast<int>( detection.DetectionRegions.size() ) );
+        for( TPsfModel model : { PSF_Gaussian, PSF_Moffat } ) {
+            CPsfFitter fitter( model );
+            run( model == PSF_Gaussian ? "psf.gaussian" : "psf.moffat", [&]() { fitter.Fit( detection ); } );
+        }
+    }
+    // Registration of a ROI of the superpixel luminance against a shifted one (the spectrum of the reference is reused)
+    if( isSelected( "registration.phase" ) ) {
+        auto gray = rawU16.GrayU16HalfRes( 0, 0, width, height );
+        const int size = CPhaseCorrelation::DefaultSize;
+        if( gray->Width() > size + 8 && gray->Height() > size + 8 ) {
+            for( bool isRotationAndScale : { false, true } ) {
+                CPhaseCorrelation correlation( size );
+                correlation.SetRotationAndScale( isRotationAndScale );
+                correlation.SetReference( gray.get(), 0, 0 );
+                run( isRotationAndScale ? "registration.phase.rotation" : "registration.phase", [&]() { correlation.Register( gray.get(), 7, 3 ); } );
+            }
+        }
+    }
+    if( isSelected( "warp.cfa" ) ) {
+        // Small rotation and subpixel shift of a registered frame
+        const double angle = 0.01;
+        const double ax[3] = { std::cos( angle ), -std::sin( angle ), 3.3 };
+        const double ay[3] = { std::sin( angle ), std::cos( angle ), -2.7 };
+        CPixelBuffer<ushort> warped( width, height );
+        for( TResamplingKernel kernel : { RK_Bilinear, RK_Bicubic, RK_Lanczos3 } ) {
+            CImageWarp warp( kernel );
+            warp.SetAffineTransform( ax, ay );
+            const char* caseName = kernel == RK_Bilinear ? "warp.cfa.bilinear" : kernel == RK_Bicubic ? "warp.cfa.bicubic" : "warp.cfa.lanczos3";
+            run( caseName, [&]() { warp.WarpCfa( *image, warped ); } );
+        }
+    }
+
+    run( "stretch.full", [&]() { rawU16.Stretch( 0, 0, width, height ); } );
+    run( "stretch.halfres", [&]() { rawU16.StretchHalfRes( 0, 0, width, height ); } );
+    run( "stretch.quarterres", [&]() { rawU16.StretchQuarterRes( 0, 0, width, height ); } );
+    run( "stretch.binned8", [&]() { rawU16.StretchBinned( 8, 0, 0, width, height ); } );
+
+    // Same calls as in MainFrame (the whole frame is rendered to a pixmap, render buffers are reused across frames)
+    CRenderBuffers renderBuffers;
+    run( "render.quarterres", [&]() { Renderer( raw, width, height, bitDepth, &renderBuffers ).Render( RM_QuarterResolution ); } );
+    run( "render.halfres", [&]() { Renderer( raw, width, height, bitDepth, &renderBuffers ).Render( RM_HalfResolution ); } );
+    run( "render.full", [&]() { Renderer( raw, width, height, bitDepth, &renderBuffers ).Render( RM_FullResolution ); } );
+    run( "render.cfa", [&]() { Renderer( raw, width, height, bitDepth, &renderBuffers ).Render( RM_CFA ); } );
+    // Rendering only (without the conversion to a pixmap)
+    run( "render.halfres.image", [&]() { Renderer( raw, width, height, bitDepth, &renderBuffers ).RenderImage( RM_HalfResolution ); } );
+    Renderer renderer( raw, width, height, bitDepth, &renderBuffers );
+    renderer.Render( RM_QuarterResolution );
+    run( "render.histogram", [&]() { renderer.RenderHistogram(); } );
+
+    // Largest zoom view (961x961) on a new frame and panned over the same frame by a quarter of the view
+    const int zoomSize = 961;
+    CZoomTileCache zoomTileCache;
+    run( "zoom.new", [&]() {
+        zoomTileCache.Clear();
+        zoomTileCache.Render( image, RM_FullResolution, true, width / 2, height / 2, zoomSize, zoomSize );
+    } );
+    int zoomX = zoomSize / 2;
+    run( "zoom.pan", [&]() {
+        zoomX = zoomX + zoomSize / 4 < width - zoomSize / 2 ? zoomX + zoomSize / 4 : zoomSize / 2;
+        zoomTileCache.Render( image, RM_FullResolution, true, zoomX, height / 2, zoomSize, zoomSize );
+    } );
+
+    // Preview stream of two alternating frames (all tiles change), encoding only and through a loopback connection
+    QImage previewFrames[2] = { renderer.RenderImage( RM_QuarterResolution ).copy(),
+        Qt::ShareImage( rawU16.StretchQuarterRes( 0, 0, width, height ) ).copy() };
+    for( TTileEncoding encoding : { TE_Jpeg, TE_Delta } ) {
+        CPreviewEncoder encoder( encoding );
+        QImage reference;
+        int index = 0;
+        run( encoding == TE_Jpeg ? "preview.encode.jpeg" : "preview.encode.delta", [&]() {
+            index++;
+            encoder.EncodeFrame( previewFrames[index % 2], reference, index );
+        } );
+    }
+    CPreviewServer previewServer;
+    previewServer.SetEncoder( CPreviewEncoder( TE_Delta ) );
+    previewServer.SetMaxSize( 0 );
+    if( previewServer.Listen( 0, QHostAddress::LocalHost ) ) {
+        CPreviewClient previewClient;
+        QEventLoop loop;
+        QTimer timeout;
+        timeout.setSingleShot( true );
+        QObject::connect( &timeout, &QTimer::timeout, &loop, &QEventLoop::quit );
+        QObject::connect( &previewClient, &CPreviewClient::frameReceived, &loop, &QEventLoop::quit );
+        previewClient.ConnectToServer( "127.0.0.1", previewServer.Port() );
+        timeout.start( 5000 );
+        while( previewServer.Clients() == 0 && timeout.isActive() ) {
+            loop.processEvents( QEventLoop::WaitForMoreEvents );
+        }
+        if( previewServer.Clients() == 0 ) {
+            qWarning( "Preview loopback: cannot connect to the server" );
+            return;
+        }
+        int index = 0;
+        bool isLossless = true;
+        run( "preview.loopback.delta", [&]() {
+            const QImage& frame = previewFrames[++index % 2];
+            previewServer.Publish( frame );
+            timeout.start( 5000 );
+            loop.exec();
+            isLossless = isLossless && previewClient.Image() == frame;
+        } );
+        if( not isLossless ) {
+            qWarning( "Preview loopback: received frame differs from the sent one" );
+        }
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    // Pixmaps are created without a display
+    if( qEnvironmentVariableIsEmpty( "QT_QPA_PLATFORM" ) ) {
+        qputenv( "QT_QPA_PLATFORM", "offscreen" );
+    }
+    QGuiApplication app( argc, argv );
+    QCoreApplication::setApplicationName( "OpenAP-Benchmark" );
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription( "Debayering, stretching and rendering benchmark. "
+        "Results are written to stdout (or to the output file), progress to stderr." );
+    parser.addHelpOption();
+    QCommandLineOption sensorOption( "sensor", "Synthetic frame of the sensor size (IMX178, IMX294, IMX455, IMX571). All by default.", "name" );
+    QCommandLineOption bitDepthOption( "bit-depth", "Bit depth of synthetic frames (12, 14, 16). All by default.", "bits" );
+    QCommandLineOption caseOption( "case", "Run only cases containing the text (e.g. debayer, render.full).", "text" );
+    QCommandLineOption iterationsOption( "iterations", "Measured iterations per case.", "n", "10" );
+    QCommandLineOption warmupOption( "warmup", "Warm-up iterations per case.", "n", "2" );
+    QCommandLineOption formatOption( "format", "Output format: json (one object per line) or csv.", "format", "json" );
+    QCommandLineOption outputOption( "output", "Output file.", "path" );
+    QCommandLineOption noSyntheticOption( "no-synthetic", "Benchmark recorded frames only." );
+    parser.addOptions( { sensorOption, bitDepthOption, caseOption, iterationsOption, warmupOption,
+        formatOption, outputOption, noSyntheticOption } );
+    parser.addPositionalArgument( "frames", "Recorded frames (.pixels files saved by OpenAP-Capture).", "[frames...]" );
+    parser.process( app );
+
+    QFile outputFile;
+    if( parser.isSet( outputOption ) ) {
+        outputFile.setFileName( parser.value( outputOption ) );
+        if( not outputFile.open( QIODevice::WriteOnly | QIODevice::Text ) ) {
+            qCritical( "Cannot open %s", qPrintable( parser.value( outputOption ) ) );
+            return 1;
+        }
+    } else {
+        outputFile.open( stdout, QIODevice::WriteOnly | QIODevice::Text );
+    }
+    QTextStream out( &outputFile );
+
+    TReportFormat format = parser.value( formatOption ) == "csv" ? RF_Csv : RF_JsonLines;
+    CBenchmarkReport report( out, format );
+    CBenchmark benchmark( std::max( 1, parser.value( iterationsOption ).toInt() ), std::max( 0, parser.value( warmupOption ).toInt() ) );
+    QString filter = parser.value( caseOption );
+
+    for( const auto& path : parser.positionalArguments() ) {
+        // Frame info is stored next to the pixels
+        QString infoPath = path;
+        infoPath.replace( ".pixels", ".info" );
+        if( not QFileInfo::exists( path ) || not QFileInfo::exists( infoPath ) ) {
+            qCritical( "Cannot find %s (or its .info file)", qPrintable( path ) );
+            return 1;
+        }
+        auto image = CRawU16Image::LoadFromFile( path.toLocal8Bit().constData() );
+        if( not image ) {
+            qCritical( "Cannot load %s", qPrintable( path ) );
+            return 1;
+        }
+        CBenchmarkFrame frame = { QFileInfo( path ).fileName().toStdString(), image->Width(), image->Height(), image->BitDepth() };
+        runFrame( benchmark, report, filter, frame, image );
+    }
+
+    if( not parser.isSet( noSyntheticOption ) ) {
+        QStringList sensors = parser.values( sensorOption );
+        QStringList bitDepths = parser.values( bitDepthOption );
+        if( bitDepths.isEmpty() ) {
+            bitDepths = QStringList( { "12", "14", "16" } );
+        }
+        for( const auto& sensor : KnownSensors() ) {
+            if( not sensors.isEmpty() && not sensors.contains( sensor.Name, Qt::CaseInsensitive ) ) {
+                continue;
+            }
+            for( const auto& bits : bitDepths ) {
+                int bitDepth = bits.toInt();
+                if( bitDepth < 8 || bitDepth > 16 ) {
+                    qCritical( "Unsupported bit depth %s", qPrintable( bits ) );
+                    return 1;
+                }
+                auto image = CreateSyntheticFrame( sensor.Name, sensor.Width, sensor.Height, bitDepth );
+                CBenchmarkFrame frame = { std::string( sensor.Name ) + ".synthetic", sensor.Width, sensor.Height, bitDepth };
+                runFrame( benchmark, report, filter, frame, image );
+            }
+        }
+    }
+
+    return 0;
+}
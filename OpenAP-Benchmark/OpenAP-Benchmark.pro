@@ -0,0 +1,56 @@
+#-------------------------------------------------
+#
+# Headless benchmark for debayering, stretching and rendering
+#
+#-------------------------------------------------
+
+QT += core gui network concurrent
+
+TARGET = OpenAP-Benchmark
+TEMPLATE = app
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+CAPTURE = ../OpenAP-Capture
+INCLUDEPATH += $$CAPTURE
+
+SOURCES += \
+        Benchmark.cpp \
+        Benchmark.Frames.cpp \
+        Main.cpp \
+        $$CAPTURE/Image.BadPixels.cpp \
+        $$CAPTURE/Image.Background.cpp \
+        $$CAPTURE/Image.Debayer.Binned.cpp \
+        $$CAPTURE/Image.Debayer.CFA.cpp \
+        $$CAPTURE/Image.Debayer.HalfRes.cpp \
+        $$CAPTURE/Image.Debayer.HQLinear.cpp \
+        $$CAPTURE/Image.Image.cpp \
+        $$CAPTURE/Image.Labeling.cpp \
+        $$CAPTURE/Image.Math.cpp \
+        $$CAPTURE/Image.Math.Advanced.cpp \
+        $$CAPTURE/Image.PhaseCorrelation.cpp \
+        $$CAPTURE/Image.PsfFitting.cpp \
+        $$CAPTURE/Image.RadialProfile.cpp \
+        $$CAPTURE/Image.StarMatcher.cpp \
+        $$CAPTURE/Image.RawImage.cpp \
+        $$CAPTURE/Image.Warp.cpp \
+        $$CAPTURE/Math.Fft.cpp \
+        $$CAPTURE/Math.Geometry.cpp \
+        $$CAPTURE/Math.LinearAlgebra.cpp \
+        $$CAPTURE/Math.Ransac.cpp \
+        $$CAPTURE/Preview.Client.cpp \
+        $$CAPTURE/Preview.Protocol.cpp \
+        $$CAPTURE/Preview.Server.cpp \
+        $$CAPTURE/Renderer.cpp \
+        $$CAPTURE/Renderer.TileCache.cpp \
+
+HEADERS += \
+        Benchmark.h \
+        Benchmark.Frames.h \
+        $$CAPTURE/Preview.Client.h \
+        $$CAPTURE/Preview.Server.h \
+
+unix: {
+    QMAKE_CXXFLAGS += -std=c++17 #CONFIG alone does not work with neither gcc nor clang
+}
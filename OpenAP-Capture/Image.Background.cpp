@@ -0,0 +1,214 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Image.Background.h"
+
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
+
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+CBackgroundMesh::CBackgroundMesh( int _cellSize, int _reuseFrames ) :
+    cellSize( _cellSize ), reuseFrames( std::max( 1, _reuseFrames ) )
+{
+}
+
+void CBackgroundMesh::Update( const CGrayU16Image* image )
+{
+    if( framesToReuse <= 0 || not IsValidFor( image->Width(), image->Height() ) ) {
+        Estimate( image );
+        framesToReuse = reuseFrames;
+    }
+    framesToReuse--;
+}
+
+// Sigma-clipped mode and RMS of the values (the values are reordered)
+static void clippedStat( std::vector<unsigned short>& values, float& mode, float& rms )
+{
+    auto begin = values.begin();
+    auto end = values.end();
+    float median = 0;
+    float sigma = 0;
+    for( int iteration = 0; iteration < 3 && end - begin > 2; iteration++ ) {
+        const auto count = end - begin;
+        auto m = begin + count / 2;
+        std::nth_element( begin, m, end );
+        median = *m;
+        // The same as in CPixelStatistics: the distance from the median to the lower 1/6 quantile, not affected by stars
+        auto q = begin + count / 2 - count / 3;
+        std::nth_element( begin, q, m );
+        sigma = std::max( 1.0f, median - *q );
+
+        const float lo = median - 3 * sigma;
+        const float hi = median + 3 * sigma;
+        auto clippedEnd = std::partition( begin, end, [lo, hi]( unsigned short v ) { return v >= lo && v <= hi; } );
+        if( clippedEnd == end ) {
+            break;
+        }
+        end = clippedEnd;
+    }
+    if( end - begin < 3 ) {
+        mode = median;
+        rms = std::max( 1.0f, sigma );
+        return;
+    }
+
+    double sum = 0;
+    double sumSq = 0;
+    for( auto i = begin; i != end; i++ ) {
+        sum += *i;
+        sumSq += double( *i ) * *i;
+    }
+    const double n = static_cast<double>( end - begin );
+    const double mean = sum / n;
+    rms = static_cast<float>( std::max( 1.0, std::sqrt( std::max( 0.0, sumSq / n - mean * mean ) ) ) );
+    // Mode estimate of a skewed (by faint stars) distribution, the median when the skew is too large
+    mode = std::abs( mean - median ) < 0.3 * rms ? static_cast<float>( 2.5 * median - 1.5 * mean ) : median;
+}
+
+void CBackgroundMesh::Estimate( const CGrayU16Image* image )
+{
+    width = image->Width();
+    height = image->Height();
+    columns = std::max( 1, ( width + cellSize / 2 ) / cellSize );
+    rows = std::max( 1, ( height + cellSize / 2 ) / cellSize );
+    background.assign( columns * rows, 0 );
+    sigma.assign( columns * rows, 0 );
+
+    // Rows of cells in parallel. Cells at the right and bottom edges take the remainder of the image
+    std::vector<int> cellRows( rows );
+    std::iota( cellRows.begin(), cellRows.end(), 0 );
+    QtConcurrent::blockingMap( cellRows, [&]( int row ) {
+        std::vector<unsigned short> values;
+        const int y0 = row * height / rows;
+        const int y1 = ( row + 1 ) * height / rows;
+        for( int column = 0; column < columns; column++ ) {
+            const int x0 = column * width / columns;
+            const int x1 = ( column + 1 ) * width / columns;
+            values.clear();
+            for( int y = y0; y < y1; y++ ) {
+                const unsigned short* src = image->ScanLine( y );
+                values.insert( values.end(), src + x0, src + x1 );
+            }
+            clippedStat( values, background[row * columns + column], sigma[row * columns + column] );
+        }
+    } );
+
+    background = medianFilter( background, columns, rows );
+    sigma = medianFilter( sigma, columns, rows );
+}
+
+std::vector<float> CBackgroundMesh::medianFilter( const std::vector<float>& mesh, int columns, int rows )
+{
+    std::vector<float> result( mesh.size() );
+    std::vector<float> window;
+    for( int row = 0; row < rows; row++ ) {
+        for( int column = 0; column < columns; column++ ) {
+            window.clear();
+            for( int r = std::max( 0, row - 1 ); r <= std::min( rows - 1, row + 1 ); r++ ) {
+                for( int c = std::max( 0, column - 1 ); c <= std::min( columns - 1, column + 1 ); c++ ) {
+                    window.push_back( mesh[r * columns + c] );
+                }
+            }
+            std::nth_element( window.begin(), window.begin() + window.size() / 2, window.end() );
+            result[row * columns + column] = window[window.size() / 2];
+        }
+    }
+    return result;
+}
+
+CBackgroundMesh::CWeights CBackgroundMesh::weights( int pos, int size, int count ) const
+{
+    // Position in cells relative to the cell centers
+    const float p = ( pos + 0.5f ) * count / size - 0.5f;
+    CWeights w;
+    if( p <= 0 ) {
+        w = { 0, 0, 0 };
+    } else if( p >= count - 1 ) {
+        w = { count - 1, count - 1, 0 };
+    } else {
+        w.I0 = static_cast<int>( p );
+        w.I1 = w.I0 + 1;
+        w.W1 = p - w.I0;
+    }
+    return w;
+}
+
+float CBackgroundMesh::interpolate( const std::vector<float>& mesh, int x, int y ) const
+{
+    const CWeights wx = weights( x, width, columns );
+    const CWeights wy = weights( y, height, rows );
+    const float* r0 = mesh.data() + wy.I0 * columns;
+    const float* r1 = mesh.data() + wy.I1 * columns;
+    const float v0 = r0[wx.I0] + wx.W1 * ( r0[wx.I1] - r0[wx.I0] );
+    const float v1 = r1[wx.I0] + wx.W1 * ( r1[wx.I1] - r1[wx.I0] );
+    return v0 + wy.W1 * ( v1 - v0 );
+}
+
+int CBackgroundMesh::Background( int x, int y ) const
+{
+    return static_cast<int>( std::lround( interpolate( background, x, y ) ) );
+}
+
+int CBackgroundMesh::Sigma( int x, int y ) const
+{
+    return std::max( 1, static_cast<int>( std::lround( interpolate( sigma, x, y ) ) ) );
+}
+
+std::shared_ptr<CGrayU16Image> CBackgroundMesh::ThresholdMap( double k ) const
+{
+    auto result = std::make_shared<CGrayU16Image>( width, height );
+
+    // Threshold on the mesh, then interpolated the same way as the background
+    std::vector<float> mesh( background.size() );
+    for( size_t i = 0; i < mesh.size(); i++ ) {
+        mesh[i] = static_cast<float>( background[i] + k * sigma[i] );
+    }
+    std::vector<CWeights> wx( width );
+    for( int x = 0; x < width; x++ ) {
+        wx[x] = weights( x, width, columns );
+    }
+
+    std::vector<int> bands( std::max( 1, std::min( QThread::idealThreadCount(), height / 128 ) ) );
+    std::iota( bands.begin(), bands.end(), 0 );
+    QtConcurrent::blockingMap( bands, [&]( int band ) {
+        std::vector<float> line( columns );
+        for( int y = band * height / int( bands.size() ); y < ( band + 1 ) * height / int( bands.size() ); y++ ) {
+            // Interpolate the rows of the mesh first, then along the row
+            const CWeights wy = weights( y, height, rows );
+            const float* r0 = mesh.data() + wy.I0 * columns;
+            const float* r1 = mesh.data() + wy.I1 * columns;
+            for( int c = 0; c < columns; c++ ) {
+                line[c] = r0[c] + wy.W1 * ( r1[c] - r0[c] );
+            }
+            unsigned short* dst = result->ScanLine( y );
+            for( int x = 0; x < width; x++ ) {
+                const CWeights& w = wx[x];
+                const float v = line[w.I0] + w.W1 * ( line[w.I1] - line[w.I0] );
+                dst[x] = static_cast<unsigned short>( std::min( 65535.0f, std::max( 0.0f, v + 0.5f ) ) );
+            }
+        }
+    } );
+    return result;
+}
+
+static int medianOf( std::vector<float> values )
+{
+    if( values.empty() ) {
+        return 0;
+    }
+    std::nth_element( values.begin(), values.begin() + values.size() / 2, values.end() );
+    return static_cast<int>( std::lround( values[values.size() / 2] ) );
+}
+
+int CBackgroundMesh::MedianBackground() const
+{
+    return medianOf( background );
+}
+
+int CBackgroundMesh::MedianSigma() const
+{
+    return medianOf( sigma );
+}
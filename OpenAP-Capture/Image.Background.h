@@ -0,0 +1,55 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <Image.Image.h>
+
+#include <memory>
+#include <vector>
+
+// Sky background and noise on a coarse grid of cells. Each cell gets the sigma-clipped mode and RMS of its pixels,
+// the grid is median filtered (to reject cells covered by bright stars) and bilinearly interpolated between cell
+// centers, so gradients from light pollution or the Moon follow the local background.
+// The mesh changes slowly, so it can be reused for several consecutive frames of the same size
+class CBackgroundMesh {
+public:
+    static const int DefaultCellSize = 64;
+
+    // The mesh is estimated for every reuseFrames-th frame passed to Update (and when the frame size changes)
+    CBackgroundMesh( int cellSize = DefaultCellSize, int reuseFrames = 1 );
+
+    void Estimate( const CGrayU16Image* );
+    void Update( const CGrayU16Image* );
+    bool IsValidFor( int width, int height ) const { return width == this->width && height == this->height && columns > 0; }
+
+    // Interpolated at the pixel
+    int Background( int x, int y ) const;
+    int Sigma( int x, int y ) const;
+    // Background + k * Sigma at each pixel (saturated to 16 bits)
+    std::shared_ptr<CGrayU16Image> ThresholdMap( double k ) const;
+
+    // Medians over cells (for logging)
+    int MedianBackground() const;
+    int MedianSigma() const;
+
+private:
+    const int cellSize;
+    const int reuseFrames;
+    int framesToReuse = 0;
+    int width = 0;
+    int height = 0;
+    int columns = 0;
+    int rows = 0;
+    std::vector<float> background;
+    std::vector<float> sigma;
+
+    struct CWeights {
+        int I0;
+        int I1;
+        float W1;
+    };
+    CWeights weights( int pos, int size, int count ) const;
+    float interpolate( const std::vector<float>& mesh, int x, int y ) const;
+    static std::vector<float> medianFilter( const std::vector<float>& mesh, int columns, int rows );
+};
@@ -0,0 +1,158 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Image.BadPixels.h"
+
+#include <QDebug>
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+// Same color neighbours in a Bayer mosaic
+static const int neighbourOffsets[8][2] = { { -2, -2 }, { 0, -2 }, { 2, -2 }, { -2, 0 }, { 2, 0 }, { -2, 2 }, { 0, 2 }, { 2, 2 } };
+
+template<typename T>
+static T median( T* values, int count )
+{
+    std::nth_element( values, values + count / 2, values + count );
+    return values[count / 2];
+}
+
+CBadPixelMap::CBadPixelMap( int _width, int _height ) :
+    width( _width ), height( _height )
+{
+}
+
+size_t CBadPixelMap::Count() const
+{
+    return defects[0].size() + defects[1].size() + defects[2].size() + defects[3].size();
+}
+
+bool CBadPixelMap::IsDefect( int x, int y ) const
+{
+    const auto& channel = defects[Channel( x, y )];
+    return std::binary_search( channel.begin(), channel.end(), static_cast<unsigned int>( y * width + x ) );
+}
+
+void CBadPixelMap::Add( int x, int y )
+{
+    defects[Channel( x, y )].push_back( static_cast<unsigned int>( y * width + x ) );
+}
+
+void CBadPixelMap::Sort()
+{
+    for( auto& channel : defects ) {
+        std::sort( channel.begin(), channel.end() );
+        channel.erase( std::unique( channel.begin(), channel.end() ), channel.end() );
+    }
+}
+
+std::shared_ptr<CBadPixelMap> CBadPixelMap::FromMasterDark( const CPixelBuffer<unsigned short>& dark, double sigmas )
+{
+    return fromMasterDark( dark, sigmas );
+}
+
+std::shared_ptr<CBadPixelMap> CBadPixelMap::FromMasterDark( const CPixelBuffer<double>& dark, double sigmas )
+{
+    return fromMasterDark( dark, sigmas );
+}
+
+template<typename T>
+std::shared_ptr<CBadPixelMap> CBadPixelMap::fromMasterDark( const CPixelBuffer<T>& dark, double sigmas )
+{
+    const int width = dark.Width();
+    const int height = dark.Height();
+    auto result = std::make_shared<CBadPixelMap>( width, height );
+
+    // Deviation of each pixel from the median of its neighbours (not affected by amp glow and other gradients)
+    std::vector<float> deviations( width * height );
+    std::vector<int> bands( std::max( 1, std::min( QThread::idealThreadCount(), height / 128 ) ) );
+    std::iota( bands.begin(), bands.end(), 0 );
+    QtConcurrent::blockingMap( bands, [&]( int band ) {
+        for( int y = band * height / int( bands.size() ); y < ( band + 1 ) * height / int( bands.size() ); y++ ) {
+            const T* src = dark.ScanLine( y );
+            float* dst = deviations.data() + y * width;
+            for( int x = 0; x < width; x++ ) {
+                double values[8];
+                int count = 0;
+                for( const auto& offset : neighbourOffsets ) {
+                    const int nx = x + offset[0];
+                    const int ny = y + offset[1];
+                    if( nx >= 0 && nx < width && ny >= 0 && ny < height ) {
+                        values[count++] = dark.At( nx, ny );
+                    }
+                }
+                dst[x] = count > 0 ? static_cast<float>( src[x] - median( values, count ) ) : 0;
+            }
+        }
+    } );
+
+    // Robust sigma of the deviations (from the median absolute deviation) for each channel
+    for( int channel = 0; channel < 4; channel++ ) {
+        const int cx = channel & 1;
+        const int cy = channel >> 1;
+        std::vector<float> values;
+        values.reserve( ( width / 2 + 1 ) * ( height / 2 + 1 ) );
+        for( int y = cy; y < height; y += 2 ) {
+            for( int x = cx; x < width; x += 2 ) {
+                values.push_back( std::abs( deviations[y * width + x] ) );
+            }
+        }
+        if( values.empty() ) {
+            continue;
+        }
+        const double sigma = std::max( 0.5, 1.4826 * median( values.data(), static_cast<int>( values.size() ) ) );
+        const double threshold = sigmas * sigma;
+        for( int y = cy; y < height; y += 2 ) {
+            for( int x = cx; x < width; x += 2 ) {
+                if( std::abs( deviations[y * width + x] ) > threshold ) {
+                    result->Add( x, y );
+                }
+            }
+        }
+        qDebug() << "Bad pixels in channel" << channel << ":" << result->Defects( channel ).size() << "Sigma:" << sigma;
+    }
+    // Pixels were added in scan order, so the channels are already sorted
+    return result;
+}
+
+bool CBadPixelMap::Apply( CPixelBuffer<unsigned short>* image ) const
+{
+    return apply( image );
+}
+
+bool CBadPixelMap::Apply( CPixelBuffer<double>* image ) const
+{
+    return apply( image );
+}
+
+template<typename T>
+bool CBadPixelMap::apply( CPixelBuffer<T>* image ) const
+{
+    if( image->Width() != width || image->Height() != height ) {
+        return false;
+    }
+    for( const auto& channel : defects ) {
+        for( unsigned int index : channel ) {
+            const int x = index % width;
+            const int y = index / width;
+            T values[8];
+            int count = 0;
+            for( const auto& offset : neighbourOffsets ) {
+                const int nx = x + offset[0];
+                const int ny = y + offset[1];
+                // Neighbours that are defects themselves are skipped, so the result does not depend on the order
+                if( nx >= 0 && nx < width && ny >= 0 && ny < height && not IsDefect( nx, ny ) ) {
+                    values[count++] = image->At( nx, ny );
+                }
+            }
+            if( count > 0 ) {
+                image->At( x, y ) = median( values, count );
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <Image.Image.h>
+
+#include <memory>
+#include <vector>
+
+// Defective (hot, warm or dead) pixels of the sensor. Defects are kept as sorted pixel indices for each of the
+// four CFA channels, so correcting a frame costs proportionally to the number of defects, not to the frame size
+class CBadPixelMap {
+public:
+    // Deviation from the neighbours in robust sigmas of the channel that makes a pixel defective
+    static constexpr double DefaultSigmas = 8;
+
+    CBadPixelMap( int width, int height );
+
+    // Pixels of a master dark deviating from the median of their same color neighbours
+    static std::shared_ptr<CBadPixelMap> FromMasterDark( const CPixelBuffer<unsigned short>& dark, double sigmas = DefaultSigmas );
+    static std::shared_ptr<CBadPixelMap> FromMasterDark( const CPixelBuffer<double>& dark, double sigmas = DefaultSigmas );
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    size_t Count() const;
+
+    // Channels are 0 to 3 in the order of the 2x2 CFA quad: ( y & 1 ) * 2 + ( x & 1 )
+    static int Channel( int x, int y ) { return ( y & 1 ) * 2 + ( x & 1 ); }
+    // Sorted indices ( y * width + x ) of the defects of the channel
+    const std::vector<unsigned int>& Defects( int channel ) const { return defects[channel]; }
+    bool IsDefect( int x, int y ) const;
+
+    void Add( int x, int y );
+    // Restores the order of defects after adding
+    void Sort();
+
+    // Replaces defects in place by the median of their non-defective same color neighbours.
+    // Returns false (and does nothing) when the frame size differs from the map
+    bool Apply( CPixelBuffer<unsigned short>* ) const;
+    bool Apply( CPixelBuffer<double>* ) const;
+
+private:
+    int width;
+    int height;
+    std::vector<unsigned int> defects[4];
+
+    template<typename T>
+    static std::shared_ptr<CBadPixelMap> fromMasterDark( const CPixelBuffer<T>&, double sigmas );
+    template<typename T>
+    bool apply( CPixelBuffer<T>* ) const;
+};
@@ -0,0 +1,104 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Image.Debayer.Binned.h"
+
+#include <cassert>
+#include <vector>
+
+struct CDebayer_RawU16_Binned::CBinnedRow {
+    std::vector<std::uint32_t> R;
+    std::vector<std::uint32_t> G;
+    std::vector<std::uint32_t> B;
+    // Number of quads in each bin (less than (factor / 2)^2 at the frame borders)
+    std::vector<std::uint32_t> Count;
+
+    CBinnedRow( int w ) : R( w ), G( w ), B( w ), Count( w ) {}
+};
+
+CDebayer_RawU16_Binned::CDebayer_RawU16_Binned( const std::uint16_t* _raw, int _width, int _height, int bitDepth, int _factor ) :
+    CDebayer_RawU16( _raw, _width, _height, bitDepth ), factor( _factor )
+{
+    assert( factor >= 2 && factor % 2 == 0 );
+}
+
+void CDebayer_RawU16_Binned::sumRow( CBinnedRow& row, int x0, int Y0, int w, bool withStatistics )
+{
+    std::fill( row.R.begin(), row.R.end(), 0 );
+    std::fill( row.G.begin(), row.G.end(), 0 );
+    std::fill( row.B.begin(), row.B.end(), 0 );
+    std::fill( row.Count.begin(), row.Count.end(), 0 );
+
+    // Only whole quads inside the frame
+    const int X0 = std::max( x0, 0 );
+    const int X1 = std::min( x0 + factor * w, width - width % 2 );
+    for( int Y = Y0; Y < Y0 + factor; Y += 2 ) {
+        if( Y < 0 || Y + 1 >= height ) {
+            continue;
+        }
+        const auto* line0 = raw + width * Y;
+        const auto* line1 = line0 + width;
+        if( withStatistics ) {
+            addToStatistics( line0 + X0, X1 - X0 );
+            addToStatistics( line1 + X0, X1 - X0 );
+        }
+        for( int X = X0 + ( X0 - x0 ) % 2; X < X1; X += 2 ) {
+            int x = ( X - x0 ) / factor;
+            row.R[x] += line0[X];
+            row.G[x] += line0[X + 1] + line1[X];
+            row.B[x] += line1[X + 1];
+            row.Count[x]++;
+        }
+    }
+}
+
+void CDebayer_RawU16_Binned::ToRgbU8( std::uint8_t* rgb, int stride, int x0, int y0, int w, int h, unsigned int* hr, unsigned int* hg, unsigned int* hb )
+{
+    CBinnedRow row( w );
+    for( int y = 0; y < h; y++ ) {
+        sumRow( row, x0, y0 + factor * y, w, true );
+        auto* dstLine = rgb + stride * y;
+        for( int x = 0; x < w; x++ ) {
+            const std::uint32_t count = row.Count[x];
+            if( count == 0 ) {
+                continue;
+            }
+            std::uint32_t r = ( row.R[x] / count ) >> scaleTo8bits;
+            std::uint32_t g = ( row.G[x] / ( 2 * count ) ) >> scaleTo8bits;
+            std::uint32_t b = ( row.B[x] / count ) >> scaleTo8bits;
+            // Actual raw image data sometimes contain pixel values exceeding expected camera bitDepth
+            r = r > UINT8_MAX ? UINT8_MAX : r;
+            g = g > UINT8_MAX ? UINT8_MAX : g;
+            b = b > UINT8_MAX ? UINT8_MAX : b;
+
+            auto* dst = dstLine + 3 * x;
+            dst[0] = r;
+            dst[1] = g;
+            dst[2] = b;
+
+            hr[r]++;
+            // Green is counted twice as in the other debayering methods
+            hg[g] += 2;
+            hb[b]++;
+        }
+    }
+}
+
+void CDebayer_RawU16_Binned::ToRgbU16( std::uint16_t* rgb, int stride, int x0, int y0, int w, int h )
+{
+    CBinnedRow row( w );
+    for( int y = 0; y < h; y++ ) {
+        sumRow( row, x0, y0 + factor * y, w, false );
+        auto* dstLine = rgb + stride * y;
+        for( int x = 0; x < w; x++ ) {
+            const std::uint32_t count = row.Count[x];
+            if( count == 0 ) {
+                continue;
+            }
+            auto* dst = dstLine + 3 * x;
+            dst[0] = row.R[x] / count;
+            dst[1] = row.G[x] / ( 2 * count );
+            dst[2] = row.B[x] / count;
+        }
+    }
+}
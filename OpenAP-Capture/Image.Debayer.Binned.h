@@ -0,0 +1,25 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include "Image.Debayer.h"
+
+// Binned preview (1/2, 1/4, 1/8 etc of the full resolution). Each output pixel averages factor x factor raw pixels
+// ((factor / 2)^2 CFA quads) in 16 bits before the conversion to 8 bits, each raw pixel is read once
+class CDebayer_RawU16_Binned : public CDebayer_RawU16 {
+public:
+    // factor is even (2 gives the same result as CDebayer_RawU16_HalfRes). x0 and y0 should be even
+    CDebayer_RawU16_Binned( const std::uint16_t* raw, int width, int height, int bitDepth, int factor );
+
+    void ToRgbU8( std::uint8_t* rgb, int stride, int x0, int y0, int w, int h, unsigned int* hr, unsigned int* hg, unsigned int* hb );
+    // Averages of the channels (green is the average of both green pixels)
+    void ToRgbU16( std::uint16_t* rgb, int stride, int x0, int y0, int w, int h );
+
+private:
+    const int factor;
+
+    // Sums of the channels for one row of output pixels
+    struct CBinnedRow;
+    void sumRow( CBinnedRow&, int x0, int Y0, int w, bool withStatistics );
+};
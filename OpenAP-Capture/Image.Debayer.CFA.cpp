@@ -12,13 +12,15 @@ void CDebayer_RawU16_CFA::ToRgbU8( std::uint8_t* rgb, int stride, int x0, int y0
         }
         const auto* srcLine = raw + width * Y;
         auto* dstLine = rgb + stride * y;
+        int X0 = std::max( x0, 0 );
+        addToStatistics( srcLine + X0, std::min( x0 + w, width ) - X0 );
         for( int x = 0; x < w; x++ ) {
             int X = x0 + x;
             if( X < 0 || X >= width ) {
                 continue;
             }
             const auto* src = srcLine + X;
-            auto v = addToStatistics( src[0] ) >> scaleTo8bits;
+            auto v = src[0] >> scaleTo8bits;
             // Actual raw image data sometimes contain pixel values exceeding expected camera bitDepth
             v = v > UINT8_MAX ? UINT8_MAX : v;
             auto* dst = dstLine + 3 * x;
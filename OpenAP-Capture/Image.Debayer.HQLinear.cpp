@@ -3,6 +3,132 @@
 
 #include "Image.Debayer.HQLinear.h"
 
+// High quality linear interpolation (Malvar, He, Cutler) of the two missing channels at an inner pixel
+static inline void interpolateAt( const std::uint16_t* src, int width, int channel, int& R, int& G, int& B )
+{
+    switch( channel ) {
+        case 0: // R
+        {
+            R = src[0];
+
+            // (0) Green at red location
+            G -= src[-width-width];
+            G += 2 * src[-width];
+            G -= src[-2];
+            G += 2 * src[-1] + 4 * src[0] + 2 * src[1];
+            G -= src[2];
+            G += 2 * src[width];
+            G -= src[width+width];
+            if( G < 0 ) G = 0;
+            G >>= 3;
+
+            // (1) Blue at red location
+            int x = 0;
+            x += src[-width-width];
+            B += 2 * ( src[-width-1] + src[-width+1] );
+            x += src[-2];
+            B += 6 * src[0];
+            x += src[2];
+            B += 2 * ( src[width-1] + src[width+1] );
+            x += src[width+width];
+            x *= 3;
+            x >>= 1;
+            B -= x;
+            if( B < 0 ) B = 0;
+            B >>= 3;
+            break;
+        }
+        case 1: // G1
+        {
+            // (3) Red at G1 location
+            R += src[-width-width] >> 1;
+            R -= src[-width-1] + src[-width+1];
+            R -= src[-2];
+            R += 4 * src[-1] + 5 * src[0] + 4 * src[1];
+            R -= src[2];
+            R -= src[width-1] + src[width+1];
+            R += src[width+width] >> 1;
+            if( R < 0 ) R = 0;
+            R >>= 3;
+
+            G = src[0];
+
+            // (4) Blue at G1 location
+            B -= src[-width-width];
+            B -= src[-width-1];
+            B += 4 * src[-width];
+            B -= src[-width+1];
+            B += ( src[-2] >> 1 ) + 5 * src[0] + ( src[2] >> 1 );
+            B -= src[width+1];
+            B += 4 * src[width];
+            B -= src[width-1];
+            B -= src[width+width];
+            if( B < 0 ) B = 0;
+            B >>= 3;
+            break;
+        }
+        case 2: // G2
+        {
+            // (4) Red at G2 location
+            R -= src[-width-width];
+            R -= src[-width-1];
+            R += 4 * src[-width];
+            R -= src[-width+1];
+            R += ( src[-2] >> 1 ) + 5 * src[0] + ( src[2] >> 1 );
+            R -= src[width+1];
+            R += 4 * src[width];
+            R -= src[width-1];
+            R -= src[width+width];
+            if( R < 0 ) R = 0;
+            R >>= 3;
+
+            G = src[0];
+
+            // (3) Blue at G2 location
+            B += src[-width-width] >> 1;
+            B -= src[-width-1] + src[-width+1];
+            B -= src[-2];
+            B += 4 * src[-1] + 5 * src[0] + 4 * src[1];
+            B -= src[2];
+            B -= src[width-1] + src[width+1];
+            B += src[width+width] >> 1;
+            if( B < 0 ) B = 0;
+            B >>= 3;
+            break;
+        }
+        case 3: // B
+        {
+            // (1) Red at blue location
+            int x = 0;
+            x += src[-width-width];
+            R += 2 * ( src[-width-1] + src[-width+1] );
+            x += src[-2];
+            R += 6 * src[0];
+            x += src[2];
+            R += 2 * ( src[width-1] + src[width+1] );
+            x += src[width+width];
+            x *= 3;
+            x >>= 1;
+            R -= x;
+            if( R < 0 ) R = 0;
+            R >>= 3;
+
+            // (0) Green at blue location
+            G -= src[-width-width];
+            G += 2 * src[-width];
+            G -= src[-2];
+            G += 2 * src[-1] + 4 * src[0] + 2 * src[1];
+            G -= src[2];
+            G += 2 * src[width];
+            G -= src[width+width];
+            if( G < 0 ) G = 0;
+            G >>= 3;
+
+            B = src[0];
+        }
+    }
+}
+
 void CDebayer_RawU16_HQLinear::ToRgbU16( std::uint16_t* rgb, int stride, int x0, int y0, int w, int h )
 {
     for( int y = 0; y < h; y++ ) {
@@ -32,127 +158,7 @@ void CDebayer_RawU16_HQLinear::ToRgbU16( std::uint16_t* rgb, int stride, int x0,
                     case 3: B = src[0]; break;
                 }
             } else {
-                switch( channel ) {
-                    case 0: // R
-                    {
-                        R = src[0];
-
-                        // (0) Green at red location
-                        G -= src[-width-width];
-                        G += 2 * src[-width];
-                        G -= src[-2];
-                        G += 2 * src[-1] + 4 * src[0] + 2 * src[1];
-                        G -= src[2];
-                        G += 2 * src[width];
-                        G -= src[width+width];
-                        if( G < 0 ) G = 0;
-                        G >>= 3;
-
-                        // (1) Blue at red location
-                        int x = 0;
-                        x += src[-width-width];
-                        B += 2 * ( src[-width-1] + src[-width+1] );
-                        x += src[-2];
-                        B += 6 * src[0];
-                        x += src[2];
-                        B += 2 * ( src[width-1] + src[width+1] );
-                        x += src[width+width];
-                        x *= 3;
-                        x >>= 1;
-                        B -= x;
-                        if( B < 0 ) B = 0;
-                        B >>= 3;
-                        break;
-                    }
-                    case 1: // G1
-                    {
-                        // (3) Red at G1 location
-                        R += src[-width-width] >> 1;
-                        R -= src[-width-1] + src[-width+1];
-                        R -= src[-2];
-                        R += 4 * src[-1] + 5 * src[0] + 4 * src[1];
-                        R -= src[2];
-                        R -= src[width-1] + src[width+1];
-                        R += src[width+width] >> 1;
-                        if( R < 0 ) R = 0;
-                        R >>= 3;
-
-                        G = src[0];
-
-                        // (4) Blue at G1 location
-                        B -= src[-width-width];
-                        B -= src[-width-1];
-                        B += 4 * src[-width];
-                        B -= src[-width+1];
-                        B += ( src[-2] >> 1 ) + 5 * src[0] + ( src[2] >> 1 );
-                        B -= src[width+1];
-                        B += 4 * src[width];
-                        B -= src[width-1];
-                        B -= src[width+width];
-                        if( B < 0 ) B = 0;
-                        B >>= 3;
-                        break;
-                    }
-                    case 2: // G2
-                    {
-                        // (4) Red at G2 location
-                        R -= src[-width-width];
-                        R -= src[-width-1];
-                        R += 4 * src[-width];
-                        R -= src[-width+1];
-                        R += ( src[-2] >> 1 ) + 5 * src[0] + ( src[2] >> 1 );
-                        R -= src[width+1];
-                        R += 4 * src[width];
-                        R -= src[width-1];
-                        R -= src[width+width];
-                        if( R < 0 ) R = 0;
-                        R >>= 3;
-
-                        G = src[0];
-
-                        // (3) Blue at G2 location
-                        B += src[-width-width] >> 1;
-                        B -= src[-width-1] + src[-width+1];
-                        B -= src[-2];
-                        B += 4 * src[-1] + 5 * src[0] + 4 * src[1];
-                        B -= src[2];
-                        B -= src[width-1] + src[width+1];
-                        B += src[width+width] >> 1;
-                        if( B < 0 ) B = 0;
-                        B >>= 3;
-                        break;
-                    }
-                    case 3: // B
-                    {
-                        // (1) Red at blue location
-                        int x = 0;
-                        x += src[-width-width];
-                        R += 2 * ( src[-width-1] + src[-width+1] );
-                        x += src[-2];
-                        R += 6 * src[0];
-                        x += src[2];
-                        R += 2 * ( src[width-1] + src[width+1] );
-                        x += src[width+width];
-                        x *= 3;
-                        x >>= 1;
-                        R -= x;
-                        if( R < 0 ) R = 0;
-                        R >>= 3;
-
-                        // (0) Green at blue location
-                        G -= src[-width-width];
-                        G += 2 * src[-width];
-                        G -= src[-2];
-                        G += 2 * src[-1] + 4 * src[0] + 2 * src[1];
-                        G -= src[2];
-                        G += 2 * src[width];
-                        G -= src[width+width];
-                        if( G < 0 ) G = 0;
-                        G >>= 3;
-
-                        B = src[0];
-                    }
-                }
+                interpolateAt( src, width, channel, R, G, B );
             }
 
             auto* dst = dstLine + 3 * x;
@@ -164,6 +170,39 @@ void CDebayer_RawU16_HQLinear::ToRgbU16( std::uint16_t* rgb, int stride, int x0,
     }
 }
 
+void CDebayer_RawU16_HQLinear::ToGrayU16( std::uint16_t* gray, int stride, int x0, int y0, int w, int h )
+{
+    for( int y = 0; y < h; y++ ) {
+        int Y = y + y0;
+        if( Y < 0 || Y >= height ) {
+            continue;
+        }
+        const auto* srcLine = raw +  width * Y;
+        auto* dstLine = gray + stride * y;
+        for( int x = 0; x < w; x++ ) {
+            int X = x + x0;
+            if( X < 0 || X >= width ) {
+                continue;
+            }
+
+            const auto* src = srcLine + X;
+            if( Y < 2 || Y >= height - 2 || X < 2 || X >= width - 2 ) {
+                // Only one channel is known on the border (the other two are zeroes as in ToRgbU16)
+                dstLine[x] = src[0];
+                continue;
+            }
+
+            int R = 0;
+            int G = 0;
+            int B = 0;
+            interpolateAt( src, width, CFA_CHANNEL_AT( X, Y ), R, G, B );
+
+            // Same clipping as in ToRgbU16 followed by the sum of channels (no intermediate RGB image)
+            dstLine[x] = ( R > UINT16_MAX ? UINT16_MAX : R ) + ( G > UINT16_MAX ? UINT16_MAX : G ) + ( B > UINT16_MAX ? UINT16_MAX : B );
+        }
+    }
+}
+
 void CDebayer_RawU16_HQLinear::ToRgbU8( std::uint8_t* rgb, int stride, int x0, int y0, int w, int h, unsigned int* hr, unsigned int* hg, unsigned int* hb )
 {
     for( int y = 0; y < h; y++ ) {
@@ -173,6 +212,8 @@ void CDebayer_RawU16_HQLinear::ToRgbU8( std::uint8_t* rgb, int stride, int x0, i
         }
         const auto* srcLine = raw +  width * Y;
         auto* dstLine = rgb + stride * y;
+        int X0 = std::max( x0, 0 );
+        addToStatistics( srcLine + X0, std::min( x0 + w, width ) - X0 );
         for( int x = 0; x < w; x++ ) {
             int X = x + x0;
             if( X < 0 || X >= width ) {
@@ -187,16 +228,16 @@ void CDebayer_RawU16_HQLinear::ToRgbU8( std::uint8_t* rgb, int stride, int x0, i
             int channel = CFA_CHANNEL_AT(X, Y);
             if( Y < 2 || Y >= height - 2 || X < 2 || X >= width - 2 ) {
                 switch( channel ) {
-                    case 0: R = addToStatistics( src[0] ) >> scaleTo8bits; break;
-                    case 1: G = addToStatistics( src[0] ) >> scaleTo8bits; break;
-                    case 2: G = addToStatistics( src[0] ) >> scaleTo8bits; break;
-                    case 3: B = addToStatistics( src[0] ) >> scaleTo8bits; break;
+                    case 0: R = src[0] >> scaleTo8bits; break;
+                    case 1: G = src[0] >> scaleTo8bits; break;
+                    case 2: G = src[0] >> scaleTo8bits; break;
+                    case 3: B = src[0] >> scaleTo8bits; break;
                 }
             } else {
                 switch( channel ) {
                     case 0: // R
                     {
-                        R = addToStatistics( src[0] ) >> scaleTo8bits;
+                        R = src[0] >> scaleTo8bits;
                         hr[R]++;
 
                         // (0) Green at red location
@@ -239,7 +280,7 @@ void CDebayer_RawU16_HQLinear::ToRgbU8( std::uint8_t* rgb, int stride, int x0, i
                         if( R < 0 ) R = 0;
                         R >>= 3 + scaleTo8bits;
 
-                        G = addToStatistics( src[0] ) >> scaleTo8bits;
+                        G = src[0] >> scaleTo8bits;
                         hg[G]++;
 
                         // (4) Blue at G1 location
@@ -271,7 +312,7 @@ void CDebayer_RawU16_HQLinear::ToRgbU8( std::uint8_t* rgb, int stride, int x0, i
                         if( R < 0 ) R = 0;
                         R >>= 3 + scaleTo8bits;
 
-                        G = addToStatistics( src[0] ) >> scaleTo8bits;
+                        G = src[0] >> scaleTo8bits;
                         hg[G]++;
 
                         // (3) Blue at G2 location
@@ -314,7 +355,7 @@ void CDebayer_RawU16_HQLinear::ToRgbU8( std::uint8_t* rgb, int stride, int x0, i
                         if( G < 0 ) G = 0;
                         G >>= 3 + scaleTo8bits;
 
-                        B = addToStatistics( src[0] ) >> scaleTo8bits;
+                        B = src[0] >> scaleTo8bits;
                         hb[B]++;
                         break;
                     }
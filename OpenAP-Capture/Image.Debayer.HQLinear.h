@@ -10,5 +10,7 @@ public:
     using CDebayer_RawU16::CDebayer_RawU16;
 
     void ToRgbU16( std::uint16_t* rgb, int stride, int x0, int y0, int w, int h );
+    // Luminance (sum of interpolated channels) in one pass without an intermediate RGB image
+    void ToGrayU16( std::uint16_t* gray, int stride, int x0, int y0, int w, int h );
     void ToRgbU8( std::uint8_t* rgb, int stride, int x0, int y0, int w, int h, unsigned int* hr, unsigned int* hg, unsigned int* hb );
 };
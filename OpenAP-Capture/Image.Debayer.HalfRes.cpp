@@ -12,16 +12,22 @@ void CDebayer_RawU16_HalfRes::ToRgbU8( std::uint8_t* rgb, int stride, int x0, in
         }
         const auto* srcLine = raw + width * Y;
         auto* dstLine = rgb + stride * y;
+        int X0 = std::max( x0, 0 );
+        int X1 = std::min( x0 + 2 * w, width );
+        addToStatistics( srcLine + X0, X1 - X0 );
+        if( Y + 1 < height ) {
+            addToStatistics( srcLine + width + X0, X1 - X0 );
+        }
         for( int x = 0; x < w; x++ ) {
             int X = 2 * x + x0;
             if( X < 0 || X >= width ) {
                 continue;
             }
             const auto* src = srcLine + X;
-            auto r = addToStatistics( src[0] ) >> scaleTo8bits;
-            auto g1 = addToStatistics( src[1] ) >> scaleTo8bits;
-            auto g2 = addToStatistics( src[width] ) >> scaleTo8bits;
-            auto b = addToStatistics( src[width + 1] ) >> scaleTo8bits;
+            auto r = src[0] >> scaleTo8bits;
+            auto g1 = src[1] >> scaleTo8bits;
+            auto g2 = src[width] >> scaleTo8bits;
+            auto b = src[width + 1] >> scaleTo8bits;
 
             auto* dst = dstLine + 3 * x;
             // Actual raw image data sometimes contain pixel values exceeding expected camera bitDepth
@@ -36,3 +42,24 @@ void CDebayer_RawU16_HalfRes::ToRgbU8( std::uint8_t* rgb, int stride, int x0, in
         }
     }
 }
+
+void CDebayer_RawU16_HalfRes::ToGrayU16( std::uint16_t* gray, int stride, int x0, int y0, int w, int h )
+{
+    for( int y = 0; y < h; y++ ) {
+        int Y = 2 * y + y0;
+        if( Y < 0 || Y + 1 >= height ) {
+            continue;
+        }
+        const auto* srcLine = raw + width * Y;
+        auto* dstLine = gray + stride * y;
+        for( int x = 0; x < w; x++ ) {
+            int X = 2 * x + x0;
+            if( X < 0 || X + 1 >= width ) {
+                continue;
+            }
+            const auto* src = srcLine + X;
+            unsigned int v = src[0] + ( ( src[1] + src[width] ) >> 1 ) + src[width + 1];
+            dstLine[x] = v > UINT16_MAX ? UINT16_MAX : v;
+        }
+    }
+}
@@ -10,4 +10,6 @@ public:
     using CDebayer_RawU16::CDebayer_RawU16;
 
     void ToRgbU8( std::uint8_t* rgb, int stride, int x0, int y0, int w, int h, unsigned int* hr, unsigned int* hg, unsigned int* hb );
+    // Superpixel luminance (r + (g1 + g2) / 2 + b) of each 2x2 CFA quad
+    void ToGrayU16( std::uint16_t* gray, int stride, int x0, int y0, int w, int h );
 };
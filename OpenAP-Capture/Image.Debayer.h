@@ -4,6 +4,7 @@
 #pragma once
 
 #include <cstdint>
+#include <algorithm>
 
 class CDebayer_RawU16 {
 public:
@@ -23,28 +24,40 @@ protected:
     const int height;
     const int scaleTo8bits;
 
-    // Fast statistics (calculated for each pixel on each frame)
-    std::uint16_t addToStatistics( std::uint16_t value );
+    // Fast statistics (calculated for each pixel on each frame). Called once per row (or block of pixels)
+    // outside of the debayering loops, so that both the reduction and the loops stay branch-free
+    void addToStatistics( const std::uint16_t* values, int count );
 };
 
-inline std::uint16_t CDebayer_RawU16::addToStatistics( std::uint16_t value )
+inline void CDebayer_RawU16::addToStatistics( const std::uint16_t* values, int count )
 {
-    if( value >= MaxValue ) {
-        if( value == MaxValue ) {
-            MaxCount++;
-        } else {
-            MaxValue = value;
-            MaxCount = 1;
+    if( count <= 0 ) {
+        return;
+    }
+    // Min/max reduction of the block (vectorized by the compiler)
+    std::uint16_t maxValue = 0;
+    std::uint16_t minValue = UINT16_MAX;
+    for( int i = 0; i < count; i++ ) {
+        maxValue = std::max( maxValue, values[i] );
+        minValue = std::min( minValue, values[i] );
+    }
+    // Counting is only needed when the block reaches the current extremes
+    if( maxValue >= MaxValue ) {
+        unsigned int n = 0;
+        for( int i = 0; i < count; i++ ) {
+            n += values[i] == maxValue;
         }
-    } else if( value <= MinValue ) {
-        if( value == MinValue ) {
-            MinCount++;
-        } else {
-            MinValue = value;
-            MinCount = 1;
+        MaxCount = maxValue == MaxValue ? MaxCount + n : n;
+        MaxValue = maxValue;
+    }
+    if( minValue <= MinValue ) {
+        unsigned int n = 0;
+        for( int i = 0; i < count; i++ ) {
+            n += values[i] == minValue;
         }
+        MinCount = minValue == MinValue ? MinCount + n : n;
+        MinValue = minValue;
     }
-    return value;
 }
 
 #define CFA_CHANNEL_AT( x, y ) ( x % 2 | y % 2 << 1 )
@@ -0,0 +1,244 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Image.Labeling.h"
+
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
+
+#include <algorithm>
+#include <cassert>
+
+// The same threshold for all pixels
+struct CConstantThreshold {
+    int Threshold;
+
+    const CConstantThreshold& Row( int ) const { return *this; }
+    int operator [] ( int ) const { return Threshold; }
+};
+
+// Threshold of each pixel
+struct CThresholdMap {
+    const CGrayU16Image* Map;
+
+    const unsigned short* Row( int y ) const { return Map->ScanLine( y ); }
+};
+
+void CComponentLabeling::Label( const CGrayU16Image* image, int threshold, int x, int y, int width, int height )
+{
+    label( image, CConstantThreshold { threshold }, x, y, width, height );
+}
+
+void CComponentLabeling::Label( const CGrayImage* image, int threshold, int x, int y, int width, int height )
+{
+    label( image, CConstantThreshold { threshold }, x, y, width, height );
+}
+
+void CComponentLabeling::Label( const CGrayU16Image* image, const CGrayU16Image* thresholds, int x, int y, int width, int height )
+{
+    assert( thresholds->Width() == image->Width() && thresholds->Height() == image->Height() );
+    label( image, CThresholdMap { thresholds }, x, y, width, height );
+}
+
+template<typename T, typename TThreshold>
+void CComponentLabeling::label( const CPixelBuffer<T, 1>* image, const TThreshold& threshold, int x, int y, int width, int height )
+{
+    x0 = std::max( 0, x );
+    y0 = std::max( 0, y );
+    const int x1 = std::min( image->Width(), x + width );
+    const int y1 = std::min( image->Height(), y + height );
+    this->height = std::max( 0, y1 - y0 );
+
+    const int numberOfBands = isParallel ? std::min( QThread::idealThreadCount(), this->height / MinBandHeight ) : 1;
+    if( numberOfBands <= 1 ) {
+        collectRuns( image, threshold, x0, x1, y0, y1, runs, parent, rowRuns );
+        resolve();
+        return;
+    }
+
+    // Bands of rows are labeled on worker threads independently
+    std::vector<CBand> bands( numberOfBands );
+    for( int i = 0; i < numberOfBands; i++ ) {
+        bands[i].Y0 = y0 + this->height * i / numberOfBands;
+        bands[i].Y1 = y0 + this->height * ( i + 1 ) / numberOfBands;
+    }
+    QtConcurrent::blockingMap( bands, [&]( CBand& band ) {
+        collectRuns( image, threshold, x0, x1, band.Y0, band.Y1, band.Runs, band.Parent, band.RowRuns );
+    } );
+
+    // Bands are joined in order, so labels stay in scan order. Then components crossing the seams are merged
+    runs.clear();
+    parent.clear();
+    rowRuns.clear();
+    for( auto& band : bands ) {
+        const int runOffset = static_cast<int>( runs.size() );
+        const int labelOffset = static_cast<int>( parent.size() );
+        for( auto& run : band.Runs ) {
+            run.Label += labelOffset;
+        }
+        for( auto& p : band.Parent ) {
+            p += labelOffset;
+        }
+        for( size_t i = 0; i + 1 < band.RowRuns.size(); i++ ) {
+            rowRuns.push_back( band.RowRuns[i] + runOffset );
+        }
+        runs.insert( runs.end(), band.Runs.begin(), band.Runs.end() );
+        parent.insert( parent.end(), band.Parent.begin(), band.Parent.end() );
+    }
+    rowRuns.push_back( static_cast<int>( runs.size() ) );
+    for( int i = 1; i < numberOfBands; i++ ) {
+        // The last row of the previous band and the first row of this band
+        const int row = bands[i].Y0 - y0;
+        mergeRows( runs, parent, rowRuns[row - 1], rowRuns[row], rowRuns[row], rowRuns[row + 1] );
+    }
+
+    resolve();
+}
+
+template<typename T, typename TThreshold>
+void CComponentLabeling::collectRuns( const CPixelBuffer<T, 1>* image, const TThreshold& threshold, int x0, int x1, int y0, int y1,
+    std::vector<CRun>& runs, std::vector<int>& parent, std::vector<int>& rowRuns )
+{
+    runs.clear();
+    parent.clear();
+    rowRuns.assign( y1 - y0 + 1, 0 );
+
+    for( int Y = y0; Y < y1; Y++ ) {
+        const T* src = image->ScanLine( Y );
+        const auto& t = threshold.Row( Y );
+        rowRuns[Y - y0] = static_cast<int>( runs.size() );
+        int X = x0;
+        while( X < x1 ) {
+            if( src[X] < t[X] ) {
+                X++;
+                continue;
+            }
+            CRun run = { Y, X, X, static_cast<int>( parent.size() ), 0, 0, X, 0 };
+            for( ; X < x1 && src[X] >= t[X]; X++ ) {
+                int v = src[X];
+                run.Flux += v;
+                if( v >= run.Peak ) {
+                    if( v > run.Peak ) {
+                        run.Peak = v;
+                        run.PeakX = X;
+                        run.PeakCount = 1;
+                    } else {
+                        run.PeakCount++;
+                    }
+                }
+            }
+            run.X1 = X;
+            parent.push_back( run.Label );
+            runs.push_back( run );
+        }
+        if( Y > y0 ) {
+            mergeRows( runs, parent, rowRuns[Y - y0 - 1], rowRuns[Y - y0], rowRuns[Y - y0], static_cast<int>( runs.size() ) );
+        }
+    }
+    rowRuns[y1 - y0] = static_cast<int>( runs.size() );
+}
+
+void CComponentLabeling::mergeRows( const std::vector<CRun>& runs, std::vector<int>& parent, int prevBegin, int prevEnd, int begin, int end )
+{
+    int prev = prevBegin;
+    for( int i = begin; i < end; i++ ) {
+        const CRun& run = runs[i];
+        // Runs of the previous row touching this one (diagonal neighbours included)
+        while( prev < prevEnd && runs[prev].X1 < run.X0 ) {
+            prev++;
+        }
+        for( int j = prev; j < prevEnd && runs[j].X0 <= run.X1; j++ ) {
+            merge( parent, runs[j].Label, run.Label );
+        }
+        // The last touching run may touch the next run of this row as well
+        while( prev < prevEnd && runs[prev].X1 <= run.X1 ) {
+            prev++;
+        }
+    }
+}
+
+int CComponentLabeling::find( std::vector<int>& parent, int label )
+{
+    while( parent[label] != label ) {
+        // Path halving
+        parent[label] = parent[parent[label]];
+        label = parent[label];
+    }
+    return label;
+}
+
+void CComponentLabeling::merge( std::vector<int>& parent, int label1, int label2 )
+{
+    label1 = find( parent, label1 );
+    label2 = find( parent, label2 );
+    // The older label is the root, so that components keep the scan order of their first pixel
+    if( label1 < label2 ) {
+        parent[label2] = label1;
+    } else if( label2 < label1 ) {
+        parent[label1] = label2;
+    }
+}
+
+void CComponentLabeling::resolve()
+{
+    // Roots become component indices (labels are in scan order, so are the roots)
+    std::vector<int>& componentOf = parent;
+    int count = 0;
+    for( int i = 0; i < static_cast<int>( parent.size() ); i++ ) {
+        // Parents are always older, so they are already resolved
+        componentOf[i] = parent[i] == i ? -1 - count++ : componentOf[parent[i]];
+    }
+    for( auto& c : componentOf ) {
+        c = c < 0 ? -1 - c : c;
+    }
+
+    components.assign( count, CConnectedComponent() );
+    componentRuns.assign( count + 1, 0 );
+    std::vector<bool> isStarted( count, false );
+    for( auto& run : runs ) {
+        run.Label = componentOf[run.Label];
+        CConnectedComponent& c = components[run.Label];
+        componentRuns[run.Label + 1]++;
+        if( not isStarted[run.Label] ) {
+            isStarted[run.Label] = true;
+            c.MinX = run.X0;
+            c.MaxX = run.X1 - 1;
+            c.MinY = run.Y;
+            c.Peak = -1;
+        }
+        c.Area += run.X1 - run.X0;
+        c.Flux += run.Flux;
+        c.MinX = std::min( c.MinX, run.X0 );
+        c.MaxX = std::max( c.MaxX, run.X1 - 1 );
+        c.MaxY = run.Y;
+        if( run.Peak > c.Peak ) {
+            c.Peak = run.Peak;
+            c.PeakX = run.PeakX;
+            c.PeakY = run.Y;
+            c.PeakCount = run.PeakCount;
+        } else if( run.Peak == c.Peak ) {
+            c.PeakCount += run.PeakCount;
+        }
+    }
+
+    // Runs grouped by component (counting sort, runs of a component stay in scan order)
+    for( int i = 0; i < count; i++ ) {
+        componentRuns[i + 1] += componentRuns[i];
+    }
+    runOrder.resize( runs.size() );
+    std::vector<int> next( componentRuns.begin(), componentRuns.end() - 1 );
+    for( int i = 0; i < static_cast<int>( runs.size() ); i++ ) {
+        runOrder[next[runs[i].Label]++] = i;
+    }
+}
+
+int CComponentLabeling::ComponentAt( int x, int y ) const
+{
+    if( y < y0 || y >= y0 + height ) {
+        return -1;
+    }
+    auto begin = runs.begin() + rowRuns[y - y0];
+    auto end = runs.begin() + rowRuns[y - y0 + 1];
+    auto run = std::upper_bound( begin, end, x, []( int x, const CRun& run ) { return x < run.X1; } );
+    return run != end && run->X0 <= x ? run->Label : -1;
+}
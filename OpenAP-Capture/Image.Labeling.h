@@ -0,0 +1,101 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <Image.Image.h>
+
+#include <vector>
+
+// 8-connected component of pixels at or above the threshold
+struct CConnectedComponent {
+    int Area = 0;
+    unsigned long long Flux = 0; // Sum of pixel values
+    int Peak = 0;
+    int PeakX = 0; // The first pixel with the peak value (in scan order)
+    int PeakY = 0;
+    int PeakCount = 0; // Number of pixels with the peak value
+    int MinX = 0; // Bounding box (inclusive)
+    int MinY = 0;
+    int MaxX = 0;
+    int MaxY = 0;
+};
+
+// Run-length connected component labeling. Pixels at or above the threshold are collected into horizontal runs
+// row by row, runs are merged with overlapping runs of the previous row using union-find. A second pass over
+// the runs (not pixels) resolves components and accumulates their statistics. Linear in the number of pixels,
+// memory is proportional to the number of runs, buffers are reused between calls.
+// Large images are split into bands of rows labeled on worker threads, components crossing the seams are merged
+// afterwards. The result is the same as labeling on one thread
+class CComponentLabeling {
+public:
+    // Bands are at least this high
+    static const int MinBandHeight = 128;
+    void SetParallel( bool _isParallel ) { isParallel = _isParallel; }
+
+    // Labels the rect (clipped to the image). Components are in scan order of their first pixel
+    void Label( const CGrayU16Image*, int threshold, int x, int y, int width, int height );
+    void Label( const CGrayImage*, int threshold, int x, int y, int width, int height );
+    void Label( const CGrayU16Image* image, int threshold ) { Label( image, threshold, 0, 0, image->Width(), image->Height() ); }
+    // Threshold of each pixel is taken from the map of the image size (e.g. local background plus k sigma)
+    void Label( const CGrayU16Image*, const CGrayU16Image* thresholds, int x, int y, int width, int height );
+    void Label( const CGrayU16Image* image, const CGrayU16Image* thresholds ) { Label( image, thresholds, 0, 0, image->Width(), image->Height() ); }
+
+    const std::vector<CConnectedComponent>& Components() const { return components; }
+    // Component containing the pixel (-1 when the pixel is below the threshold or outside of the labeled rect)
+    int ComponentAt( int x, int y ) const;
+
+    // Calls f( x, y ) for each pixel of the component
+    template<typename F>
+    void ForEachPixel( int component, F f ) const
+    {
+        for( int i = componentRuns[component]; i < componentRuns[component + 1]; i++ ) {
+            const CRun& run = runs[runOrder[i]];
+            for( int x = run.X0; x < run.X1; x++ ) {
+                f( x, run.Y );
+            }
+        }
+    }
+
+private:
+    struct CRun {
+        int Y;
+        int X0;
+        int X1; // Exclusive
+        int Label; // Union-find node, the component index after labeling
+        unsigned long long Flux;
+        int Peak;
+        int PeakX;
+        int PeakCount;
+    };
+
+    struct CBand {
+        int Y0;
+        int Y1;
+        std::vector<CRun> Runs;
+        std::vector<int> Parent;
+        std::vector<int> RowRuns;
+    };
+
+    bool isParallel = true;
+    int x0 = 0;
+    int y0 = 0;
+    int height = 0;
+    std::vector<CRun> runs;
+    std::vector<int> rowRuns; // Index of the first run of each row (and the end)
+    std::vector<int> parent;
+    std::vector<CConnectedComponent> components;
+    // Runs of each component
+    std::vector<int> componentRuns;
+    std::vector<int> runOrder;
+
+    template<typename T, typename TThreshold>
+    void label( const CPixelBuffer<T, 1>*, const TThreshold&, int x, int y, int width, int height );
+    template<typename T, typename TThreshold>
+    static void collectRuns( const CPixelBuffer<T, 1>*, const TThreshold&, int x0, int x1, int y0, int y1,
+        std::vector<CRun>& runs, std::vector<int>& parent, std::vector<int>& rowRuns );
+    static void mergeRows( const std::vector<CRun>& runs, std::vector<int>& parent, int prevBegin, int prevEnd, int begin, int end );
+    static int find( std::vector<int>& parent, int label );
+    static void merge( std::vector<int>& parent, int label1, int label2 );
+    void resolve();
+};
@@ -4,13 +4,22 @@
 #include "Image.Math.Advanced.h"
 
 #include <Image.Debayer.HQLinear.h>
+#include <Image.Debayer.HalfRes.h>
+#include <Image.Debayer.Binned.h>
+#include <Image.Labeling.h>
+#include <Image.StarMatcher.h>
 
 #include <Math.Geometry.h>
 #include <Math.LinearAlgebra.h>
+#include <Math.Ransac.h>
 
 #include <QDebug>
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
 
 #include <cmath>
+#include <cassert>
+#include <random>
 #include <stack>
 #include <algorithm>
 
@@ -88,9 +97,46 @@ std::shared_ptr<CRgbU16Image> CRawU16::DebayerRect( int x, int y, int w, int h )
     return result;
 }
 
-std::shared_ptr<CGrayU16Image> CRawU16::GrayU16( int x, int y, int width, int height ) const
+std::shared_ptr<CGrayU16Image> CRawU16::GrayU16( int x, int y, int w, int h ) const
 {
-    return ToGrayU16( DebayerRect( x, y, width, height ).get() );
+    auto result = std::make_shared<CGrayU16Image>( w, h );
+    // Large rects are debayered in bands of rows on worker threads
+    const int numberOfBands = std::min( QThread::idealThreadCount(), h / 128 );
+    if( numberOfBands <= 1 ) {
+        CDebayer_RawU16_HQLinear debayer( raw, width, height, bitDepth );
+        debayer.ToGrayU16( result->ScanLine( 0 ), result->Stride(), x, y, w, h );
+        return result;
+    }
+    std::vector<std::pair<int, int>> bands;
+    for( int i = 0; i < numberOfBands; i++ ) {
+        bands.emplace_back( h * i / numberOfBands, h * ( i + 1 ) / numberOfBands );
+    }
+    QtConcurrent::blockingMap( bands, [&]( const std::pair<int, int>& band ) {
+        CDebayer_RawU16_HQLinear debayer( raw, width, height, bitDepth );
+        debayer.ToGrayU16( result->ScanLine( band.first ), result->Stride(), x, y + band.first, w, band.second - band.first );
+    } );
+    return result;
+}
+
+std::shared_ptr<CGrayU16Image> CRawU16::GrayU16HalfRes( int x, int y, int w, int h ) const
+{
+    auto result = std::make_shared<CGrayU16Image>( w / 2, h / 2 );
+    // Large rects are converted in bands of rows on worker threads
+    const int numberOfBands = std::min( QThread::idealThreadCount(), h / 2 / 128 );
+    if( numberOfBands <= 1 ) {
+        CDebayer_RawU16_HalfRes debayer( raw, width, height, bitDepth );
+        debayer.ToGrayU16( result->ScanLine( 0 ), result->Stride(), x, y, w / 2, h / 2 );
+        return result;
+    }
+    std::vector<std::pair<int, int>> bands;
+    for( int i = 0; i < numberOfBands; i++ ) {
+        bands.emplace_back( h / 2 * i / numberOfBands, h / 2 * ( i + 1 ) / numberOfBands );
+    }
+    QtConcurrent::blockingMap( bands, [&]( const std::pair<int, int>& band ) {
+        CDebayer_RawU16_HalfRes debayer( raw, width, height, bitDepth );
+        debayer.ToGrayU16( result->ScanLine( band.first ), result->Stride(), x, y + 2 * band.first, w / 2, band.second - band.first );
+    } );
+    return result;
 }
 
 CPixelStatistics CRawU16::CalculateStatistics( int x0, int y0, int W, int H ) const
@@ -141,68 +187,245 @@ CPixelStatistics CRawU16::CalculateStatistics( int x0, int y0, int W, int H ) co
     return stats;
 }
 
-std::shared_ptr<CRgbImage> CRawU16::Stretch( int x0, int y0, int W, int H ) const
+static CStretchParams stretchParams( const CPixelStatistics& stats )
 {
-    CPixelStatistics stats = CalculateStatistics( x0, y0, W, H );
+    CStretchParams params;
+    params.R = stats.stat( 0 );
+    params.G = stats.stat( 1, 2);
+    params.B = stats.stat( 2 );
 
-    const uint maxValue = ~(~0u << bitDepth) - 1;
+    params.R.Sigma = std::max( 1u, params.R.Sigma );
+    params.G.Sigma = std::max( 1u, params.G.Sigma );
+    params.B.Sigma = std::max( 1u, params.B.Sigma );
 
-    CChannelStat sR = stats.stat( 0 );
-    CChannelStat sG = stats.stat( 1, 2);
-    CChannelStat sB = stats.stat( 2 );
+    return params;
+}
 
-    sR.Sigma = std::max( 1u, sR.Sigma );
-    sG.Sigma = std::max( 1u, sG.Sigma );
-    sB.Sigma = std::max( 1u, sB.Sigma );
+CStretchEstimate CRawU16::EstimateStretchParams( int x0, int y0, int W, int H, TSamplingMode mode, int sampleCount ) const
+{
+    CStretchEstimate estimate;
 
-    auto rgb16 = DebayerRect( x0, y0, W, H );
+    // The same quads as in CalculateStatistics
+    int cx = x0 + W / 2;
+    int cy = y0 + H / 2;
+    int X0 = cx - W;
+    int Y0 = cy - H;
+    X0 += X0 % 2;
+    Y0 += Y0 % 2;
+    const int qx0 = std::max( 0, -X0 / 2 );
+    const int qy0 = std::max( 0, -Y0 / 2 );
+    const int qx1 = std::min( W, ( width - X0 ) / 2 );
+    const int qy1 = std::min( H, ( height - Y0 ) / 2 );
+    const int quads = qx1 > qx0 && qy1 > qy0 ? ( qx1 - qx0 ) * ( qy1 - qy0 ) : 0;
+
+    if( mode == SM_Exact || quads <= sampleCount ) {
+        CPixelStatistics stats = CalculateStatistics( x0, y0, W, H );
+        estimate.Params = stretchParams( stats );
+        estimate.SampleCount = stats.totalCount();
+        estimate.IsExact = true;
+        return estimate;
+    }
 
-    auto result = std::make_shared<CRgbImage>( W, H );
-    for( int y = 0; y < H; y++ ) {
-        const ushort* srcLine = rgb16->ScanLine( y );
-        uchar* dstLine = result->ScanLine( y );
-        for( int x = 0; x < W; x++ ) {
-            const ushort* src = srcLine + 3 * x;
-            uchar* dst = dstLine + 3 * x;
+    CPixelStatistics stats( 3, bitDepth );
 
-            uint r = src[0];
-            uint g = src[1];
-            uint b = src[2];
+    auto& histR = stats[0];
+    auto& histG = stats[1];
+    auto& histB = stats[2];
 
-            if( r >= maxValue || g >= maxValue || b >= maxValue ) {
-                dst[0] = 0xFF;
-                dst[1] = 0x00;
-                dst[2] = 0x80;
-            } else {
-                const int k = 12;
-                dst[0] = r <= ( sR.Median + k * sR.Sigma ) ? ( r < sR.Median ? 0 : ( 255 * ( r - sR.Median ) / k / sR.Sigma ) ) : 255;
-                dst[1] = g <= ( sG.Median + k * sG.Sigma ) ? ( g < sG.Median ? 0 : ( 255 * ( g - sG.Median ) / k / sG.Sigma ) ) : 255;
-                dst[2] = b <= ( sB.Median + k * sB.Sigma ) ? ( b < sB.Median ? 0 : ( 255 * ( b - sB.Median ) / k / sB.Sigma ) ) : 255;
+    int count = 0;
+    auto addQuad = [&]( int x, int y ) {
+        const ushort* src = raw + width * ( 2 * y + Y0 ) + 2 * x + X0;
+        histR[src[0]]++;
+        histG[src[1]]++;
+        histG[src[width]]++;
+        histB[src[width + 1]]++;
+        count++;
+    };
+
+    if( mode == SM_Strided ) {
+        // Every stride-th quad in every stride-th row of quads. Rows are shifted, so that columns are not sampled repeatedly
+        const int stride = std::max( 2, (int)std::sqrt( double( quads ) / sampleCount ) );
+        for( int y = qy0, row = 0; y < qy1; y += stride, row++ ) {
+            for( int x = qx0 + ( 7 * row ) % stride; x < qx1; x += stride ) {
+                addQuad( x, y );
+            }
+        }
+    } else {
+        assert( mode == SM_Random );
+        // Fixed seed, the same frame gives the same estimate
+        std::minstd_rand random( 1 );
+        std::uniform_int_distribution<int> randomX( qx0, qx1 - 1 );
+        std::uniform_int_distribution<int> randomY( qy0, qy1 - 1 );
+        for( int i = 0; i < sampleCount; i++ ) {
+            int x = randomX( random );
+            int y = randomY( random );
+            addQuad( x, y );
+        }
+    }
+
+    stats.setCount( count );
+
+    estimate.Params = stretchParams( stats );
+    estimate.SampleCount = count;
+    estimate.IsExact = false;
+
+    // Errors measured against exact statistics on synthetic 3008x2008 frames (flat and gradient background, with and
+    // without stars, 12 and 16 bit). RMS error of the median is 1.1-1.3 sigma / sqrt(n) and of the sigma 1.4-1.6
+    // sigma / sqrt(n) for n quads, the two green pixels of a quad do not make the green estimate better. Both are
+    // whole ADU, which adds about 0.6 ADU RMS (up to 1 ADU) and dominates for 12 bit frames
+    const CChannelStat* channels[3] = { &estimate.Params.R, &estimate.Params.G, &estimate.Params.B };
+    for( int i = 0; i < 3; i++ ) {
+        const double n = count;
+        estimate.MedianError[i] = std::hypot( 1.25 * channels[i]->Sigma / std::sqrt( n ), 0.6 );
+        estimate.SigmaError[i] = std::hypot( 1.5 * channels[i]->Sigma / std::sqrt( n ), 0.6 );
+    }
+
+    return estimate;
+}
+
+CStretchParams CRawU16::StretchParams( int x0, int y0, int W, int H, bool exact ) const
+{
+    return EstimateStretchParams( x0, y0, W, H, exact ? SM_Exact : SM_Strided ).Params;
+}
+
+CStretchParams CStretchTracker::Update( const CRawU16& rawU16, int _x, int _y, int _w, int _h )
+{
+    bool isSameRect = _x == x && _y == y && _w == w && _h == h;
+    x = _x;
+    y = _y;
+    w = _w;
+    h = _h;
+
+    isFullUpdate = not isValid || not isSameRect;
+    if( not isFullUpdate ) {
+        auto sample = rawU16.EstimateStretchParams( x, y, w, h, SM_Strided, SampleCount );
+        const CChannelStat* sampled[3] = { &sample.Params.R, &sample.Params.G, &sample.Params.B };
+        for( int i = 0; i < 3 && not isFullUpdate; i++ ) {
+            // Drift within the estimation error of the sample is not a drift
+            double medianDrift = std::abs( sampled[i]->Median - median[i] ) - 2 * sample.MedianError[i];
+            double sigmaDrift = std::abs( sampled[i]->Sigma - sigma[i] ) - 2 * sample.SigmaError[i];
+            isFullUpdate = medianDrift > MaxMedianDrift * sigma[i] || sigmaDrift > MaxSigmaDrift * sigma[i];
+        }
+        if( not isFullUpdate ) {
+            for( int i = 0; i < 3; i++ ) {
+                median[i] += Smoothing * ( sampled[i]->Median - median[i] );
+                sigma[i] += Smoothing * ( sampled[i]->Sigma - sigma[i] );
             }
         }
     }
+    if( isFullUpdate ) {
+        auto params = rawU16.StretchParams( x, y, w, h, true );
+        const CChannelStat* stats[3] = { &params.R, &params.G, &params.B };
+        for( int i = 0; i < 3; i++ ) {
+            median[i] = stats[i]->Median;
+            sigma[i] = stats[i]->Sigma;
+        }
+        isValid = true;
+    }
 
+    CStretchParams params;
+    CChannelStat* stats[3] = { &params.R, &params.G, &params.B };
+    for( int i = 0; i < 3; i++ ) {
+        stats[i]->Median = (unsigned int)std::lround( median[i] );
+        stats[i]->Sigma = std::max( 1u, (unsigned int)std::lround( sigma[i] ) );
+    }
+    return params;
+}
+
+std::shared_ptr<CRgbImage> CRawU16::Stretch( int x0, int y0, int W, int H ) const
+{
+    return Stretch( StretchParams( x0, y0, W, H ), x0, y0, W, H );
+}
+
+static void stretchRow( const CStretchParams& params, uint maxValue, const ushort* srcLine, uchar* dstLine, int w )
+{
+    const CChannelStat& sR = params.R;
+    const CChannelStat& sG = params.G;
+    const CChannelStat& sB = params.B;
+
+    for( int x = 0; x < w; x++ ) {
+        const ushort* src = srcLine + 3 * x;
+        uchar* dst = dstLine + 3 * x;
+
+        uint r = src[0];
+        uint g = src[1];
+        uint b = src[2];
+
+        if( r >= maxValue || g >= maxValue || b >= maxValue ) {
+            dst[0] = 0xFF;
+            dst[1] = 0x00;
+            dst[2] = 0x80;
+        } else {
+            const int k = 12;
+            dst[0] = r <= ( sR.Median + k * sR.Sigma ) ? ( r < sR.Median ? 0 : ( 255 * ( r - sR.Median ) / k / sR.Sigma ) ) : 255;
+            dst[1] = g <= ( sG.Median + k * sG.Sigma ) ? ( g < sG.Median ? 0 : ( 255 * ( g - sG.Median ) / k / sG.Sigma ) ) : 255;
+            dst[2] = b <= ( sB.Median + k * sB.Sigma ) ? ( b < sB.Median ? 0 : ( 255 * ( b - sB.Median ) / k / sB.Sigma ) ) : 255;
+        }
+    }
+}
+
+std::shared_ptr<CRgbImage> CRawU16::Stretch( const CStretchParams& params, int x0, int y0, int W, int H ) const
+{
+    auto result = std::make_shared<CRgbImage>( W, H );
+    std::vector<ushort> scratch;
+    Stretch( params, x0, y0, W, H, result.get(), scratch );
     return result;
 }
 
+// Bands of 16-bit RGB rows debayered before stretching. Small enough to stay in the cache
+static const int StretchBandHeight = 16;
+
+void CRawU16::Stretch( const CStretchParams& params, int x0, int y0, int W, int H, CRgbImage* result, std::vector<ushort>& scratch ) const
+{
+    assert( result->Width() == W && result->Height() == H );
+    const uint maxValue = ~(~0u << bitDepth) - 1;
+
+    // Debayering skips pixels outside of the frame
+    const bool isInside = x0 >= 0 && y0 >= 0 && x0 + W <= width && y0 + H <= height;
+    scratch.resize( 3 * W * StretchBandHeight );
+    ushort* band = scratch.data();
+    CDebayer_RawU16_HQLinear debayer( raw, width, height, bitDepth );
+    for( int y = 0; y < H; y += StretchBandHeight ) {
+        const int h = std::min( StretchBandHeight, H - y );
+        if( not isInside ) {
+            std::fill( band, band + 3 * W * h, 0 );
+        }
+        debayer.ToRgbU16( band, 3 * W, x0, y0 + y, W, h );
+        for( int i = 0; i < h; i++ ) {
+            stretchRow( params, maxValue, band + 3 * W * i, result->ScanLine( y + i ), W );
+        }
+    }
+}
+
 std::shared_ptr<CRgbImage> CRawU16::StretchHalfRes( int x0, int y0, int W, int H ) const
 {
-    CPixelStatistics stats = CalculateStatistics( x0, y0, W, H );
+    return StretchHalfRes( StretchParams( x0, y0, W, H ), x0, y0, W, H );
+}
 
+std::shared_ptr<CRgbImage> CRawU16::StretchHalfRes( const CStretchParams& params, int x0, int y0, int W, int H ) const
+{
+    auto result = std::make_shared<CRgbImage>( W / 2, H / 2 );
+    StretchHalfRes( params, x0, y0, W, H, result.get() );
+    return result;
+}
+
+void CRawU16::StretchHalfRes( const CStretchParams& params, int x0, int y0, int W, int H, CRgbImage* result ) const
+{
     const uint maxValue = ~(~0u << bitDepth) - 1;
 
-    CChannelStat sR = stats.stat( 0 );
-    CChannelStat sG = stats.stat( 1, 2);
-    CChannelStat sB = stats.stat( 2 );
+    const CChannelStat& sR = params.R;
+    const CChannelStat& sG = params.G;
+    const CChannelStat& sB = params.B;
 
-    sR.Sigma = std::max( 1u, sR.Sigma );
-    sG.Sigma = std::max( 1u, sG.Sigma );
-    sB.Sigma = std::max( 1u, sB.Sigma );
+    // Pixels outside of the frame are skipped, a reused result keeps them from the previous frames
+    if( x0 < 0 || y0 < 0 || x0 + W > width || y0 + H > height ) {
+        std::fill( result->RgbPixels(), result->RgbPixels() + result->ByteWidth() * result->Height(), 0 );
+    }
 
     W /= 2;
     H /= 2;
+    assert( result->Width() == W && result->Height() == H );
 
-    auto result = std::make_shared<CRgbImage>( W, H );
     for( int y = 0; y < H; y++ ) {
             int Y = 2 * y + y0;
             if( Y < 0 || Y >= height ) {
@@ -236,34 +459,50 @@ std::shared_ptr<CRgbImage> CRawU16::StretchHalfRes( int x0, int y0, int W, int H
                 }
             }
         }
+}
 
+std::shared_ptr<CRgbImage> CRawU16::StretchQuarterRes( int x, int y, int w, int h ) const
+{
+    return StretchBinned( 4, x, y, w, h );
+}
+
+std::shared_ptr<CRgbImage> CRawU16::StretchBinned( int factor, int x, int y, int w, int h ) const
+{
+    return StretchBinned( StretchParams( x, y, w, h ), factor, x, y, w, h );
+}
+
+std::shared_ptr<CRgbImage> CRawU16::StretchBinned( const CStretchParams& params, int factor, int x0, int y0, int W, int H ) const
+{
+    auto result = std::make_shared<CRgbImage>( W / factor, H / factor );
+    std::vector<ushort> scratch;
+    StretchBinned( params, factor, x0, y0, W, H, result.get(), scratch );
     return result;
 }
 
-std::shared_ptr<CRgbImage> CRawU16::StretchQuarterRes( int x, int y, int w, int h ) const
+void CRawU16::StretchBinned( const CStretchParams& params, int factor, int x0, int y0, int W, int H, CRgbImage* result,
+    std::vector<ushort>& scratch ) const
 {
-    auto rgbImage = StretchHalfRes( x, y, w, h );
-    int byteWidth = rgbImage->ByteWidth();
-    w /= 2;
-    h /= 2;
-
-    auto result = std::make_shared<CRgbImage>( w / 2, h / 2 );
-    for( int i = 0; i < h / 2; i++ ) {
-        const uchar* ptr = rgbImage->ScanLine( 2 * i );
-        uchar* ptr2 = result->ScanLine( i );
-        for( int j = 0; j < w / 2; j++ ) {
-            const uchar* src0 = ptr + 2 * 3 * j;
-            const uchar* src1 = src0 + 3;
-            const uchar* src2 = src0 + byteWidth;
-            const uchar* src3 = src0 + byteWidth + 3;
-
-            uchar* dst = ptr2 + 3 * j;
-            dst[0] = ( src0[0] + src1[0] + src2[0] + src3[0] ) / 4;
-            dst[1] = ( src0[1] + src1[1] + src2[1] + src3[1] ) / 4;
-            dst[2] = ( src0[2] + src1[2] + src2[2] + src3[2] ) / 4;
+    const uint maxValue = ~(~0u << bitDepth) - 1;
+
+    const bool isInside = x0 >= 0 && y0 >= 0 && x0 + W <= width && y0 + H <= height;
+    W /= factor;
+    H /= factor;
+    assert( result->Width() == W && result->Height() == H );
+
+    // Binning in 16 bits (each raw pixel is read once), by bands of output rows as for the full resolution
+    scratch.resize( 3 * W * StretchBandHeight );
+    ushort* band = scratch.data();
+    CDebayer_RawU16_Binned debayer( raw, width, height, bitDepth, factor );
+    for( int y = 0; y < H; y += StretchBandHeight ) {
+        const int h = std::min( StretchBandHeight, H - y );
+        if( not isInside ) {
+            std::fill( band, band + 3 * W * h, 0 );
+        }
+        debayer.ToRgbU16( band, 3 * W, x0, y0 + factor * y, W, h );
+        for( int i = 0; i < h; i++ ) {
+            stretchRow( params, maxValue, band + 3 * W * i, result->ScanLine( y + i ), W );
         }
     }
-    return result;
 }
 
 std::shared_ptr<CGrayU16Image> CRawU16::ToGrayU16( const CRgbU16Image* rgb16 )
@@ -380,50 +619,6 @@ CPixelStatistics CRawU16::CalculateStatistics( const CGrayU16Image* image )
     return stats;
 }
 
-static std::tuple<int, int, int, int, int, unsigned> starMaskWithMax( const CGrayU16Image* image, int x, int y, int t, int width, int height, std::shared_ptr<CGrayImage> result, int value )
-{
-    int vmax = 0;
-    int xmax = 0;
-    int ymax = 0;
-    int cmax = 0;
-    int count = 0;
-    unsigned sum = 0;
-    std::stack<std::tuple<int, int>> s;
-    s.emplace( x, y );
-    while( not s.empty() ) {
-        auto [x, y] = s.top();
-        s.pop();
-        if( x >= 0 && x < width && y > 0 && y < height ) {
-            auto& dst = result->At( x, y );
-            int v = image->At( x, y );
-            if( dst < value && v >= t ) {
-                dst = value;
-                count++;
-                sum += v;
-                if( v >= vmax ) {
-                    if( v > vmax ) {
-                        vmax = v;
-                        xmax = x;
-                        ymax = y;
-                        cmax = 1;
-                    } else {
-                        cmax++;
-                    }
-                }
-                s.emplace( x - 1, y );
-                s.emplace( x + 1, y );
-                s.emplace( x - 1, y - 1 );
-                s.emplace( x, y - 1);
-                s.emplace( x + 1, y - 1);
-                s.emplace( x - 1, y + 1 );
-                s.emplace( x, y + 1);
-                s.emplace( x + 1, y + 1);
-            }
-        }
-    }
-    return std::make_tuple( vmax, xmax, ymax, cmax, count, sum );
-}
-
 /*static void erase( int x, int y, int width, int height, std::shared_ptr<CGrayImage> result )
 {
     std::stack<std::tuple<int, int>> s;
@@ -448,76 +643,37 @@ static std::tuple<int, int, int, int, int, unsigned> starMaskWithMax( const CGra
     }
 }*/
 
-static void enumerate(const CGrayU16Image* image, int x, int y, int width, int height, int th, std::shared_ptr<CGrayImage> mask, std::function<void(int, int, ushort)> f )
-{
-    std::stack<std::tuple<int, int, int>> undo;
-    std::stack<std::tuple<int, int>> s;
-    s.emplace( x, y );
-    while( not s.empty() ) {
-        auto [x, y] = s.top();
-        s.pop();
-        if( x >= 0 && x < width && y > 0 && y < height ) {
-            auto& dst = mask->At( x, y );
-            if( dst >= th  ) {
-                f( x, y, image->At( x, y ) );
-                undo.emplace( x, y, dst );
-                dst = 0;
-                s.emplace( x - 1, y );
-                s.emplace( x + 1, y );
-                s.emplace( x - 1, y - 1 );
-                s.emplace( x, y - 1);
-                s.emplace( x + 1, y - 1);
-                s.emplace( x - 1, y + 1 );
-                s.emplace( x, y + 1);
-                s.emplace( x + 1, y + 1);
-            }
-        }
-    }
-    while( not undo.empty() ) {
-        auto [x, y, v] = undo.top();
-        undo.pop();
-        mask->At( x, y ) = v;
-    }
-}
-
-static std::shared_ptr<CGrayImage> starMask( const CGrayU16Image* image, int x, int y, int t, int width, int height, std::shared_ptr<CGrayImage> result, int value )
+// Marks the component of pixels at or above the threshold that contains the seed pixel (the mask is not lowered)
+// When the owner labeling is given, only the pixels of its component ownerComponent are marked (a component above
+// a lower threshold may reach into the neighbours of the star)
+static void starMask( CComponentLabeling& labeling, const CGrayU16Image* image, int seedX, int seedY, int t, int value, CGrayImage* mask,
+    int x, int y, int width, int height, const CComponentLabeling* owner = nullptr, int ownerComponent = -1 )
 {
-    std::stack<std::tuple<int, int>> s;
-    s.emplace( x, y );
-    while( not s.empty() ) {
-        auto [x, y] = s.top();
-        s.pop();
-        if( x >= 0 && x < width && y > 0 && y < height ) {
-            auto& dst = result->At( x, y );
-            if( dst < value && image->At( x, y ) >= t ) {
-                dst = value;
-                s.emplace( x - 1, y );
-                s.emplace( x + 1, y );
-                s.emplace( x - 1, y - 1 );
-                s.emplace( x, y - 1);
-                s.emplace( x + 1, y - 1);
-                s.emplace( x - 1, y + 1 );
-                s.emplace( x, y + 1);
-                s.emplace( x + 1, y + 1);
+    labeling.Label( image, t, x, y, width, height );
+    int component = labeling.ComponentAt( seedX, seedY );
+    if( component >= 0 ) {
+        labeling.ForEachPixel( component, [&]( int x, int y ) {
+            if( owner == nullptr || owner->ComponentAt( x, y ) == ownerComponent ) {
+                auto& dst = mask->At( x, y );
+                dst = std::max<int>( dst, value );
             }
-        }
+        } );
     }
-    return result;
 }
 
 static std::shared_ptr<CGrayImage> starMask( const CGrayU16Image* image, int x, int y, int t, int value = 128 )
 {
-    int width = image->Width();
-    int height = image->Height();
-    std::shared_ptr<CGrayImage> result = std::make_shared<CGrayImage>( width, height );
-    return starMask( image, x, y, t, width, height, result, value );
+    std::shared_ptr<CGrayImage> result = std::make_shared<CGrayImage>( image->Width(), image->Height() );
+    CComponentLabeling labeling;
+    starMask( labeling, image, x, y, t, value, result.get(), 0, 0, image->Width(), image->Height() );
+    return result;
 }
 
 static std::shared_ptr<CGrayImage> starMask( const CGrayU16Image* image, int x, int y, int t, int value, std::shared_ptr<CGrayImage>& result )
 {
-    int width = image->Width();
-    int height = image->Height();
-    return starMask( image, x, y, t, width, height, result, value );
+    CComponentLabeling labeling;
+    starMask( labeling, image, x, y, t, value, result.get(), 0, 0, image->Width(), image->Height() );
+    return result;
 }
 
 class CalculateXY {
@@ -545,179 +701,79 @@ private:
     double sumV = 0;
 };
 
-struct StarXY {
-    double NormalizedBrightness;
-    double X;
-    double Y;
-    std::vector<int> Neighbours;
-    std::vector<double> Distances;
-    std::vector<double> Angles;
-    int MatchedIndex = -1;
-};
+void CStarCatalog::Add( float x, float y, float flux, unsigned short peak, int area )
+{
+    X.push_back( x );
+    Y.push_back( y );
+    Flux.push_back( flux );
+    Peak.push_back( peak );
+    Area.push_back( area );
+}
 
-static std::vector<StarXY> normalizedBrightStarsXY( const DetectionResults& r0, size_t num )
+CStarCatalog CStarCatalog::Extract( const DetectionResults& r0, size_t maxCount )
 {
     auto d0 = r0.DetectionRegions;
     auto sortByBrightness = [&]( std::shared_ptr<DetectionRegion> r0, std::shared_ptr<DetectionRegion> r1 ) { return r0->FluxAtHalfDetectionThreshold > r1->FluxAtHalfDetectionThreshold; };
     std::sort( d0.begin(), d0.end(), sortByBrightness );
-    auto size = std::min( d0.size(), num );
-    auto b0 =  d0.front()->FluxAtHalfDetectionThreshold;
-
-    std::vector<StarXY> result;
-    result.resize( size );
+    auto size = maxCount > 0 ? std::min( d0.size(), maxCount ) : d0.size();
+
+    CStarCatalog result;
+    result.X.reserve( size );
+    result.Y.reserve( size );
+    result.Flux.reserve( size );
+    result.Peak.reserve( size );
+    result.Area.reserve( size );
+    CComponentLabeling labeling;
     for( size_t i = 0; i < size; i++ ) {
         auto dr0 = *d0[i];
-        result[i].NormalizedBrightness = 1.0 * dr0.FluxAtHalfDetectionThreshold / b0;
         CalculateXY c0( dr0.Xmax, dr0.Ymax, dr0.Background + ( dr0.Vmax - dr0.Background ) / 2 );
-        enumerate( r0.Image.get(), dr0.Xmax, dr0.Ymax, r0.Image->Width(), r0.Image->Height(), 128, r0.Mask, std::ref( c0 ) );
-        result[i].X = dr0.Xmax + c0.dx();
-        result[i].Y = dr0.Ymax + c0.dy();
+        // The half max part of the star is marked as 128 and above
+        labeling.Label( r0.Mask.get(), 128, dr0.MinX, dr0.MinY, dr0.MaxX - dr0.MinX + 1, dr0.MaxY - dr0.MinY + 1 );
+        int component = labeling.ComponentAt( dr0.Xmax, dr0.Ymax );
+        if( component >= 0 ) {
+            labeling.ForEachPixel( component, [&]( int x, int y ) { c0( x, y, r0.Image->At( x, y ) ); } );
+        }
+        // In pixels of the frame (the center of a superpixel is between its pixels)
+        result.Add( static_cast<float>( r0.X0 + r0.Scale * ( dr0.Xmax + c0.dx() ) + 0.5 * ( r0.Scale - 1 ) ),
+            static_cast<float>( r0.Y0 + r0.Scale * ( dr0.Ymax + c0.dy() ) + 0.5 * ( r0.Scale - 1 ) ),
+            static_cast<float>( dr0.FluxAtHalfDetectionThreshold ),
+            static_cast<unsigned short>( std::min( dr0.Vmax, 0xFFFF ) ),
+            dr0.AreaAtHalfDetectionThreshold );
     }
     return result;
 }
 
-template <typename T, typename Compare>
-std::vector<std::size_t> sort_permutation(
-    const std::vector<T>& vec,
-    const Compare& compare)
+CStarCatalogHistory::CStarCatalogHistory( int depth ) :
+    catalogs( std::max( 1, depth ) )
 {
-    std::vector<std::size_t> p(vec.size());
-    std::iota(p.begin(), p.end(), 0);
-    std::sort(p.begin(), p.end(),
-        [&](std::size_t i, std::size_t j){ return compare(vec[i], vec[j]); });
-    return p;
-}
-
-template <typename T>
-std::vector<T> apply_permutation(
-    const std::vector<T>& vec,
-    const std::vector<std::size_t>& p)
-{
-    std::vector<T> sorted_vec(vec.size());
-    std::transform(p.begin(), p.end(), sorted_vec.begin(),
-        [&](std::size_t i){ return vec[i]; });
-    return sorted_vec;
-}
-
-static void calculateDistances( std::vector<StarXY>& stars )
-{
-    for( size_t i = 0; i < stars.size(); i++ ) {
-        auto& d = stars[i].Distances;
-        std::vector<double> DX;
-        std::vector<double> DY;
-        auto& neighbours = stars[i].Neighbours;
-        for( size_t j = 0; j < i; j++ ) {
-            double dX = stars[j].X - stars[i].X;
-            double dY = stars[j].Y - stars[i].Y;
-            double L = sqrt( dX * dX + dY * dY );
-            d.push_back( L );
-            DX.push_back( dX );
-            DY.push_back( dY );
-            neighbours.push_back( j );
-        }
-        if( d.size() < 7 ) {
-            for( size_t j = i + 1; j < stars.size() && d.size() < 7; j++ ) {
-                double dX = stars[j].X - stars[i].X;
-                double dY = stars[j].Y - stars[i].Y;
-                double L = sqrt( dX * dX + dY * dY );
-                d.push_back( L );
-                DX.push_back( dX );
-                DY.push_back( dY );
-                neighbours.push_back( j );
-            }
-        }
-        if( d.size() > 7 ) {
-            auto p = sort_permutation( d, std::less<double>() );
-            d = apply_permutation( d, p );
-            DX = apply_permutation( DX, p );
-            DY = apply_permutation( DY, p );
-            neighbours = apply_permutation( neighbours, p );
-            d.resize( 7 );
-            DX.resize( 7 );
-            DY.resize( 7 );
-            neighbours.resize( 7 );
-
-            std::vector<double> brightness;
-            for( size_t j = 0; j < neighbours.size(); j++ ) {
-                brightness.push_back( stars[neighbours[j]].NormalizedBrightness );
-            }
-            auto p1 = sort_permutation( brightness, std::greater<double>() );
-            d = apply_permutation( d, p1 );
-            DX = apply_permutation( DX, p1 );
-            DY = apply_permutation( DY, p1 );
-            neighbours = apply_permutation( neighbours, p1 );
-        }
-        auto& a = stars[i].Angles;
-        for( size_t j = 0; j < d.size(); j++ ) {
-            a.push_back( atan2( DX[j], DY[j] ) );
-        }
-    }
 }
 
-static bool match( const StarXY& star0, const StarXY& star1 )
+void CStarCatalogHistory::Push( CStarCatalog&& catalog )
 {
-    const auto& n0 = star0.Neighbours;
-    const auto& n1 = star1.Neighbours;
-    const auto& d0 = star0.Distances;
-    const auto& d1 = star1.Distances;
-    const auto& a0 = star0.Angles;
-    const auto& a1 = star1.Angles;
-    int count = 0;
-    int fCount = 0;
-    for( size_t n = 0; n < std::min( n0.size(), n1.size() ); n++ ) {
-        double L0 = d0[n];
-        double A0 = a0[n] - a0[0];
-        double L1 = d1[n];
-        double A1 = a1[n] - a1[0];
-        if( fabs( L0 - L1 ) < 2 && fabs( A0 - A1 ) < 2 / L0 ) {
-            count++;
-        } else {
-            fCount++;
-        }
-    }
-    if( fCount == 0 || count > 2 ) {
-        return true;
-    }
-    count = 0;
-    for( size_t n = 0; n < std::min( n0.size(), n1.size() ); n++ ) {
-        double L0 = d0[n];
-        double A0 = a0[n] - a0[1];
-        double L1 = d1[n];
-        double A1 = a1[n] - a1[1];
-        if( fabs( L0 - L1 ) < 2 && fabs( A0 - A1 ) < 2 / L0 ) {
-            count++;
-        }
+    const int depth = Depth();
+    if( count < depth ) {
+        catalogs[( first + count ) % depth] = std::move( catalog );
+        count++;
+    } else {
+        catalogs[first] = std::move( catalog );
+        first = ( first + 1 ) % depth;
     }
-    return count > 2;
 }
 
-std::vector<std::pair<double, double>> align( std::vector<StarXY>& stars0, std::vector<StarXY>& stars1 )
+void CStarCatalogHistory::SetDepth( int depth )
 {
-    calculateDistances( stars0 );
-    calculateDistances( stars1 );
-
-    std::vector<std::pair<double, double>> result;
-    for( size_t i = 0; i < stars0.size(); i++ ) {
-        const auto& s0 = stars0[i];
-        bool matched = false;
-        for( size_t j = 0; j < stars1.size(); j++ ) {
-            auto& s1 = stars1[j];
-            if( match( s0, s1 ) ) {
-                qDebug() << "Matched" << i << j << s0.X << s0.Y << s1.X << s1.Y;
-                assert( !matched );
-                matched = true;
-                result.push_back( std::make_pair( s1.X, s1.Y ) );
-                s1.MatchedIndex = i;
-            }
-        }
-        if( !matched ) {
-            result.push_back( std::make_pair( 0, 0 ) );
-        }
+    depth = std::max( 1, depth );
+    std::vector<CStarCatalog> newest( depth );
+    const int newCount = std::min( count, depth );
+    for( int i = 0; i < newCount; i++ ) {
+        newest[i] = std::move( catalogs[( first + count - newCount + i ) % catalogs.size()] );
     }
-    return result;
+    catalogs = std::move( newest );
+    first = 0;
+    count = newCount;
 }
 
-void CFocusingHelper::AddFrame( const CRawU16Image* currentImage, int imageSize, int focuserPos )
+void CFocusingHelper::measure( const CRawU16Image* currentImage, int imageSize, bool isStacked )
 {
     double prevCX = CX;
     double prevCY = CY;
@@ -785,109 +841,42 @@ void CFocusingHelper::AddFrame( const CRawU16Image* currentImage, int imageSize,
     double dY = sumVY / sumV;
     qDebug() << "dX:" << QString::number( dX, 'f', 2 ) << "dY:" << QString::number( dY, 'f', 2 );
 
-    double meanSky = INT_MAX;
+    // Pixels of the cutout binned by the distance from the centroid in one pass
+    CRadialProfile profile;
+    profile.Build( image.get(), imageSize / 2 + dX, imageSize / 2 + dY );
+
+    // Sky is the darkest annulus around the star. Its radius is found on the first frame and kept
+    const int dR = 10;
     if( R == 0 ) {
-        const int dR = 10;
-        int bestR = 0;
-        int samples = 0;
-        while( true ) {
-            double sumV = 0;
-            int count = 0;
-            for( int y = 0; y < height; y++ ) {
-                const ushort* src = image->ScanLine( y );
-                for( int x = 0; x < width; x++ ) {
-                    int dx = x - imageSize / 2;
-                    int dy = y - imageSize / 2;
-                    int rr = dx * dx + dy * dy;
-                    if( rr >= R * R && rr < ( R + dR ) * ( R + dR ) ) {
-                        sumV += src[x];
-                        count++;
-                    }
-                }
-            }
-            double current = sumV / count;
-            //qDebug() << "R:" << R << "Mean Sky:" << current;
-            bool foundBoundary = false;
-            if( current < meanSky || R == 0 ) {
-                meanSky = current;
-                bestR = R;
-            } else {
-                foundBoundary = true;
-                //qDebug() << "----------";
-            }
-            if( foundBoundary || samples > 0 ) {
-                if( ++samples == 15 ) {
-                    break;
-                }
-            }
-            R += 3;
-        }
-        R = bestR;
+        R = profile.FindSkyAnnulus( dR );
         R_out = R + dR;
-    } else {
-        double sumV = 0;
-        int count = 0;
-        for( int y = 0; y < height; y++ ) {
-            const ushort* src = image->ScanLine( y );
-            for( int x = 0; x < width; x++ ) {
-                int dx = x - imageSize / 2;
-                int dy = y - imageSize / 2;
-                int rr = dx * dx + dy * dy;
-                if( rr >= R * R && rr < ( R + 10 ) * ( R + 10 ) ) {
-                    sumV += src[x];
-                    count++;
-                }
-            }
-        }
-        meanSky = sumV / count;
     }
+    double meanSky = profile.Mean( R, R + dR );
     qDebug() << "R:" << R << "Mean Sky:" << meanSky;
 
-    sumV = 0;
-    double sumVR = 0;
-    for( int y = 0; y < height; y++ ) {
-        const ushort* src = image->ScanLine( y );
-        const uchar* msk = mask->ScanLine( y );
-        for( int x = 0; x < width; x++ ) {
-            if( msk[x] >= 32 ) {
-                double value = src[x] - meanSky; // (?) ( s.Median + ( cVal - s.Median ) / 10 );
-                for( int n = 0; n < 3; n++ ) {
-                    for( int m = 0; m < 3; m++ ) {
-                        double dx = x - ( imageSize / 2 + dX ) + n / 3.0;
-                        double dy = y - ( imageSize / 2 + dY ) + m / 3.0;
-                        double r = sqrt( dx * dx + dy * dy );
-                        if( r < R ) {
-                            sumVR += value * r;
-                            sumV += value;
-                        }
-                    }
-                }
-            }
-        }
-    }
-    HFD = 2 * sumVR / sumV;
+    // Distances of the 3x3 subpixel samples come from tables, which are reused while the centroid stays at the same
+    // quantized offset within its pixel
+    HFD = hfdTable.Hfd( image.get(), mask.get(), 32, imageSize / 2 + dX, imageSize / 2 + dY, R, meanSky );
     qDebug() << "HFD:" << QString::number( HFD, 'f', 2 );
 
-    double halfMax2 = meanSky + ( maxVal - meanSky ) / 2;
-    count = 0;
-    for( int y = imageSize / 2 - 10; y <= imageSize / 2 + 10; y++ ) {
-        const ushort* src = image->ScanLine( y );
-        for( int x = imageSize / 2 - 10; x < imageSize / 2 + 10; x++ ) {
-            if( src[x] - 0.5 >= halfMax2 ) {
-                count++;
-            }
-        }
-    }
-
-    qDebug() << "(2) Count at half max:" << count;
-    qDebug() << "(2) FWHM:" << 2 * sqrt ( count / M_PI );
+    const double fwhm = profile.Fwhm( meanSky, maxVal );
+    qDebug() << "(2) FWHM:" << QString::number( fwhm, 'f', 2 );
     qDebug() << "(2) Max:" << maxVal;
+    qDebug() << "EE80:" << QString::number( 2 * profile.EncircledEnergyRadius( 0.8, meanSky, R ), 'f', 2 );
 
     Mask = mask;
 
     CX = cx + dX;
     CY = cy + dY;
 
+    dCX = CX - prevCX;
+    dCY = CY - prevCY;
+    FWHM = fwhm;
+    Max = maxVal;
+
+    if( not isStacked ) {
+        return;
+    }
     auto finalImage = rawU16.DebayerRect( std::round( CX ) - imageSize / 2,  std::round( CY ) - imageSize / 2, imageSize, imageSize );
     if( Stack == 0 || Stack->Height() != height || Stack->Width() != width || ( MaxStackSize > 0 && StackSize >= MaxStackSize ) ) {
         Stack = std::make_shared<CPixelBuffer<double, 3>>( width, height );
@@ -898,7 +887,10 @@ void CFocusingHelper::AddFrame( const CRawU16Image* currentImage, int imageSize,
         pixels_add( Stack->Pixels(), finalImage->Pixels(), finalImage->Count(), 3 );
         StackSize++;
     }
+}
 
+void CFocusingHelper::addToSeries( int focuserPos, CStarCatalog&& stars )
+{
     auto it = focuserStats.find( focuserPos );
     if( it == focuserStats.end() ) {
         currentSeries = std::make_shared<Data>();
@@ -910,24 +902,41 @@ void CFocusingHelper::AddFrame( const CRawU16Image* currentImage, int imageSize,
     }
 
     currentSeries->HFD.push_back( HFD );
-    currentSeries->FWHM.push_back( 2 * sqrt ( count / M_PI ) );
-    currentSeries->Max.push_back( maxVal );
+    currentSeries->FWHM.push_back( FWHM );
+    currentSeries->Max.push_back( Max );
     currentSeries->CX.push_back( CX );
     currentSeries->CY.push_back( CY );
+    currentSeries->Catalogs.Push( std::move( stars ) );
+}
 
+void CFocusingHelper::AddFrame( const CRawU16Image* currentImage, int imageSize, int focuserPos )
+{
+    // This star and the extra ones (tilt and curvature) are measured in one batch on worker threads. Each star reads
+    // only its own cutouts of the frame and changes only its own helper. Only this star is stacked for the view
+    std::vector<CFocusingHelper*> helpers( 1, this );
+    for( auto helper : extra ) {
+        helpers.push_back( helper.get() );
+    }
+    QtConcurrent::blockingMap( helpers, [this, currentImage, imageSize]( CFocusingHelper* helper ) {
+        helper->measure( currentImage, imageSize, helper == this );
+    } );
+
+    CRawU16 rawU16( currentImage );
     if( isGlobalPolarAlign ) {
-        currentSeries->theDetectionResults.push_back( rawU16.DetectStars( 0, 0, currentImage->Width(), currentImage->Height() ) );
+        // Only centroids are needed for the alignment. The images of the detection are released here
+        auto detection = rawU16.DetectStars( 0, 0, currentImage->Width(), currentImage->Height(), &background, DM_Superpixel );
+        addToSeries( focuserPos, CStarCatalog::Extract( detection, MaxCatalogStars ) );
     } else {
-        currentSeries->theDetectionResults.push_back( DetectionResults() );
+        addToSeries( focuserPos, CStarCatalog() );
+    }
+    for( auto helper : extra ) {
+        helper->addToSeries( focuserPos, CStarCatalog() );
     }
 
     double sumdCX = 0;
     double sumdCY = 0;
     double sumdCXdCX = 0;
     double sumdCYdCY = 0;
-    dCX = CX - prevCX;
-    dCY = CY - prevCY;
-
     int minSize = currentSeries->CX.size();
     for( auto helper : extra ) {
         if( helper->currentSeries ) {
@@ -948,12 +957,8 @@ void CFocusingHelper::AddFrame( const CRawU16Image* currentImage, int imageSize,
         CFocusingHelper* prev = this;
         double d = 0; 
         for( auto helper : extra ) {
-            double prevCX = helper->CX;
-            double prevCY = helper->CY;
-            helper->AddFrame( currentImage, imageSize, focuserPos );
-
-            double dCX = helper->CX - prevCX;
-            double dCY = helper->CY - prevCY;
+            double dCX = helper->dCX;
+            double dCY = helper->dCY;
             sumdCX += dCX;
             sumdCXdCX += dCX * dCX;
             sumdCY += dCY;
@@ -1011,36 +1016,44 @@ void CFocusingHelper::AddFrame( const CRawU16Image* currentImage, int imageSize,
         }
     }
     if( isGlobalPolarAlign && minSize > 1 ) {
-        std::vector<StarXY> stars0;
-        for( auto i = currentSeries->theDetectionResults.cend() - minSize; i < currentSeries->theDetectionResults.cend() - 1; i++ ) {
-            const auto& dr = *i;
-            if( dr.DetectionRegions.size() > 0 ) {
-                stars0 = normalizedBrightStarsXY( dr, 50 );
+        // The first frame with stars among the last minSize frames (or the oldest one still in the history)
+        const auto& catalogs = currentSeries->Catalogs;
+        const CStarCatalog* reference = nullptr;
+        for( int i = std::max( 0, catalogs.Size() - minSize ); i < catalogs.Size() - 1; i++ ) {
+            if( not catalogs[i].IsEmpty() ) {
+                reference = &catalogs[i];
                 break;
             }
         }
-        auto stars1 = normalizedBrightStarsXY( currentSeries->theDetectionResults.back(), 50 );
-        Stars = align( stars0, stars1 );
-        //currentSeries->DetectionResults.back().Image.reset();
-        //currentSeries->DetectionResults.back().Mask.reset();
-
-        std::vector<double> x1;
-        std::vector<double> y1;
-        std::vector<double> x2;
-        std::vector<double> y2;
-        for( const auto& s1 : stars1 ) {
-            if( s1.MatchedIndex >= 0 ) {
-                const auto& s0 = stars0[s1.MatchedIndex];
-                x1.push_back( s0.X );
-                y1.push_back( s0.Y );
-                x2.push_back( s1.X );
-                y2.push_back( s1.Y );
+        const CStarCatalog& current = catalogs.Back();
+
+        Stars.clear();
+        if( reference != nullptr ) {
+            auto matched = CStarMatcher().Match( *reference, current );
+            std::vector<double> x1;
+            std::vector<double> y1;
+            std::vector<double> x2;
+            std::vector<double> y2;
+            for( const auto& m : matched.Matches ) {
+                x1.push_back( reference->X[m.Index0] );
+                y1.push_back( reference->Y[m.Index0] );
+                x2.push_back( current.X[m.Index1] );
+                y2.push_back( current.Y[m.Index1] );
             }
-        }
-        if( x1.size() > 2 ) {
-            CMatrix<double> Ax( 3, 1 );
-            CMatrix<double> Ay( 3, 1 );
-            if( LeastSquaresAffineTransform( Ax, Ay, x1, y1, x2, y2 ) ) {
+            // A wrong match does not move the center of rotation
+            auto fitted = CRansac( TM_Affine ).Estimate( x1, y1, x2, y2 );
+            qDebug() << "Matched" << matched.Matches.size() << "of" << reference->Size() << "stars, inliers:"
+                << fitted.Inliers.size() << "RMS:" << fitted.Rms;
+
+            // Current positions of the reference stars, ( 0, 0 ) for the ones that were not found or are outliers
+            Stars.assign( std::min<size_t>( reference->Size(), CStarMatcher::DefaultMaxStars ), std::make_pair( 0.0, 0.0 ) );
+            for( int i : fitted.Inliers ) {
+                Stars[matched.Matches[i].Index0] = std::make_pair( x2[i], y2[i] );
+            }
+            if( fitted.IsValid ) {
+                CMatrix<double> Ax( 3, 1 );
+                CMatrix<double> Ay( 3, 1 );
+                fitted.Transform.GetAffine( Ax, Ay );
                 double p[2];
                 if( SolveSystemOfTwoLinearEquations( p, Ax[0][0] - 1.0, Ax[1][0], Ax[2][0], Ay[0][0], Ay[1][0] - 1.0, Ay[2][0] ) ) {
                     PX1 = p[0];
@@ -1097,46 +1110,95 @@ std::shared_ptr<CRgbImage> CFocusingHelper::GetStackedImage( bool strach, int fa
     return result;
 }
 
-DetectionResults CRawU16::DetectStars( int x0, int y0, int W, int H ) const
+DetectionResults CRawU16::DetectStars( int x0, int y0, int W, int H, CBackgroundMesh* background, TDetectionMode mode ) const
 {
-    auto image = GrayU16( x0, y0, W, H );
-
-    const auto s = CRawU16::CalculateStatistics( image.get() ).stat( 0 );
-    qDebug() << "Median:" << s.Median << "Sigma:" << s.Sigma;
+    DetectionResults results;
+    std::shared_ptr<CGrayU16Image> image;
+    if( mode == DM_Superpixel ) {
+        // Superpixels start at even pixels of the frame
+        results.X0 = x0 - ( x0 & 1 );
+        results.Y0 = y0 - ( y0 & 1 );
+        image = GrayU16HalfRes( results.X0, results.Y0, W, H );
+        results.Scale = 2;
+    } else {
+        results.X0 = x0;
+        results.Y0 = y0;
+        image = GrayU16( x0, y0, W, H );
+    }
+    W = image->Width();
+    H = image->Height();
 
-    int th = s.Median + 6 * s.Sigma;
-    int halfTh = s.Median + 3 * s.Sigma;
+    // Thresholds follow the local background and noise (gradients from light pollution or the Moon)
+    CBackgroundMesh frameBackground;
+    CBackgroundMesh& mesh = background != nullptr ? *background : frameBackground;
+    mesh.Update( image.get() );
+    qDebug() << "Median:" << mesh.MedianBackground() << "Sigma:" << mesh.MedianSigma();
 
+    const int detectionSigmas = 6;
+    const int halfDetectionSigmas = 3;
+    auto halfThMap = mesh.ThresholdMap( halfDetectionSigmas );
 
-    DetectionResults results;
     auto& regions = results.DetectionRegions;
     auto mask = std::make_shared<CGrayImage>( W, H );
-    for( int y = 0; y < H; y++ ) {
-        const ushort* srcLine = image->ScanLine( y );
-        uchar* dstLine = mask->ScanLine( y );
-        for( int x = 0; x < W; x++ ) {
-            const ushort* src = srcLine + x;
-            uchar* dst = dstLine + x;
-
-            if( dst[0] == 0 && src[0] >= th ) {
-                auto region = std::make_shared<DetectionRegion>();
-                auto [vmax, xmax, ymax, cmax, count, sum] = starMaskWithMax( image.get(), x, y, halfTh, image->Width(), image->Height(), mask, 32 );
-                region->Vmax = vmax;
-                region->Xmax = xmax;
-                region->Ymax = ymax;
-                region->Cmax = cmax;
-                region->AreaAtHalfDetectionThreshold = count;
-                region->FluxAtHalfDetectionThreshold = sum;
-                region->FluxAtHalfDetectionThreshold -= count * s.Median;
-                region->Background = s.Median;
-                int base = s.Median + ( vmax - s.Median ) / 10;
-                if( base > halfTh ) {
-                    starMask( image.get(), xmax, ymax, base, 64, mask );
-                }
-                starMask( image.get(), xmax, ymax, s.Median + ( vmax - s.Median ) / 2, 128, mask );
-                starMask( image.get(), xmax, ymax, s.Median + 9 * ( vmax - s.Median ) / 10, 255, mask );
-                regions.push_back( region );
+
+    // Stars are components above the half of the detection threshold that reach the detection threshold.
+    // Labeling runs on bands of the frame in parallel
+    CComponentLabeling labeling;
+    labeling.Label( image.get(), halfThMap.get() );
+    const auto& components = labeling.Components();
+
+    // Stars are measured in parallel. Each star writes only to the pixels of its component in the mask
+    std::vector<std::shared_ptr<DetectionRegion>> stars( components.size() );
+    std::vector<std::pair<size_t, size_t>> chunks;
+    const size_t chunkSize = std::max<size_t>( 64, components.size() / ( 4 * QThread::idealThreadCount() ) + 1 );
+    for( size_t i = 0; i < components.size(); i += chunkSize ) {
+        chunks.emplace_back( i, std::min( components.size(), i + chunkSize ) );
+    }
+    QtConcurrent::blockingMap( chunks, [&]( const std::pair<size_t, size_t>& chunk ) {
+        CComponentLabeling starLabeling;
+        starLabeling.SetParallel( false );
+        for( size_t i = chunk.first; i < chunk.second; i++ ) {
+            const auto& c = components[i];
+            // Background and noise at the peak are taken for the whole star
+            const int bg = mesh.Background( c.PeakX, c.PeakY );
+            const int sigma = mesh.Sigma( c.PeakX, c.PeakY );
+            if( c.Peak < bg + detectionSigmas * sigma ) {
+                continue;
             }
+            auto region = std::make_shared<DetectionRegion>();
+            region->Vmax = c.Peak;
+            region->Xmax = c.PeakX;
+            region->Ymax = c.PeakY;
+            region->Cmax = c.PeakCount;
+            region->MinX = c.MinX;
+            region->MinY = c.MinY;
+            region->MaxX = c.MaxX;
+            region->MaxY = c.MaxY;
+            // Area and flux in pixels of the frame
+            region->AreaAtHalfDetectionThreshold = c.Area * results.Scale * results.Scale;
+            region->FluxAtHalfDetectionThreshold = ( c.Flux - c.Area * bg ) * results.Scale * results.Scale;
+            region->Background = bg;
+
+            labeling.ForEachPixel( i, [&]( int x, int y ) { mask->At( x, y ) = 32; } );
+            // Brighter parts of the star are within its bounding box
+            const int vmax = c.Peak;
+            const int bx = c.MinX;
+            const int by = c.MinY;
+            const int bw = c.MaxX - c.MinX + 1;
+            const int bh = c.MaxY - c.MinY + 1;
+            int base = bg + ( vmax - bg ) / 10;
+            if( base > bg + halfDetectionSigmas * sigma ) {
+                starMask( starLabeling, image.get(), c.PeakX, c.PeakY, base, 64, mask.get(), bx, by, bw, bh, &labeling, i );
+            }
+            starMask( starLabeling, image.get(), c.PeakX, c.PeakY, bg + ( vmax - bg ) / 2, 128, mask.get(), bx, by, bw, bh, &labeling, i );
+            starMask( starLabeling, image.get(), c.PeakX, c.PeakY, bg + 9 * ( vmax - bg ) / 10, 255, mask.get(), bx, by, bw, bh, &labeling, i );
+            stars[i] = region;
+        }
+    } );
+    // In the order of components (the same as on one thread)
+    for( auto& region : stars ) {
+        if( region != 0 ) {
+            regions.push_back( region );
         }
     }
     results.Mask = mask;
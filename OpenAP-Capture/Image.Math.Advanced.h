@@ -5,10 +5,25 @@
 
 #include <Image.Math.h>
 #include <Image.RawImage.h>
+#include <Image.Background.h>
+#include <Image.RadialProfile.h>
 
 struct CChannelStat {
     unsigned int Median;
     unsigned int Sigma;
+
+    bool operator == ( const CChannelStat& other ) const { return Median == other.Median && Sigma == other.Sigma; }
+    bool operator != ( const CChannelStat& other ) const { return not( *this == other ); }
+};
+
+// Linear stretch of each channel from Median to Median + 12 * Sigma
+struct CStretchParams {
+    CChannelStat R;
+    CChannelStat G;
+    CChannelStat B;
+
+    bool operator == ( const CStretchParams& other ) const { return R == other.R && G == other.G && B == other.B; }
+    bool operator != ( const CStretchParams& other ) const { return not( *this == other ); }
 };
 
 class CPixelStatistics {
@@ -24,6 +39,7 @@ public:
     size_t maxP( int channel, int start, int end ) const;
 
     void setCount( int _count ) { count = _count; }
+    int totalCount() const { return count; }
 
 private:
     const size_t channelSize;
@@ -31,6 +47,22 @@ private:
     int count = 0;
 };
 
+enum TSamplingMode {
+    SM_Exact, // All quads
+    SM_Strided, // Regular grid of quads
+    SM_Random // Pseudo-random quads (fixed seed)
+};
+
+// Stretch parameters estimated from a subset of CFA quads
+struct CStretchEstimate {
+    CStretchParams Params;
+    int SampleCount = 0;
+    bool IsExact = false;
+    // Estimated standard errors (in ADU) of Median and Sigma for R, G and B (zero when exact)
+    double MedianError[3] = { 0, 0, 0 };
+    double SigmaError[3] = { 0, 0, 0 };
+};
+
 struct DetectionRegion {
     int Vmax;
     int Xmax;
@@ -43,12 +75,70 @@ struct DetectionRegion {
     int AreaAt10PercentOfMax;
     int AreaAtHalfDetectionThreshold;
     unsigned FluxAtHalfDetectionThreshold;
+    // Bounding box at the half detection threshold (inclusive)
+    int MinX;
+    int MinY;
+    int MaxX;
+    int MaxY;
 };
 
+// Regions are in pixels of Image and Mask. A pixel of Image is Scale x Scale pixels of the frame, the first one
+// starts at X0, Y0 of the frame
 struct DetectionResults {
     std::vector<std::shared_ptr<DetectionRegion>> DetectionRegions;
     std::shared_ptr<CGrayU16Image> Image;
     std::shared_ptr<CGrayImage> Mask;
+    int Scale = 1;
+    int X0 = 0;
+    int Y0 = 0;
+};
+
+// Stars of a frame as a structure of arrays, the brightest first. Positions are in pixels of the frame.
+// Only centroids and measurements are kept, so a catalog takes a few bytes per star
+struct CStarCatalog {
+    std::vector<float> X;
+    std::vector<float> Y;
+    // Above the background at the half detection threshold
+    std::vector<float> Flux;
+    std::vector<unsigned short> Peak;
+    std::vector<int> Area;
+
+    size_t Size() const { return X.size(); }
+    bool IsEmpty() const { return X.empty(); }
+    void Add( float x, float y, float flux, unsigned short peak, int area );
+
+    // Centroids of the brightest stars (all when maxCount is 0). The images of the detection are not referenced
+    static CStarCatalog Extract( const DetectionResults&, size_t maxCount = 0 );
+};
+
+// The last catalogs of a series of frames in a ring buffer of fixed depth, memory does not grow with the series
+class CStarCatalogHistory {
+public:
+    static const int DefaultDepth = 64;
+
+    CStarCatalogHistory( int depth = DefaultDepth );
+
+    // Drops the oldest catalog when the history is full
+    void Push( CStarCatalog&& );
+    void Clear() { count = 0; }
+    // Keeps the newest catalogs
+    void SetDepth( int depth );
+    int Depth() const { return static_cast<int>( catalogs.size() ); }
+
+    int Size() const { return count; }
+    // From the oldest (0) to the newest (Size() - 1)
+    const CStarCatalog& operator [] ( int index ) const { return catalogs[( first + index ) % catalogs.size()]; }
+    const CStarCatalog& Back() const { return ( *this )[count - 1]; }
+
+private:
+    std::vector<CStarCatalog> catalogs;
+    int first = 0;
+    int count = 0;
+};
+
+enum TDetectionMode {
+    DM_FullResolution, // Luminance of the debayered frame
+    DM_Superpixel // Luminance of 2x2 CFA superpixels (a quarter of the pixels, enough for centroids)
 };
 
 class CRawU16 {
@@ -58,14 +148,37 @@ public:
 
     std::shared_ptr<CRgbU16Image> DebayerRect( int x, int y, int width, int height ) const;
     std::shared_ptr<CGrayU16Image> GrayU16( int x, int y, int width, int height ) const;
+    // Luminance of 2x2 CFA superpixels for a full resolution rect (x and y should be even), result is width/2 x height/2
+    std::shared_ptr<CGrayU16Image> GrayU16HalfRes( int x, int y, int width, int height ) const;
 
     CPixelStatistics CalculateStatistics( int x, int y, int width, int height ) const;
 
+    // Stretch parameters of the rect (the same as used by Stretch and StretchHalfRes). Estimated from a subset
+    // of the rect for large rects, so that stretching is a single pass over the frame
+    CStretchParams StretchParams( int x, int y, int w, int h, bool exact = false ) const;
+    // Exact statistics are computed when asked or when the rect has no more than sampleCount quads
+    CStretchEstimate EstimateStretchParams( int x, int y, int w, int h, TSamplingMode = SM_Strided, int sampleCount = 65536 ) const;
+
     std::shared_ptr<CRgbImage> Stretch( int x, int y, int w, int h ) const;
     std::shared_ptr<CRgbImage> StretchHalfRes( int x, int y, int w, int h ) const;
+    // Stretch with known parameters (e.g. to render parts of the same view separately)
+    std::shared_ptr<CRgbImage> Stretch( const CStretchParams&, int x, int y, int w, int h ) const;
+    std::shared_ptr<CRgbImage> StretchHalfRes( const CStretchParams&, int x, int y, int w, int h ) const;
+    std::shared_ptr<CRgbImage> StretchBinned( const CStretchParams&, int factor, int x, int y, int w, int h ) const;
+    // The same into a result of the output size (e.g. a reused render buffer). Pixels of the result are overwritten.
+    // Scratch keeps a few debayered rows (reused by the caller across frames, so that nothing is allocated)
+    void Stretch( const CStretchParams&, int x, int y, int w, int h, CRgbImage* result, std::vector<ushort>& scratch ) const;
+    void StretchHalfRes( const CStretchParams&, int x, int y, int w, int h, CRgbImage* result ) const;
+    void StretchBinned( const CStretchParams&, int factor, int x, int y, int w, int h, CRgbImage* result,
+        std::vector<ushort>& scratch ) const;
     std::shared_ptr<CRgbImage> StretchQuarterRes( int x, int y, int w, int h ) const;
+    // Binned by factor (2, 4, 8 etc) in 16 bits before stretching, result is w/factor x h/factor
+    std::shared_ptr<CRgbImage> StretchBinned( int factor, int x, int y, int w, int h ) const;
 
-    DetectionResults DetectStars( int x, int y, int w, int h ) const;
+    // Background is estimated for the frame unless the mesh (possibly reused from earlier frames) is given.
+    // For superpixels x and y are rounded down to even
+    DetectionResults DetectStars( int x, int y, int w, int h, CBackgroundMesh* background = nullptr,
+        TDetectionMode mode = DM_FullResolution ) const;
 
     static std::shared_ptr<CGrayU16Image> ToGrayU16( const CRgbU16Image* );
     static std::shared_ptr<CGrayImage> ToGray( const CGrayU16Image* );
@@ -82,6 +195,40 @@ private:
     int bitDepth;
 };
 
+// Stretch parameters tracked across consecutive frames of the same view (continuous capture). Sky background
+// changes slowly, so parameters of the previous frame are updated with a moving average of a small sample of
+// each new frame. Full statistics are recomputed when the sample drifts too far or the rect changes.
+// Smoothing also removes flicker of the stretched view caused by the noise of the statistics
+class CStretchTracker {
+public:
+    // Stretch parameters for the rect of the new frame
+    CStretchParams Update( const CRawU16&, int x, int y, int w, int h );
+    // The next update recomputes full statistics
+    void Reset() { isValid = false; }
+
+    // Whether full statistics were computed by the last update
+    bool IsFullUpdate() const { return isFullUpdate; }
+
+    // Weight of a new frame in the moving average
+    static constexpr double Smoothing = 0.25;
+    // Drift of the sampled median from the tracked one (in tracked sigmas) that forces full statistics
+    static constexpr double MaxMedianDrift = 1.0;
+    // Relative change of the sampled sigma that forces full statistics
+    static constexpr double MaxSigmaDrift = 0.3;
+    static const int SampleCount = 16384;
+
+private:
+    bool isValid = false;
+    bool isFullUpdate = false;
+    int x = 0;
+    int y = 0;
+    int w = 0;
+    int h = 0;
+    // Not rounded, so that slow changes are not lost
+    double median[3] = { 0, 0, 0 };
+    double sigma[3] = { 0, 0, 0 };
+};
+
 class CFocusingHelper {
 public:
     CFocusingHelper() {}
@@ -93,6 +240,8 @@ public:
     int cx = 0;
     int cy = 0;
     double HFD = 0;
+    double FWHM = 0;
+    int Max = 0;
     double CX = 0;
     double CY = 0;
     std::shared_ptr<const CGrayImage> Mask;
@@ -113,7 +262,8 @@ public:
         std::vector<double> CX;
         std::vector<double> CY;
 
-        std::vector<DetectionResults> theDetectionResults;
+        // Stars of the last frames (when detected)
+        CStarCatalogHistory Catalogs;
     };
 
     std::shared_ptr<Data> currentSeries;
@@ -170,5 +320,16 @@ public:
     }
 
     bool isGlobalPolarAlign = false;
+    // Brightest stars of each frame kept for the alignment
+    static const int MaxCatalogStars = 200;
+    // Background of the frames for star detection, re-estimated every few frames
+    CBackgroundMesh background { CBackgroundMesh::DefaultCellSize, 8 };
+    // Subpixel distances for the HFD
+    CHfdTable hfdTable;
     void toggleGlobalPolarAllign() { isGlobalPolarAlign = !isGlobalPolarAlign; }
+
+private:
+    // Everything of one star in the frame that does not touch the other helpers (called on a worker thread)
+    void measure( const CRawU16Image*, int imageSize, bool isStacked );
+    void addToSeries( int focuserPos, CStarCatalog&& stars );
 };
@@ -0,0 +1,291 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Image.PhaseCorrelation.h"
+
+#include <algorithm>
+#include <cmath>
+
+CPhaseCorrelation::CPhaseCorrelation( int _size, TFftWindow windowType ) :
+    size( _size ),
+    fft( _size, _size ),
+    window( _size, 1.0f ),
+    roi( _size * _size ),
+    correlation( _size * _size ),
+    magnitude( fft.SpectrumWidth() * _size ),
+    spectrum( fft.SpectrumWidth() * _size ),
+    crossSpectrum( fft.SpectrumWidth() * _size ),
+    logPolarSpectrum( fft.SpectrumWidth() * _size ),
+    referenceSpectrum( fft.SpectrumWidth() * _size )
+{
+    if( windowType == FW_Hann ) {
+        for( int i = 0; i < size; i++ ) {
+            window[i] = static_cast<float>( 0.5 - 0.5 * std::cos( 2 * M_PI * ( i + 0.5 ) / size ) );
+        }
+    }
+
+    const int spectrumWidth = fft.SpectrumWidth();
+    // Whitened spectra are dominated by noise at high frequencies. A Gaussian taper makes the correlation peak a smooth
+    // Gaussian of about a pixel, which is also what the subpixel interpolation expects. The lowest frequencies come from
+    // the window and the gradients (the same in unrelated ROIs) and are removed. Normalized so that identical ROIs
+    // correlate to 1
+    bandPass.resize( spectrumWidth * size );
+    double sum = 0;
+    for( int v = 0; v < size; v++ ) {
+        const double fy = static_cast<double>( v <= size / 2 ? v : v - size ) / size;
+        for( int u = 0; u < spectrumWidth; u++ ) {
+            const double fx = static_cast<double>( u ) / size;
+            const double f2 = fx * fx + fy * fy;
+            const double cut = static_cast<double>( LowCutBins ) / size;
+            const double value = std::exp( -f2 / ( 2 * LowPassSigma * LowPassSigma ) ) * ( 1 - std::exp( -f2 / ( 2 * cut * cut ) ) );
+            bandPass[v * spectrumWidth + u] = static_cast<float>( value );
+            // Columns other than the first and the last stand for two columns of the full spectrum
+            sum += ( u == 0 || u == size / 2 ) ? value : 2 * value;
+        }
+    }
+    for( float& value : bandPass ) {
+        value = static_cast<float>( value * size * size / sum );
+    }
+
+    // Low frequencies of the magnitude do not change with rotation of the ROI (they come from its edges and gradients),
+    // so they are suppressed before the log-polar resampling
+    highPass.resize( spectrumWidth * size );
+    for( int v = 0; v < size; v++ ) {
+        const double cy = std::cos( M_PI * ( v <= size / 2 ? v : v - size ) / size );
+        for( int u = 0; u < spectrumWidth; u++ ) {
+            const double c = std::cos( M_PI * u / size ) * cy;
+            highPass[v * spectrumWidth + u] = static_cast<float>( ( 1 - c ) * ( 2 - c ) );
+        }
+    }
+
+    // The magnitude of the spectrum of a real image is symmetric, so angles 0..pi cover all directions
+    logRadiusStep = std::log( size / 2.0 ) / size;
+    logPolarSamples.resize( size * size );
+    for( int a = 0; a < size; a++ ) {
+        const double angle = M_PI * a / size;
+        for( int j = 0; j < size; j++ ) {
+            const double radius = std::exp( j * logRadiusStep );
+            double fx = radius * std::cos( angle );
+            double fy = radius * std::sin( angle );
+            if( fx < 0 ) {
+                fx = -fx;
+                fy = -fy;
+            }
+            if( fy < 0 ) {
+                fy += size;
+            }
+            const int u0 = std::min( static_cast<int>( fx ), spectrumWidth - 2 );
+            const int v0 = std::min( static_cast<int>( fy ), size - 1 );
+            const int v1 = ( v0 + 1 ) % size;
+            CLogPolarSample& sample = logPolarSamples[a * size + j];
+            sample.Index00 = v0 * spectrumWidth + u0;
+            sample.Index10 = v0 * spectrumWidth + u0 + 1;
+            sample.Index01 = v1 * spectrumWidth + u0;
+            sample.Index11 = v1 * spectrumWidth + u0 + 1;
+            sample.Fx = static_cast<float>( fx - u0 );
+            sample.Fy = static_cast<float>( fy - v0 );
+        }
+    }
+}
+
+void CPhaseCorrelation::SetReference( const CGrayU16Image* image, int x, int y )
+{
+    load( image, x, y );
+    fft.Forward( roi.data(), referenceSpectrum.data() );
+    if( isRotationAndScale ) {
+        referenceLogPolarSpectrum.resize( referenceSpectrum.size() );
+        logPolar( referenceSpectrum );
+        fft.Forward( roi.data(), referenceLogPolarSpectrum.data() );
+    }
+    referenceX = x;
+    referenceY = y;
+    hasReference = true;
+}
+
+CPhaseCorrelationResult CPhaseCorrelation::Register( const CGrayU16Image* image, int x, int y )
+{
+    CPhaseCorrelationResult result;
+    if( not hasReference || ( isRotationAndScale && referenceLogPolarSpectrum.empty() ) ) {
+        return result;
+    }
+    load( image, x, y );
+    fft.Forward( roi.data(), spectrum.data() );
+
+    double dx = 0;
+    double dy = 0;
+    double secondPeak = 0;
+    if( not isRotationAndScale ) {
+        result.Peak = correlate( referenceSpectrum, spectrum, dx, dy, &secondPeak );
+    } else {
+        logPolar( spectrum );
+        fft.Forward( roi.data(), logPolarSpectrum.data() );
+        double logScaleShift;
+        double angleShift;
+        correlate( referenceLogPolarSpectrum, logPolarSpectrum, logScaleShift, angleShift );
+        const double scale = std::exp( -logScaleShift * logRadiusStep );
+        const double angle = angleShift * M_PI / size;
+        // The magnitude does not tell the angle from the opposite one, the shift is found for both
+        for( double candidate : { angle, angle + M_PI } ) {
+            load( image, x, y, candidate, scale );
+            fft.Forward( roi.data(), spectrum.data() );
+            double cdx;
+            double cdy;
+            double candidateSecondPeak;
+            const double peak = correlate( referenceSpectrum, spectrum, cdx, cdy, &candidateSecondPeak );
+            if( peak > result.Peak ) {
+                result.Peak = peak;
+                secondPeak = candidateSecondPeak;
+                result.Angle = std::remainder( candidate, 2 * M_PI );
+                result.Scale = scale;
+                dx = cdx;
+                dy = cdy;
+            }
+        }
+    }
+
+    // The shift was measured in the rotated and scaled ROI
+    const double c = result.Scale * std::cos( result.Angle );
+    const double s = result.Scale * std::sin( result.Angle );
+    result.Dx = c * dx - s * dy + ( x - referenceX );
+    result.Dy = s * dx + c * dy + ( y - referenceY );
+    result.Significance = secondPeak > 0 ? result.Peak / secondPeak : result.Peak / MinPeak;
+    result.IsValid = result.Peak >= MinPeak && result.Significance >= MinSignificance;
+    return result;
+}
+
+void CPhaseCorrelation::load( const CGrayU16Image* image, int x, int y, double angle, double scale )
+{
+    const int width = image->Width();
+    const int height = image->Height();
+    // Pixels outside of the image get the mean of the ROI (marked as negative first)
+    double sum = 0;
+    int count = 0;
+    if( angle == 0 && scale == 1 ) {
+        const int i0 = std::max( 0, -x );
+        const int i1 = std::max( i0, std::min( size, width - x ) );
+        for( int j = 0; j < size; j++ ) {
+            float* dst = roi.data() + j * size;
+            const int sy = y + j;
+            if( sy < 0 || sy >= height ) {
+                std::fill( dst, dst + size, -1.0f );
+                continue;
+            }
+            const unsigned short* src = image->ScanLine( sy ) + x;
+            std::fill( dst, dst + i0, -1.0f );
+            unsigned int rowSum = 0;
+            for( int i = i0; i < i1; i++ ) {
+                dst[i] = src[i];
+                rowSum += src[i];
+            }
+            std::fill( dst + i1, dst + size, -1.0f );
+            sum += rowSum;
+            count += i1 - i0;
+        }
+    } else {
+        // Bilinear samples of the frame rotated and scaled about the center of the ROI
+        const double center = ( size - 1 ) / 2.0;
+        const double c = scale * std::cos( angle );
+        const double s = scale * std::sin( angle );
+        for( int j = 0; j < size; j++ ) {
+            float* dst = roi.data() + j * size;
+            for( int i = 0; i < size; i++ ) {
+                const double sx = x + center + c * ( i - center ) - s * ( j - center );
+                const double sy = y + center + s * ( i - center ) + c * ( j - center );
+                const int x0 = static_cast<int>( std::floor( sx ) );
+                const int y0 = static_cast<int>( std::floor( sy ) );
+                if( x0 < 0 || y0 < 0 || x0 + 1 >= width || y0 + 1 >= height ) {
+                    dst[i] = -1.0f;
+                    continue;
+                }
+                const double fx = sx - x0;
+                const double fy = sy - y0;
+                const unsigned short* p0 = image->ScanLine( y0 ) + x0;
+                const unsigned short* p1 = image->ScanLine( y0 + 1 ) + x0;
+                const double value = ( 1 - fy ) * ( ( 1 - fx ) * p0[0] + fx * p0[1] ) + fy * ( ( 1 - fx ) * p1[0] + fx * p1[1] );
+                dst[i] = static_cast<float>( value );
+                sum += value;
+                count++;
+            }
+        }
+    }
+    const float mean = count > 0 ? static_cast<float>( sum / count ) : 0.0f;
+    for( int j = 0; j < size; j++ ) {
+        float* dst = roi.data() + j * size;
+        for( int i = 0; i < size; i++ ) {
+            dst[i] = dst[i] < 0 ? 0.0f : ( dst[i] - mean ) * window[i] * window[j];
+        }
+    }
+}
+
+void CPhaseCorrelation::logPolar( const std::vector<std::complex<float>>& source )
+{
+    for( size_t i = 0; i < magnitude.size(); i++ ) {
+        magnitude[i] = std::abs( source[i] ) * highPass[i];
+    }
+    // Angles are cyclic, only the radius is windowed
+    double sum = 0;
+    for( size_t i = 0; i < logPolarSamples.size(); i++ ) {
+        const CLogPolarSample& s = logPolarSamples[i];
+        const float top = magnitude[s.Index00] + s.Fx * ( magnitude[s.Index10] - magnitude[s.Index00] );
+        const float bottom = magnitude[s.Index01] + s.Fx * ( magnitude[s.Index11] - magnitude[s.Index01] );
+        roi[i] = top + s.Fy * ( bottom - top );
+        sum += roi[i];
+    }
+    const float mean = static_cast<float>( sum / roi.size() );
+    for( int a = 0; a < size; a++ ) {
+        float* row = roi.data() + a * size;
+        for( int j = 0; j < size; j++ ) {
+            row[j] = ( row[j] - mean ) * window[j];
+        }
+    }
+}
+
+double CPhaseCorrelation::correlate( const std::vector<std::complex<float>>& reference, const std::vector<std::complex<float>>& current,
+    double& dx, double& dy, double* secondPeak )
+{
+    // conj( reference ) * current peaks at the shift of the current ROI
+    for( size_t i = 0; i < crossSpectrum.size(); i++ ) {
+        const float re = reference[i].real() * current[i].real() + reference[i].imag() * current[i].imag();
+        const float im = reference[i].real() * current[i].imag() - reference[i].imag() * current[i].real();
+        const float norm = std::sqrt( re * re + im * im );
+        const float weight = norm > 1e-20f ? bandPass[i] / norm : 0.0f;
+        crossSpectrum[i] = std::complex<float>( re * weight, im * weight );
+    }
+    fft.Inverse( crossSpectrum.data(), correlation.data() );
+
+    const int peakIndex = static_cast<int>( std::max_element( correlation.begin(), correlation.end() ) - correlation.begin() );
+    const int px = peakIndex % size;
+    const int py = peakIndex / size;
+    auto at = [&]( int x, int y ) { return correlation[( ( y + size ) % size ) * size + ( x + size ) % size]; };
+    // Parabolas through the logarithms of the peak and its neighbours (exact for a Gaussian peak)
+    auto offset = [&]( float left, float center, float right ) {
+        if( left <= 0 || right <= 0 ) {
+            return 0.0;
+        }
+        const double l = std::log( left );
+        const double c = std::log( center );
+        const double r = std::log( right );
+        const double denominator = l - 2 * c + r;
+        return denominator < 0 ? std::max( -0.5, std::min( 0.5, 0.5 * ( l - r ) / denominator ) ) : 0.0;
+    };
+    const float peak = correlation[peakIndex];
+    dx = ( px > size / 2 ? px - size : px ) + offset( at( px - 1, py ), peak, at( px + 1, py ) );
+    dy = ( py > size / 2 ? py - size : py ) + offset( at( px, py - 1 ), peak, at( px, py + 1 ) );
+
+    if( secondPeak != nullptr ) {
+        // The highest correlation outside of the neighbourhood of the peak
+        float second = 0;
+        for( int y = 0; y < size; y++ ) {
+            const int distanceY = std::min( std::abs( y - py ), size - std::abs( y - py ) );
+            const float* row = correlation.data() + y * size;
+            for( int x = 0; x < size; x++ ) {
+                const int distanceX = std::min( std::abs( x - px ), size - std::abs( x - px ) );
+                if( row[x] > second && ( distanceX > PeakRadius || distanceY > PeakRadius ) ) {
+                    second = row[x];
+                }
+            }
+        }
+        *secondPeak = second;
+    }
+    return peak;
+}
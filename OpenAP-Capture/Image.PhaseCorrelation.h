@@ -0,0 +1,98 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <Image.Image.h>
+#include <Math.Fft.h>
+
+#include <complex>
+#include <vector>
+
+enum TFftWindow {
+    FW_None,
+    FW_Hann // Suppresses the edges of the ROI, which otherwise correlate as a strong cross at zero shift
+};
+
+struct CPhaseCorrelationResult {
+    bool IsValid = false;
+    // A point p of the reference goes to C + Scale * Rotation( Angle ) * ( p - C ) + ( Dx, Dy ) of the frame, where C is
+    // the center of the reference ROI. The shift includes the difference of the positions of the ROIs
+    double Dx = 0;
+    double Dy = 0;
+    double Angle = 0; // Radians
+    double Scale = 1;
+    // Height of the correlation peak, 1 for identical ROIs and close to 0 for unrelated ones
+    double Peak = 0;
+    // The peak relative to the highest correlation elsewhere. Unrelated ROIs with a lot of structure can correlate
+    // noticeably at some shift, but not at one shift much more than at the others
+    double Significance = 0;
+};
+
+// Registration of frames by the phase of their Fourier spectra. Works with any structure of the image, so it is used
+// where there are not enough stars to match: the Moon, the Sun, planets, frames through clouds.
+// The ROI is a square of a power of two size. FFT plans, buffers and the spectrum of the reference are made once,
+// so registering a sequence of frames against the same reference costs one forward and one inverse transform per frame
+// (without rotation). Rotation and scale are found from the log-polar resampled magnitudes of the spectra
+class CPhaseCorrelation {
+public:
+    static const int DefaultSize = 512;
+    // Lower peaks are indistinguishable from noise
+    static constexpr double MinPeak = 0.05;
+    static constexpr double MinSignificance = 3;
+
+    CPhaseCorrelation( int size = DefaultSize, TFftWindow window = FW_Hann );
+
+    int Size() const { return size; }
+    // Off by default (only the shift is estimated)
+    void SetRotationAndScale( bool value ) { isRotationAndScale = value; }
+
+    // ROIs have the top left corner at x, y. Pixels outside of the image are ignored
+    void SetReference( const CGrayU16Image*, int x, int y );
+    bool HasReference() const { return hasReference; }
+    CPhaseCorrelationResult Register( const CGrayU16Image*, int x, int y );
+
+private:
+    const int size;
+    CRealFft2D fft;
+    bool isRotationAndScale = false;
+    std::vector<float> window;
+    std::vector<float> roi;
+    std::vector<float> correlation;
+    std::vector<float> magnitude;
+    std::vector<std::complex<float>> spectrum;
+    std::vector<std::complex<float>> crossSpectrum;
+    std::vector<std::complex<float>> logPolarSpectrum;
+
+    bool hasReference = false;
+    int referenceX = 0;
+    int referenceY = 0;
+    std::vector<std::complex<float>> referenceSpectrum;
+    std::vector<std::complex<float>> referenceLogPolarSpectrum;
+
+    // Bilinear samples of the magnitude of the spectrum on the log-polar grid: angles 0..pi by rows and logarithms
+    // of radii from 1 to size / 2 by columns
+    struct CLogPolarSample {
+        int Index00; // Top left of the 2x2 neighbourhood in the spectrum
+        int Index10;
+        int Index01;
+        int Index11;
+        float Fx;
+        float Fy;
+    };
+    std::vector<CLogPolarSample> logPolarSamples;
+    std::vector<float> highPass;
+    // Weights of the cross-power spectrum: Gaussian with the sigma in cycles per pixel, without the lowest frequencies
+    static constexpr double LowPassSigma = 0.15;
+    static const int LowCutBins = 2;
+    std::vector<float> bandPass;
+    double logRadiusStep;
+
+    void load( const CGrayU16Image*, int x, int y, double angle = 0, double scale = 1 );
+    void logPolar( const std::vector<std::complex<float>>& spectrum );
+    // Cross-power spectrum normalized to unit magnitudes, back to the image plane and the subpixel peak (cyclic shift)
+    double correlate( const std::vector<std::complex<float>>& reference, const std::vector<std::complex<float>>& current,
+        double& dx, double& dy, double* secondPeak = nullptr );
+    // Half size of the neighbourhood of the peak excluded from the search of the second peak
+    static const int PeakRadius = 3;
+};
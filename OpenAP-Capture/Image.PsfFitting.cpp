@@ -0,0 +1,414 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Image.PsfFitting.h"
+
+#include <Math.LinearAlgebra.h>
+
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
+
+#include <algorithm>
+#include <cmath>
+
+enum TPsfParameter {
+    PP_Background,
+    PP_Amplitude,
+    PP_X,
+    PP_Y,
+    PP_A, // q = a * dx^2 + 2 * b * dx * dy + c * dy^2
+    PP_B,
+    PP_C,
+    PP_Beta, // Moffat only
+    PP_Count
+};
+
+// Fits one star at a time. Buffers are reused for all stars of a chunk
+class CPsfSolver {
+public:
+    CPsfSolver( TPsfModel model, int size );
+
+    CPsfFit Fit( const float* values, const float* weights );
+
+private:
+    const TPsfModel model;
+    const int size;
+    const int count;
+    const int numberOfParameters;
+    // Coordinates of the pixels in the cutout
+    std::vector<double> gx;
+    std::vector<double> gy;
+    // Per pixel: elliptical distance, profile shape (without amplitude) and weighted residuals
+    std::vector<double> q;
+    std::vector<double> shape;
+    std::vector<double> residuals;
+    // Weighted derivatives of the model by each parameter, numberOfParameters x count
+    std::vector<double> jacobian;
+    CMatrix<double> normal;
+    CMatrix<double> damped;
+    CMatrix<double> gradient;
+    CMatrix<double> step;
+    CSolveSystemOfLinearEquationsCache cache;
+
+    bool initialGuess( const float* values, const float* weights, double* p ) const;
+    bool isValid( const double* p ) const;
+    // Sum of squared weighted residuals, derivatives are computed when asked
+    double evaluate( const float* values, const float* weights, const double* p, bool withJacobian );
+    void normalEquations();
+    void result( CPsfFit&, const double* p ) const;
+};
+
+CPsfSolver::CPsfSolver( TPsfModel _model, int _size ) :
+    model( _model ), size( _size ), count( _size * _size ), numberOfParameters( _model == PSF_Moffat ? PP_Count : PP_Beta ),
+    gx( count ), gy( count ), q( count ), shape( count ), residuals( count ), jacobian( numberOfParameters * count ),
+    normal( numberOfParameters, numberOfParameters ), damped( numberOfParameters, numberOfParameters ),
+    gradient( numberOfParameters, 1 ), step( numberOfParameters, 1 )
+{
+    for( int i = 0; i < count; i++ ) {
+        gx[i] = i % size;
+        gy[i] = i / size;
+    }
+}
+
+bool CPsfSolver::initialGuess( const float* values, const float* weights, double* p ) const
+{
+    // Background is the median of the border of the cutout
+    std::vector<float> border;
+    for( int i = 0; i < count; i++ ) {
+        const int x = i % size;
+        const int y = i / size;
+        if( weights[i] > 0 && ( x == 0 || y == 0 || x == size - 1 || y == size - 1 ) ) {
+            border.push_back( values[i] );
+        }
+    }
+    if( border.empty() ) {
+        return false;
+    }
+    std::nth_element( border.begin(), border.begin() + border.size() / 2, border.end() );
+    const double background = border[border.size() / 2];
+
+    // The peak is near the center of the cutout
+    const int center = size / 2;
+    double peak = -1;
+    for( int y = center - 2; y <= center + 2; y++ ) {
+        for( int x = center - 2; x <= center + 2; x++ ) {
+            const int i = y * size + x;
+            if( weights[i] > 0 && values[i] > peak ) {
+                peak = values[i];
+            }
+        }
+    }
+    const double amplitude = peak - background;
+    if( amplitude <= 0 ) {
+        return false;
+    }
+
+    // Centroid and area above the half maximum
+    const double halfMax = background + amplitude / 2;
+    double sumV = 0;
+    double sumVX = 0;
+    double sumVY = 0;
+    int area = 0;
+    for( int i = 0; i < count; i++ ) {
+        const double v = weights[i] * ( values[i] - halfMax );
+        if( v > 0 ) {
+            sumV += v;
+            sumVX += v * gx[i];
+            sumVY += v * gy[i];
+            area++;
+        }
+    }
+    const double fwhm = std::max( 1.0, 2 * std::sqrt( area / M_PI ) );
+
+    p[PP_Background] = background;
+    p[PP_Amplitude] = amplitude;
+    p[PP_X] = sumV > 0 ? sumVX / sumV : center;
+    p[PP_Y] = sumV > 0 ? sumVY / sumV : center;
+    // Round profile of the same FWHM
+    if( model == PSF_Moffat ) {
+        p[PP_Beta] = 3;
+        p[PP_A] = ( std::pow( 2.0, 1 / p[PP_Beta] ) - 1 ) * 4 / ( fwhm * fwhm );
+    } else {
+        p[PP_A] = 8 * M_LN2 / ( fwhm * fwhm );
+    }
+    p[PP_B] = 0;
+    p[PP_C] = p[PP_A];
+    return true;
+}
+
+bool CPsfSolver::isValid( const double* p ) const
+{
+    if( not( p[PP_Amplitude] > 0 && p[PP_A] > 0 && p[PP_C] > 0 && p[PP_A] * p[PP_C] > p[PP_B] * p[PP_B] ) ) {
+        return false;
+    }
+    // The center stays inside of the cutout
+    if( not( p[PP_X] >= 0 && p[PP_X] <= size - 1 && p[PP_Y] >= 0 && p[PP_Y] <= size - 1 ) ) {
+        return false;
+    }
+    return model != PSF_Moffat || ( p[PP_Beta] > 0.5 && p[PP_Beta] < 50 );
+}
+
+double CPsfSolver::evaluate( const float* values, const float* weights, const double* p, bool withJacobian )
+{
+    const double x0 = p[PP_X];
+    const double y0 = p[PP_Y];
+    const double a = p[PP_A];
+    const double b = p[PP_B];
+    const double c = p[PP_C];
+    for( int i = 0; i < count; i++ ) {
+        const double dx = gx[i] - x0;
+        const double dy = gy[i] - y0;
+        q[i] = a * dx * dx + 2 * b * dx * dy + c * dy * dy;
+    }
+    const double beta = model == PSF_Moffat ? p[PP_Beta] : 0;
+    if( model == PSF_Moffat ) {
+        for( int i = 0; i < count; i++ ) {
+            shape[i] = std::exp( -beta * std::log1p( q[i] ) );
+        }
+    } else {
+        for( int i = 0; i < count; i++ ) {
+            shape[i] = std::exp( -0.5 * q[i] );
+        }
+    }
+
+    const double background = p[PP_Background];
+    const double amplitude = p[PP_Amplitude];
+    double cost = 0;
+    for( int i = 0; i < count; i++ ) {
+        const double r = weights[i] * ( values[i] - background - amplitude * shape[i] );
+        residuals[i] = r;
+        cost += r * r;
+    }
+    if( not withJacobian ) {
+        return cost;
+    }
+
+    double* dB = jacobian.data() + PP_Background * count;
+    double* dA = jacobian.data() + PP_Amplitude * count;
+    double* dX = jacobian.data() + PP_X * count;
+    double* dY = jacobian.data() + PP_Y * count;
+    double* da = jacobian.data() + PP_A * count;
+    double* db = jacobian.data() + PP_B * count;
+    double* dc = jacobian.data() + PP_C * count;
+    for( int i = 0; i < count; i++ ) {
+        const double w = weights[i];
+        const double dx = gx[i] - x0;
+        const double dy = gy[i] - y0;
+        // Derivative of the model by q
+        const double dq = model == PSF_Moffat ? -w * amplitude * beta * shape[i] / ( 1 + q[i] ) : -0.5 * w * amplitude * shape[i];
+        dB[i] = w;
+        dA[i] = w * shape[i];
+        dX[i] = -2 * dq * ( a * dx + b * dy );
+        dY[i] = -2 * dq * ( b * dx + c * dy );
+        da[i] = dq * dx * dx;
+        db[i] = 2 * dq * dx * dy;
+        dc[i] = dq * dy * dy;
+    }
+    if( model == PSF_Moffat ) {
+        double* dBeta = jacobian.data() + PP_Beta * count;
+        for( int i = 0; i < count; i++ ) {
+            dBeta[i] = -weights[i] * amplitude * shape[i] * std::log1p( q[i] );
+        }
+    }
+    return cost;
+}
+
+void CPsfSolver::normalEquations()
+{
+    for( int j = 0; j < numberOfParameters; j++ ) {
+        const double* Jj = jacobian.data() + j * count;
+        for( int k = 0; k <= j; k++ ) {
+            const double* Jk = jacobian.data() + k * count;
+            double sum = 0;
+            for( int i = 0; i < count; i++ ) {
+                sum += Jj[i] * Jk[i];
+            }
+            normal[j][k] = normal[k][j] = sum;
+        }
+        double sum = 0;
+        for( int i = 0; i < count; i++ ) {
+            sum += Jj[i] * residuals[i];
+        }
+        gradient[j][0] = sum;
+    }
+}
+
+CPsfFit CPsfSolver::Fit( const float* values, const float* weights )
+{
+    CPsfFit fit;
+    double p[PP_Count];
+    if( not initialGuess( values, weights, p ) ) {
+        return fit;
+    }
+
+    double cost = evaluate( values, weights, p, true );
+    double lambda = 1e-3;
+    int iteration = 0;
+    bool isConverged = false;
+    while( iteration < CPsfFitter::MaxIterations && not isConverged ) {
+        iteration++;
+        normalEquations();
+
+        // Damping is increased until the step reduces the residuals
+        bool isAccepted = false;
+        while( not isAccepted && lambda < 1e10 ) {
+            for( int j = 0; j < numberOfParameters; j++ ) {
+                for( int k = 0; k < numberOfParameters; k++ ) {
+                    damped[j][k] = normal[j][k];
+                }
+                damped[j][j] += lambda * normal[j][j];
+            }
+            cache.P.clear();
+            double trial[PP_Count];
+            if( SolveSystemOfLinearEquations( step, cache, damped, gradient ) ) {
+                for( int j = 0; j < numberOfParameters; j++ ) {
+                    trial[j] = p[j] + step[j][0];
+                }
+                if( isValid( trial ) ) {
+                    const double trialCost = evaluate( values, weights, trial, false );
+                    if( trialCost < cost ) {
+                        isConverged = cost - trialCost < 1e-7 * cost;
+                        std::copy( trial, trial + numberOfParameters, p );
+                        cost = trialCost;
+                        isAccepted = true;
+                        lambda = std::max( 1e-7, lambda / 10 );
+                        break;
+                    }
+                }
+            }
+            lambda *= 10;
+        }
+        if( not isAccepted ) {
+            // No step reduces the residuals (at the minimum)
+            break;
+        }
+        if( not isConverged ) {
+            evaluate( values, weights, p, true );
+        }
+    }
+
+    double weight = 0;
+    for( int i = 0; i < count; i++ ) {
+        weight += weights[i];
+    }
+    if( weight <= numberOfParameters || not isValid( p ) ) {
+        return fit;
+    }
+    result( fit, p );
+    fit.Rms = std::sqrt( cost / weight );
+    fit.Iterations = iteration;
+    return fit;
+}
+
+void CPsfSolver::result( CPsfFit& fit, const double* p ) const
+{
+    const double a = p[PP_A];
+    const double b = p[PP_B];
+    const double c = p[PP_C];
+    // Eigenvalues of the quadratic form, the smaller one is along the major axis
+    const double mean = ( a + c ) / 2;
+    const double d = std::sqrt( ( a - c ) * ( a - c ) / 4 + b * b );
+    const double lambdaMinor = mean + d;
+    const double lambdaMajor = mean - d;
+    if( lambdaMajor <= 0 ) {
+        return;
+    }
+    // Half maximum is at q = qHalf
+    const double qHalf = model == PSF_Moffat ? std::pow( 2.0, 1 / p[PP_Beta] ) - 1 : 2 * M_LN2;
+
+    fit.X = p[PP_X];
+    fit.Y = p[PP_Y];
+    fit.Background = p[PP_Background];
+    fit.Amplitude = p[PP_Amplitude];
+    fit.FwhmMajor = 2 * std::sqrt( qHalf / lambdaMajor );
+    fit.FwhmMinor = 2 * std::sqrt( qHalf / lambdaMinor );
+    fit.Fwhm = std::sqrt( fit.FwhmMajor * fit.FwhmMinor );
+    fit.Eccentricity = std::sqrt( 1 - lambdaMajor / lambdaMinor );
+    // Direction of the larger eigenvalue turned by 90 degrees
+    double angle = 0.5 * std::atan2( 2 * b, a - c ) + M_PI / 2;
+    fit.Angle = angle > M_PI / 2 ? angle - M_PI : angle;
+    fit.Beta = model == PSF_Moffat ? p[PP_Beta] : 0;
+    // Profiles wider than the cutout are not measured
+    fit.IsValid = fit.FwhmMajor < size;
+}
+
+CPsfFitter::CPsfFitter( TPsfModel _model, int _radius ) :
+    model( _model ), radius( std::max( 2, _radius ) ), size( 2 * radius + 1 )
+{
+}
+
+void CPsfFitter::extractCutouts( CCutouts& cutouts, const CGrayU16Image* image, const std::vector<std::pair<int, int>>& peaks ) const
+{
+    const int count = size * size;
+    cutouts.Count = static_cast<int>( peaks.size() );
+    cutouts.Values.assign( cutouts.Count * count, 0 );
+    cutouts.Weights.assign( cutouts.Count * count, 0 );
+    cutouts.X0.resize( cutouts.Count );
+    cutouts.Y0.resize( cutouts.Count );
+    for( int n = 0; n < cutouts.Count; n++ ) {
+        const int x0 = peaks[n].first - radius;
+        const int y0 = peaks[n].second - radius;
+        cutouts.X0[n] = x0;
+        cutouts.Y0[n] = y0;
+        float* values = cutouts.Values.data() + n * count;
+        float* weights = cutouts.Weights.data() + n * count;
+        for( int y = std::max( 0, y0 ); y < std::min( image->Height(), y0 + size ); y++ ) {
+            const unsigned short* src = image->ScanLine( y );
+            const int offset = ( y - y0 ) * size - x0;
+            for( int x = std::max( 0, x0 ); x < std::min( image->Width(), x0 + size ); x++ ) {
+                values[offset + x] = src[x];
+                weights[offset + x] = src[x] < saturation ? 1 : 0;
+            }
+        }
+    }
+}
+
+std::vector<CPsfFit> CPsfFitter::Fit( const CGrayU16Image* image, const std::vector<std::pair<int, int>>& peaks ) const
+{
+    CCutouts cutouts;
+    extractCutouts( cutouts, image, peaks );
+    std::vector<CPsfFit> result( cutouts.Count );
+
+    std::vector<std::pair<int, int>> chunks;
+    const int chunkSize = std::max( 16, cutouts.Count / ( 4 * QThread::idealThreadCount() ) + 1 );
+    for( int i = 0; i < cutouts.Count; i += chunkSize ) {
+        chunks.emplace_back( i, std::min( cutouts.Count, i + chunkSize ) );
+    }
+    QtConcurrent::blockingMap( chunks, [&]( const std::pair<int, int>& chunk ) {
+        CPsfSolver solver( model, size );
+        const int count = size * size;
+        for( int n = chunk.first; n < chunk.second; n++ ) {
+            CPsfFit& fit = result[n];
+            fit = solver.Fit( cutouts.Values.data() + n * count, cutouts.Weights.data() + n * count );
+            // Fits that did not converge are left as the solver returned them
+            if( fit.IsValid ) {
+                fit.X += cutouts.X0[n];
+                fit.Y += cutouts.Y0[n];
+            }
+        }
+    } );
+    return result;
+}
+
+std::vector<CPsfFit> CPsfFitter::Fit( const DetectionResults& detection ) const
+{
+    std::vector<std::pair<int, int>> peaks;
+    peaks.reserve( detection.DetectionRegions.size() );
+    for( const auto& region : detection.DetectionRegions ) {
+        peaks.emplace_back( region->Xmax, region->Ymax );
+    }
+    auto result = Fit( detection.Image.get(), peaks );
+    // The center of a superpixel is between its pixels
+    const int scale = detection.Scale;
+    for( auto& fit : result ) {
+        if( not fit.IsValid ) {
+            continue;
+        }
+        fit.X = detection.X0 + scale * fit.X + 0.5 * ( scale - 1 );
+        fit.Y = detection.Y0 + scale * fit.Y + 0.5 * ( scale - 1 );
+        fit.FwhmMajor *= scale;
+        fit.FwhmMinor *= scale;
+        fit.Fwhm *= scale;
+    }
+    return result;
+}
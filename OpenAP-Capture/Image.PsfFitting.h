@@ -0,0 +1,76 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <Image.Math.Advanced.h>
+
+#include <vector>
+
+enum TPsfModel {
+    PSF_Gaussian, // B + A * exp( -q / 2 )
+    PSF_Moffat // B + A * ( 1 + q ) ^ -Beta, Beta is fitted as well
+};
+
+// Fitted profile of a star. q = a * dx^2 + 2 * b * dx * dy + c * dy^2 is the elliptical distance from the center
+struct CPsfFit {
+    // The center and the size of invalid fits are not in frame coordinates
+    bool IsValid = false;
+    // Center (pixel centers are at integer coordinates)
+    double X = 0;
+    double Y = 0;
+    double Background = 0;
+    double Amplitude = 0;
+    // FWHM along the major and minor axes, and their geometric mean
+    double FwhmMajor = 0;
+    double FwhmMinor = 0;
+    double Fwhm = 0;
+    // Angle of the major axis from the X axis (radians, -pi/2..pi/2)
+    double Angle = 0;
+    // 0 for round stars
+    double Eccentricity = 0;
+    // Moffat power (0 for Gaussian)
+    double Beta = 0;
+    // Residual RMS of the fit in ADU
+    double Rms = 0;
+    int Iterations = 0;
+};
+
+// Levenberg-Marquardt fitting of elliptical Gaussian or Moffat profiles to many stars at once.
+// Square cutouts around the stars are copied into one buffer (pixel values and weights of all stars one after
+// another), the stars are fitted on worker threads in chunks. Model values and derivatives are computed for all
+// pixels of a cutout in separate passes over contiguous arrays, the normal equations (7 or 8 parameters) are solved
+// with the LU decomposition from Math.LinearAlgebra
+class CPsfFitter {
+public:
+    static const int DefaultRadius = 7;
+    static const int MaxIterations = 30;
+
+    // Cutouts are ( 2 * radius + 1 ) x ( 2 * radius + 1 )
+    CPsfFitter( TPsfModel model = PSF_Gaussian, int radius = DefaultRadius );
+
+    // Pixels at or above saturation are excluded from the fit
+    void SetSaturation( int _saturation ) { saturation = _saturation; }
+
+    // Stars with peaks near the given pixels (e.g. peaks of detections). The result is in the order of the positions
+    std::vector<CPsfFit> Fit( const CGrayU16Image*, const std::vector<std::pair<int, int>>& peaks ) const;
+    // Stars of the detection results (in pixels of the frame, see DetectionResults)
+    std::vector<CPsfFit> Fit( const DetectionResults& ) const;
+
+private:
+    const TPsfModel model;
+    const int radius;
+    const int size;
+    int saturation = 65535;
+
+    // Cutouts of all stars
+    struct CCutouts {
+        int Count = 0;
+        std::vector<float> Values;
+        // 0 outside of the image and for saturated pixels
+        std::vector<float> Weights;
+        std::vector<int> X0;
+        std::vector<int> Y0;
+    };
+    void extractCutouts( CCutouts&, const CGrayU16Image*, const std::vector<std::pair<int, int>>& peaks ) const;
+};
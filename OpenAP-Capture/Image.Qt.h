@@ -26,6 +26,14 @@ inline QImage CreateImage( std::shared_ptr<const CRgbImage> image )
     return CreateImage( image->RgbPixels(), image->Width(), image->Height(), image->ByteWidth() );
 }
 
+// The QImage references the pixels of the image (no copy) and keeps the image alive until the QImage and all its copies are destroyed
+inline QImage ShareImage( std::shared_ptr<const CRgbImage> image )
+{
+    auto* handle = new std::shared_ptr<const CRgbImage>( image );
+    return QImage( image->RgbPixels(), image->Width(), image->Height(), image->ByteWidth(), QImage::Format_RGB888,
+        []( void* info ) { delete static_cast<std::shared_ptr<const CRgbImage>*>( info ); }, handle );
+}
+
 inline QPixmap CreatePixmap( const uchar* rgb, int width, int height, int byteWidth = -1 )
 {
     return QPixmap::fromImage( CreateImage( rgb, width, height, byteWidth ) );
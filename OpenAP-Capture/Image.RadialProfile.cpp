@@ -0,0 +1,208 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Image.RadialProfile.h"
+
+#include <algorithm>
+#include <cmath>
+
+void CRadialProfile::Build( const CGrayU16Image* image, double cx, double cy )
+{
+    const int width = image->Width();
+    const int height = image->Height();
+    const double farX = std::max( cx, width - 1 - cx );
+    const double farY = std::max( cy, height - 1 - cy );
+    const int bins = static_cast<int>( std::sqrt( farX * farX + farY * farY ) * BinsPerPixel ) + 1;
+    binCount.assign( bins, 0 );
+    binSum.assign( bins, 0 );
+    binSumVR.assign( bins, 0 );
+    binSumR.assign( bins, 0 );
+
+    for( int y = 0; y < height; y++ ) {
+        const unsigned short* src = image->ScanLine( y );
+        const double dy2 = ( y - cy ) * ( y - cy );
+        for( int x = 0; x < width; x++ ) {
+            const double r = std::sqrt( ( x - cx ) * ( x - cx ) + dy2 );
+            const int bin = std::min( static_cast<int>( r * BinsPerPixel ), bins - 1 );
+            binCount[bin]++;
+            binSum[bin] += src[x];
+            binSumVR[bin] += src[x] * r;
+            binSumR[bin] += r;
+        }
+    }
+
+    count.assign( bins + 1, 0 );
+    sum.assign( bins + 1, 0 );
+    sumVR.assign( bins + 1, 0 );
+    sumR.assign( bins + 1, 0 );
+    for( int i = 0; i < bins; i++ ) {
+        count[i + 1] = count[i] + binCount[i];
+        sum[i + 1] = sum[i] + binSum[i];
+        sumVR[i + 1] = sumVR[i] + binSumVR[i];
+        sumR[i + 1] = sumR[i] + binSumR[i];
+    }
+}
+
+int CRadialProfile::binAt( double r ) const
+{
+    return std::max( 0, std::min( static_cast<int>( count.size() ) - 1, static_cast<int>( std::ceil( r * BinsPerPixel ) ) ) );
+}
+
+int CRadialProfile::Count( double r0, double r1 ) const
+{
+    return count[binAt( r1 )] - count[binAt( r0 )];
+}
+
+double CRadialProfile::Mean( double r0, double r1 ) const
+{
+    const int b0 = binAt( r0 );
+    const int b1 = binAt( r1 );
+    const int n = count[b1] - count[b0];
+    return n > 0 ? ( sum[b1] - sum[b0] ) / n : 0;
+}
+
+int CRadialProfile::FindSkyAnnulus( int width, int step, int samples ) const
+{
+    double meanSky = 0;
+    int bestR = 0;
+    int samplesAfterBoundary = 0;
+    for( int r = 0; r < MaxRadius(); r += step ) {
+        const bool isEmpty = Count( r, r + width ) == 0;
+        const double current = Mean( r, r + width );
+        bool foundBoundary = false;
+        if( r == 0 || ( not isEmpty && current < meanSky ) ) {
+            meanSky = current;
+            bestR = r;
+        } else {
+            foundBoundary = true;
+        }
+        if( foundBoundary || samplesAfterBoundary > 0 ) {
+            if( ++samplesAfterBoundary == samples ) {
+                break;
+            }
+        }
+    }
+    return bestR;
+}
+
+double CRadialProfile::EncircledEnergy( double radius, double sky ) const
+{
+    const int b = binAt( radius );
+    return sum[b] - sky * count[b];
+}
+
+double CRadialProfile::EncircledEnergyRadius( double fraction, double sky, double maxRadius ) const
+{
+    const int last = binAt( maxRadius );
+    const double target = fraction * ( sum[last] - sky * count[last] );
+    for( int b = 0; b < last; b++ ) {
+        const double energy = sum[b + 1] - sky * count[b + 1];
+        if( energy >= target ) {
+            const double binEnergy = binSum[b] - sky * binCount[b];
+            const double f = binEnergy > 0 ? ( target - ( sum[b] - sky * count[b] ) ) / binEnergy : 0;
+            return ( b + std::max( 0.0, std::min( 1.0, f ) ) ) / BinsPerPixel;
+        }
+    }
+    return static_cast<double>( last ) / BinsPerPixel;
+}
+
+double CRadialProfile::Hfd( double sky, double radius ) const
+{
+    const int b = binAt( radius );
+    const double energy = sum[b] - sky * count[b];
+    return energy > 0 ? 2 * ( sumVR[b] - sky * sumR[b] ) / energy : 0;
+}
+
+double CRadialProfile::Fwhm( double sky, double peak ) const
+{
+    const double halfMax = sky + ( peak - sky ) / 2;
+    double prevR = 0;
+    double prevMean = peak;
+    for( size_t b = 0; b < binCount.size(); b++ ) {
+        if( binCount[b] == 0 ) {
+            continue;
+        }
+        const double mean = binSum[b] / binCount[b];
+        // Mean distance of the pixels of the bin
+        const double r = binSumR[b] / binCount[b];
+        if( mean < halfMax ) {
+            const double f = prevMean > mean ? ( prevMean - halfMax ) / ( prevMean - mean ) : 0;
+            return 2 * ( prevR + f * ( r - prevR ) );
+        }
+        prevR = r;
+        prevMean = mean;
+    }
+    return 2 * MaxRadius();
+}
+
+const CHfdTable::CTable& CHfdTable::table( int phaseX, int phaseY )
+{
+    CTable& t = tables[phaseY * Quantization + phaseX];
+    if( not t.Counts.empty() ) {
+        return t;
+    }
+    const int size = 2 * radius + 1;
+    const double fx = static_cast<double>( phaseX ) / Quantization;
+    const double fy = static_cast<double>( phaseY ) / Quantization;
+    t.Counts.resize( size * size );
+    t.Distances.resize( size * size );
+    for( int v = 0; v < size; v++ ) {
+        for( int u = 0; u < size; u++ ) {
+            int count = 0;
+            double sum = 0;
+            for( int n = 0; n < Subsamples; n++ ) {
+                for( int m = 0; m < Subsamples; m++ ) {
+                    const double dx = u - radius - fx + static_cast<double>( n ) / Subsamples;
+                    const double dy = v - radius - fy + static_cast<double>( m ) / Subsamples;
+                    const double r = std::sqrt( dx * dx + dy * dy );
+                    if( r < radius ) {
+                        count++;
+                        sum += r;
+                    }
+                }
+            }
+            t.Counts[v * size + u] = static_cast<float>( count );
+            t.Distances[v * size + u] = static_cast<float>( sum );
+        }
+    }
+    return t;
+}
+
+double CHfdTable::Hfd( const CGrayU16Image* image, const CGrayImage* mask, int minMask, double cx, double cy, int _radius, double sky )
+{
+    if( _radius != radius || tables.empty() ) {
+        radius = _radius;
+        tables.assign( Quantization * Quantization, CTable() );
+    }
+    const long qx = std::lround( cx * Quantization );
+    const long qy = std::lround( cy * Quantization );
+    // Pixel of the center and the fractional offset (floor division, the center may be left or above the cutout)
+    const int ix = static_cast<int>( qx >= 0 ? qx / Quantization : -( ( -qx + Quantization - 1 ) / Quantization ) );
+    const int iy = static_cast<int>( qy >= 0 ? qy / Quantization : -( ( -qy + Quantization - 1 ) / Quantization ) );
+    const CTable& t = table( static_cast<int>( qx - ix * Quantization ), static_cast<int>( qy - iy * Quantization ) );
+
+    const int size = 2 * radius + 1;
+    const int x0 = std::max( 0, ix - radius );
+    const int x1 = std::min( image->Width(), ix + radius + 1 );
+    const int y0 = std::max( 0, iy - radius );
+    const int y1 = std::min( image->Height(), iy + radius + 1 );
+    double sumV = 0;
+    double sumVR = 0;
+    for( int y = y0; y < y1; y++ ) {
+        const unsigned short* src = image->ScanLine( y );
+        const unsigned char* msk = mask->ScanLine( y );
+        const float* c = t.Counts.data() + ( y - iy + radius ) * size - ( ix - radius );
+        const float* d = t.Distances.data() + ( y - iy + radius ) * size - ( ix - radius );
+        // Rows are summed in float without branches (a row is a few tens of pixels)
+        float rowV = 0;
+        float rowVR = 0;
+        for( int x = x0; x < x1; x++ ) {
+            const float value = msk[x] >= minMask ? static_cast<float>( src[x] - sky ) : 0.0f;
+            rowV += value * c[x];
+            rowVR += value * d[x];
+        }
+        sumV += rowV;
+        sumVR += rowVR;
+    }
+    return 2 * sumVR / sumV;
+}
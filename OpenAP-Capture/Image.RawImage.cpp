@@ -142,6 +142,9 @@ std::shared_ptr<CRawU16Image> CRawU16Image::LoadFromFileRW( const char* filePath
     imageInfo.Camera = toString( map[L"CAMERA"] );
     imageInfo.Channel = toString( map[L"CHANNEL"] );
     imageInfo.FilterDescription = toString( map[L"FILTER"] );
+    if( map[L"BAD_PIXELS_CORRECTED"] == L"1" ) {
+        imageInfo.Flags |= IF_BAD_PIXELS_CORRECTED;
+    }
     imageInfo.FilePath = filePath;
 
     Pixels16BitUncompressed uncompressed;
@@ -174,6 +177,9 @@ void CRawU16Image::SaveToFile( const char* filePath, const ImageFileFormat* file
     fwprintf_no_trailing_zeroes( info, L"CAMERA_TEMPERATURE", imageInfo.Temperature );
     fwprintf_normalize_spaces( info, L"SERIES_ID", imageInfo.SeriesId );
     fwprintf_normalize_spaces( info, L"TIMESTAMP", imageInfo.Timestamp );
+    if( imageInfo.Flags & IF_BAD_PIXELS_CORRECTED ) {
+        fwprintf( info, L"BAD_PIXELS_CORRECTED 1\n" );
+    }
     fclose( info );
 
     if( fileFormat == 0 ) {
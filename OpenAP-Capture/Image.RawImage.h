@@ -10,7 +10,8 @@
 
 enum IMAGE_FLAGS {
     IF_SERIES_START = 0x1,
-    IF_SERIES_END = 0x2
+    IF_SERIES_END = 0x2,
+    IF_BAD_PIXELS_CORRECTED = 0x4 // Hot and dead pixels are replaced by their neighbours (do not calibrate with darks)
 };
 
 struct ImageInfo {
@@ -2,7 +2,10 @@
 // GNU General Public License version 3. See <http://www.gnu.org/licenses/>
 
 #include "Image.Stack.h"
+#include "Image.StarMatcher.h"
+
 #include <QDebug>
+#include <QtConcurrent/QtConcurrent>
 
 template<typename T>
 static std::tuple<size_t, size_t> patches_statistics( const T* pixels, size_t width, size_t height, int bitDepth, int numverOfPatches )
@@ -238,9 +241,9 @@ std::shared_ptr<CPixelBuffer<double>> CFlatsStacker::Process( const ImageSequenc
 
 std::shared_ptr<const CPixelBuffer<double>> CLightsStacker::calibrateImage( std::shared_ptr<const CRawU16Image> rawImage )
 {
+    auto buffer = std::make_shared<CPixelBuffer<double>>( rawImage->Width(), rawImage->Height() );
+    pixels_set( buffer->Pixels(), rawImage->Pixels(), rawImage->Count() );
     if( darkFrame || flatFrame ) {
-        auto buffer = std::make_shared<CPixelBuffer<double>>( rawImage->Width(), rawImage->Height() );
-        pixels_set( buffer->Pixels(), rawImage->Pixels(), rawImage->Count() );
         if( darkFrame ) {
             pixels_subtract( buffer->Pixels(), darkFrame->Pixels(), rawImage->Count() );
         } else {
@@ -256,10 +259,12 @@ std::shared_ptr<const CPixelBuffer<double>> CLightsStacker::calibrateImage( std:
             }
         }
         pixels_add_value( buffer->Pixels(), offset, rawImage->Count() );
-
-        return buffer;
     }
-    return CStacker::calibrateImage( rawImage );
+    if( badPixelMap ) {
+        // Neighbours are calibrated as well, so the replaced values match them
+        badPixelMap->Apply( buffer.get() );
+    }
+    return buffer;
 }
 
 std::shared_ptr<CPixelBuffer<double>> CLightsStacker::Process( const ImageSequence& images, Callback* callback )
@@ -270,6 +275,14 @@ std::shared_ptr<CPixelBuffer<double>> CLightsStacker::Process( const ImageSequen
         assert( offset == 0.0 );
     }
 
+    if( isRegistration ) {
+        auto final = stackRegistered( images, callback );
+        if( final ) {
+            return final;
+        }
+        qDebug() << "No stars to register the frames, stacking them as they are";
+    }
+
     prepareTwoStacks( images, callback );
 
     // Final lights frame
@@ -281,3 +294,128 @@ std::shared_ptr<CPixelBuffer<double>> CLightsStacker::Process( const ImageSequen
 
     return final;
 }
+
+CLightsStacker::CRegisteredImage CLightsStacker::registerImage( std::shared_ptr<const CRawU16Image> rawImage, const CStarCatalog* reference )
+{
+    CRegisteredImage result;
+    result.Image = calibrateImage( rawImage );
+    result.IsCfa = not rawImage->Info().CFA.empty();
+
+    // Stars are detected in the calibrated frame (superpixels of a mono frame are its 2x2 bins)
+    const int width = rawImage->Width();
+    const int height = rawImage->Height();
+    CPixelBuffer<unsigned short> pixels( width, height );
+    pixels_set_round_limit( pixels.Pixels(), result.Image->Pixels(), pixels.Count(), rawImage->BitDepth() );
+    auto detection = CRawU16( pixels.Pixels(), width, height, rawImage->BitDepth() ).DetectStars( 0, 0, width, height, nullptr, DM_Superpixel );
+    result.Stars = CStarCatalog::Extract( detection, CStarMatcher::DefaultMaxStars );
+
+    if( reference != nullptr ) {
+        auto matched = CStarMatcher().Match( *reference, result.Stars );
+        std::vector<double> x1;
+        std::vector<double> y1;
+        std::vector<double> x2;
+        std::vector<double> y2;
+        for( const auto& m : matched.Matches ) {
+            x1.push_back( reference->X[m.Index0] );
+            y1.push_back( reference->Y[m.Index0] );
+            x2.push_back( result.Stars.X[m.Index1] );
+            y2.push_back( result.Stars.Y[m.Index1] );
+        }
+        // From the reference to the frame, that is where each pixel of the stack is taken from in the frame
+        result.Registration = CRansac( TM_Affine ).Estimate( x1, y1, x2, y2 );
+        if( result.Registration.Inliers.size() < static_cast<size_t>( CStarMatcher::MinMatches ) ) {
+            result.Registration.IsValid = false;
+        }
+    }
+    return result;
+}
+
+std::shared_ptr<CPixelBuffer<double>> CLightsStacker::stackRegistered( const ImageSequence& images, Callback* callback )
+{
+    const int n = images.Count();
+
+    // The reference is the first frame with enough stars to match
+    CRegisteredImage reference;
+    int first = 0;
+    for( ; first < n; first++ ) {
+        auto rawImage = images.LoadRawU16( first );
+        count = rawImage->Count();
+        bitDepth = rawImage->BitDepth();
+        reference = registerImage( rawImage, nullptr );
+        if( reference.Stars.Size() >= static_cast<size_t>( CStarMatcher::MinMatches ) ) {
+            break;
+        }
+    }
+    if( first == n ) {
+        return nullptr;
+    }
+    const int width = reference.Image->Width();
+    const int height = reference.Image->Height();
+
+    // Pixels near the edges are covered by fewer frames, each pixel is the mean of the frames covering it
+    auto sum = std::make_shared<CPixelBuffer<double>>( width, height );
+    pixels_set( sum->Pixels(), reference.Image->Pixels(), count );
+    CPixelBuffer<int> frames( width, height );
+    pixels_set_value( frames.Pixels(), 1, count );
+    CPixelBuffer<double> warped( width, height );
+    CGrayImage coverage( width, height );
+    int stacked = 1;
+
+    // Pipeline of two stages: the next frame is loaded, calibrated, detected and matched on a worker thread while
+    // the current one is warped and added. Both stages run their own loops on all cores, and the frames are read
+    // by one thread at a time
+    auto analyze = [&]( int i ) {
+        auto rawImage = images.LoadRawU16( i );
+        assert( rawImage->Count() == count );
+        return registerImage( rawImage, &reference.Stars );
+    };
+    QFuture<CRegisteredImage> next;
+    if( first + 1 < n ) {
+        next = QtConcurrent::run( [&analyze, first]() { return analyze( first + 1 ); } );
+    }
+    for( int i = first + 1; i < n; i++ ) {
+        CRegisteredImage frame = next.result();
+        if( i + 1 < n ) {
+            next = QtConcurrent::run( [&analyze, i]() { return analyze( i + 1 ); } );
+        }
+        if( not frame.Registration.IsValid ) {
+            qDebug() << "Frame" << i << "is not registered, stars:" << frame.Stars.Size();
+            continue;
+        }
+        qDebug() << "Frame" << i << "inliers:" << frame.Registration.Inliers.size() << "rms:" << frame.Registration.Rms;
+
+        CMatrix<double> Ax( 3, 1 );
+        CMatrix<double> Ay( 3, 1 );
+        frame.Registration.Transform.GetAffine( Ax, Ay );
+        CImageWarp warp( kernel );
+        warp.SetAffineTransform( Ax, Ay );
+        if( frame.IsCfa ) {
+            warp.WarpCfa( *frame.Image, warped, &coverage );
+        } else {
+            warp.Warp( *frame.Image, warped, &coverage );
+        }
+        const double* src = warped.Pixels();
+        const unsigned char* covered = coverage.Pixels();
+        double* dst = sum->Pixels();
+        int* counts = frames.Pixels();
+        for( size_t j = 0; j < count; j++ ) {
+            if( covered[j] != 0 ) {
+                dst[j] += src[j];
+                counts[j]++;
+            }
+        }
+        stacked++;
+
+        if( callback ) {
+            callback->OnShowImage( correlationGraph( warped.Pixels(), reference.Image->Pixels(), count, bitDepth ) );
+        }
+    }
+    qDebug() << "Stacked" << stacked << "of" << n << "frames";
+
+    double* dst = sum->Pixels();
+    const int* counts = frames.Pixels();
+    for( size_t j = 0; j < count; j++ ) {
+        dst[j] /= counts[j];
+    }
+    return sum;
+}
@@ -4,7 +4,11 @@
 #pragma once
 
 #include <Image.Math.h>
+#include <Image.Math.Advanced.h>
 #include <Image.RawImage.h>
+#include <Image.BadPixels.h>
+#include <Image.Warp.h>
+#include <Math.Ransac.h>
 
 #include <memory>
 
@@ -65,11 +69,31 @@ public:
     void SetFlatFrame( std::shared_ptr<CPixelBuffer<double>> value ) { flatFrame = value; }
 
     void SetOffset( double value ) { offset = value; }
+    // Defects are corrected in each calibrated frame
+    void SetBadPixelMap( std::shared_ptr<const CBadPixelMap> value ) { badPixelMap = value; }
 
+    // Frames are aligned by their stars to the first frame with stars before they are summed (on by default).
+    // Frames that do not match are left out of the stack
+    void SetRegistration( bool value ) { isRegistration = value; }
+    void SetResamplingKernel( TResamplingKernel value ) { kernel = value; }
 
 private:
     std::shared_ptr<CPixelBuffer<double>> darkFrame;
     std::shared_ptr<CPixelBuffer<double>> flatFrame;
+    std::shared_ptr<const CBadPixelMap> badPixelMap;
     double offset = 0.0;
+    bool isRegistration = true;
+    TResamplingKernel kernel = RK_Lanczos3;
     virtual std::shared_ptr<const CPixelBuffer<double>> calibrateImage( std::shared_ptr<const CRawU16Image> rawImage );
+
+    // Calibrated frame with its stars and the transform from the reference frame to it
+    struct CRegisteredImage {
+        std::shared_ptr<const CPixelBuffer<double>> Image;
+        bool IsCfa = false;
+        CStarCatalog Stars;
+        CRansacResult Registration;
+    };
+    CRegisteredImage registerImage( std::shared_ptr<const CRawU16Image> rawImage, const CStarCatalog* reference );
+    // Mean of the registered frames (null when no frame has enough stars)
+    std::shared_ptr<CPixelBuffer<double>> stackRegistered( const ImageSequence&, Callback* );
 };
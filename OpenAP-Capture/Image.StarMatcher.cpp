@@ -0,0 +1,444 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Image.StarMatcher.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+
+void CPointGrid::Build( const float* x, const float* y, int count, double minCellSize )
+{
+    points.resize( count );
+    if( count == 0 ) {
+        return;
+    }
+    const auto [minX, maxX] = std::minmax_element( x, x + count );
+    const auto [minY, maxY] = std::minmax_element( y, y + count );
+    left = *minX;
+    top = *minY;
+    const double width = std::max( 1.0, static_cast<double>( *maxX - left ) );
+    const double height = std::max( 1.0, static_cast<double>( *maxY - top ) );
+    cellSize = std::max( minCellSize, std::sqrt( width * height / count ) );
+    columns = static_cast<int>( width / cellSize ) + 1;
+    rows = static_cast<int>( height / cellSize ) + 1;
+
+    // Counting sort of the points by cell
+    cellStart.assign( columns * rows + 1, 0 );
+    for( int i = 0; i < count; i++ ) {
+        cellStart[cell( x[i], y[i] ) + 1]++;
+    }
+    for( int c = 0; c < columns * rows; c++ ) {
+        cellStart[c + 1] += cellStart[c];
+    }
+    std::vector<int> next( cellStart.begin(), cellStart.end() - 1 );
+    for( int i = 0; i < count; i++ ) {
+        points[next[cell( x[i], y[i] )]++] = { x[i], y[i], i };
+    }
+}
+
+int CPointGrid::column( double x ) const
+{
+    return std::max( 0, std::min( columns - 1, static_cast<int>( std::floor( ( x - left ) / cellSize ) ) ) );
+}
+
+int CPointGrid::row( double y ) const
+{
+    return std::max( 0, std::min( rows - 1, static_cast<int>( std::floor( ( y - top ) / cellSize ) ) ) );
+}
+
+int CPointGrid::Nearest( double x, double y, double radius, double* distanceSq ) const
+{
+    if( points.empty() || x < left - radius || y < top - radius || x > left + columns * cellSize + radius
+        || y > top + rows * cellSize + radius )
+    {
+        return -1;
+    }
+    double bestSq = radius * radius;
+    int best = -1;
+    const int c1 = column( x + radius );
+    const int r1 = row( y + radius );
+    for( int r = row( y - radius ); r <= r1; r++ ) {
+        for( int c = column( x - radius ); c <= c1; c++ ) {
+            for( int i = cellStart[r * columns + c]; i < cellStart[r * columns + c + 1]; i++ ) {
+                const double dx = points[i].X - x;
+                const double dy = points[i].Y - y;
+                const double dSq = dx * dx + dy * dy;
+                if( dSq < bestSq ) {
+                    bestSq = dSq;
+                    best = points[i].Index;
+                }
+            }
+        }
+    }
+    if( best >= 0 && distanceSq != nullptr ) {
+        *distanceSq = bestSq;
+    }
+    return best;
+}
+
+void CPointGrid::Nearest( double x, double y, int k, std::vector<int>& result ) const
+{
+    // Sorted by distance, at most k
+    nearest.clear();
+    const int c0 = column( x );
+    const int r0 = row( y );
+    const int maxRing = std::max( columns, rows );
+    // Distance from the point to the border of its cell
+    const double cellX = x - ( left + c0 * cellSize );
+    const double cellY = y - ( top + r0 * cellSize );
+    const double margin = std::max( 0.0, std::min( { cellX, cellY, cellSize - cellX, cellSize - cellY } ) );
+    for( int ring = 0; ring <= maxRing; ring++ ) {
+        for( int r = std::max( 0, r0 - ring ); r <= std::min( rows - 1, r0 + ring ); r++ ) {
+            // Only the border of the ring (both ends of inner rows)
+            const bool isBorderRow = r == r0 - ring || r == r0 + ring;
+            const int step = isBorderRow || ring == 0 ? 1 : 2 * ring;
+            for( int c = c0 - ring; c <= c0 + ring; c += step ) {
+                if( c < 0 || c >= columns ) {
+                    continue;
+                }
+                for( int i = cellStart[r * columns + c]; i < cellStart[r * columns + c + 1]; i++ ) {
+                    const double dx = points[i].X - x;
+                    const double dy = points[i].Y - y;
+                    const double dSq = dx * dx + dy * dy;
+                    if( static_cast<int>( nearest.size() ) < k ) {
+                        nearest.emplace_back( dSq, points[i].Index );
+                    } else if( dSq < nearest.back().first ) {
+                        nearest.back() = { dSq, points[i].Index };
+                    } else {
+                        continue;
+                    }
+                    // Insertion into the sorted list
+                    for( size_t j = nearest.size() - 1; j > 0 && nearest[j].first < nearest[j - 1].first; j-- ) {
+                        std::swap( nearest[j], nearest[j - 1] );
+                    }
+                }
+            }
+        }
+        // Points beyond the ring are farther than ring cells from the border of the central cell
+        const double bound = ring * cellSize + margin;
+        if( static_cast<int>( nearest.size() ) == k && nearest.back().first <= bound * bound ) {
+            break;
+        }
+    }
+    result.clear();
+    for( const auto& n : nearest ) {
+        result.push_back( n.second );
+    }
+}
+
+void CStarListTransform::Apply( double x, double y, double& x1, double& y1 ) const
+{
+    const double a = Scale * std::cos( Angle );
+    const double b = Scale * std::sin( Angle );
+    if( IsMirrored ) {
+        y = -y;
+    }
+    x1 = a * x - b * y + Dx;
+    y1 = b * x + a * y + Dy;
+}
+
+// Least squares similarity transform for the pairs of stars (exact for two pairs)
+static bool fitSimilarity( CStarListTransform& transform, const std::vector<std::pair<int, int>>& pairs, bool isMirrored,
+    const float* x0, const float* y0, const float* x1, const float* y1 )
+{
+    if( pairs.size() < 2 ) {
+        return false;
+    }
+    const double sign = isMirrored ? -1 : 1;
+    double mx0 = 0;
+    double my0 = 0;
+    double mx1 = 0;
+    double my1 = 0;
+    for( const auto& p : pairs ) {
+        mx0 += x0[p.first];
+        my0 += sign * y0[p.first];
+        mx1 += x1[p.second];
+        my1 += y1[p.second];
+    }
+    const double n = static_cast<double>( pairs.size() );
+    mx0 /= n;
+    my0 /= n;
+    mx1 /= n;
+    my1 /= n;
+    double sumDot = 0;
+    double sumCross = 0;
+    double sumNorm = 0;
+    for( const auto& p : pairs ) {
+        const double dx0 = x0[p.first] - mx0;
+        const double dy0 = sign * y0[p.first] - my0;
+        const double dx1 = x1[p.second] - mx1;
+        const double dy1 = y1[p.second] - my1;
+        sumDot += dx0 * dx1 + dy0 * dy1;
+        sumCross += dx0 * dy1 - dy0 * dx1;
+        sumNorm += dx0 * dx0 + dy0 * dy0;
+    }
+    if( sumNorm < 1e-6 ) {
+        return false;
+    }
+    const double a = sumDot / sumNorm;
+    const double b = sumCross / sumNorm;
+    transform.Scale = std::hypot( a, b );
+    transform.Angle = std::atan2( b, a );
+    transform.IsMirrored = isMirrored;
+    transform.Dx = mx1 - ( a * mx0 - b * my0 );
+    transform.Dy = my1 - ( b * mx0 + a * my0 );
+    return transform.Scale > 0;
+}
+
+void CStarMatcher::triangles( const float* x, const float* y, int count, std::vector<CTriangle>& result ) const
+{
+    CPointGrid grid;
+    grid.Build( x, y, count );
+
+    // Neighbours of each star (without the star itself)
+    std::vector<int> neighbours( count * Neighbours, -1 );
+    std::vector<int> nearest;
+    for( int i = 0; i < count; i++ ) {
+        grid.Nearest( x[i], y[i], Neighbours + 1, nearest );
+        int* n = neighbours.data() + i * Neighbours;
+        for( int j : nearest ) {
+            if( j != i && n < neighbours.data() + ( i + 1 ) * Neighbours ) {
+                *n++ = j;
+            }
+        }
+    }
+    // The star forms triangles with the pairs of its neighbours. The same triangle is found from each of its vertices
+    // that has both others among the neighbours, it is taken from the first such vertex only
+    auto formsTriangle = [&]( int v, int p, int q ) {
+        const int* n = neighbours.data() + v * Neighbours;
+        return std::find( n, n + Neighbours, p ) != n + Neighbours && std::find( n, n + Neighbours, q ) != n + Neighbours;
+    };
+
+    result.clear();
+    result.reserve( count * Neighbours * ( Neighbours - 1 ) / 2 );
+    for( int i = 0; i < count; i++ ) {
+        const int* n = neighbours.data() + i * Neighbours;
+        for( int a = 0; a < Neighbours && n[a] >= 0; a++ ) {
+            for( int b = a + 1; b < Neighbours && n[b] >= 0; b++ ) {
+                const int t[3] = { i, n[a], n[b] };
+                if( ( t[1] < i && formsTriangle( t[1], i, t[2] ) ) || ( t[2] < i && formsTriangle( t[2], i, t[1] ) ) ) {
+                    continue;
+                }
+                // Sides opposite to the vertices (squared), the longest first
+                std::pair<float, int> sides[3];
+                for( int v = 0; v < 3; v++ ) {
+                    const int p = t[( v + 1 ) % 3];
+                    const int q = t[( v + 2 ) % 3];
+                    sides[v] = std::make_pair( ( x[p] - x[q] ) * ( x[p] - x[q] ) + ( y[p] - y[q] ) * ( y[p] - y[q] ), t[v] );
+                }
+                if( sides[0].first < sides[1].first ) {
+                    std::swap( sides[0], sides[1] );
+                }
+                if( sides[1].first < sides[2].first ) {
+                    std::swap( sides[1], sides[2] );
+                }
+                if( sides[0].first < sides[1].first ) {
+                    std::swap( sides[0], sides[1] );
+                }
+                if( sides[0].first < 1 ) {
+                    continue;
+                }
+                CTriangle triangle;
+                triangle.U = std::sqrt( sides[1].first / sides[0].first );
+                triangle.V = std::sqrt( sides[2].first / sides[0].first );
+                // The order of vertices is ambiguous for nearly isosceles triangles
+                if( 1 - triangle.U < 2 * invariantTolerance || triangle.U - triangle.V < 2 * invariantTolerance ) {
+                    continue;
+                }
+                for( int v = 0; v < 3; v++ ) {
+                    triangle.Vertex[v] = sides[v].second;
+                }
+                const int* vx = triangle.Vertex;
+                const double cross = ( x[vx[1]] - x[vx[0]] ) * ( y[vx[2]] - y[vx[0]] ) - ( y[vx[1]] - y[vx[0]] ) * ( x[vx[2]] - x[vx[0]] );
+                triangle.IsClockwise = cross < 0;
+                result.push_back( triangle );
+            }
+        }
+    }
+}
+
+CStarMatchResult CStarMatcher::Match( const CStarCatalog& catalog0, const CStarCatalog& catalog1 ) const
+{
+    return Match( catalog0.X.data(), catalog0.Y.data(), static_cast<int>( catalog0.Size() ),
+        catalog1.X.data(), catalog1.Y.data(), static_cast<int>( catalog1.Size() ) );
+}
+
+CStarMatchResult CStarMatcher::Match( const float* x0, const float* y0, int count0, const float* x1, const float* y1, int count1 ) const
+{
+    CStarMatchResult result;
+    const int n0 = std::min( count0, maxStars );
+    const int n1 = std::min( count1, maxStars );
+    if( n0 < MinMatches || n1 < MinMatches ) {
+        return result;
+    }
+
+    std::vector<CTriangle> triangles0;
+    std::vector<CTriangle> triangles1;
+    triangles( x0, y0, n0, triangles0 );
+    triangles( x1, y1, n1, triangles1 );
+
+    // Triangles of the second list in a grid of cells of the tolerance size (counting sort by cell). The middle side
+    // is at least a half of the longest one, so U is from 0.5 to 1 and V from 0 to 1
+    const int uCells = static_cast<int>( 0.5 / invariantTolerance ) + 1;
+    const int vCells = static_cast<int>( 1 / invariantTolerance ) + 1;
+    auto uCell = [&]( double u ) { return std::max( 0, std::min( uCells - 1, static_cast<int>( ( u - 0.5 ) / invariantTolerance ) ) ); };
+    auto vCell = [&]( double v ) { return std::max( 0, std::min( vCells - 1, static_cast<int>( v / invariantTolerance ) ) ); };
+    // Ends of the cells first, starts after placing the triangles
+    std::vector<int> cellStart( uCells * vCells + 1, 0 );
+    for( const auto& t1 : triangles1 ) {
+        cellStart[uCell( t1.U ) * vCells + vCell( t1.V )]++;
+    }
+    for( int c = 1; c < uCells * vCells; c++ ) {
+        cellStart[c] += cellStart[c - 1];
+    }
+    cellStart.back() = static_cast<int>( triangles1.size() );
+    std::vector<int> cellTriangles( triangles1.size() );
+    for( size_t i = 0; i < triangles1.size(); i++ ) {
+        cellTriangles[--cellStart[uCell( triangles1[i].U ) * vCells + vCell( triangles1[i].V )]] = static_cast<int>( i );
+    }
+
+    // Votes for pairs of stars, separately for the same and the flipped orientation of triangles. A star is a vertex
+    // of a few tens of triangles at most, 16 bits are plenty and keep the tables small. The best voted pair of each star
+    // is tracked while voting
+    struct CVotes {
+        std::vector<unsigned short> Pairs;
+        std::vector<unsigned short> RowMax;
+        std::vector<int> RowBest;
+        std::vector<unsigned short> ColumnMax;
+        std::vector<int> ColumnBest;
+        int Max = 0;
+
+        CVotes( int n0, int n1 ) : Pairs( n0 * n1, 0 ), RowMax( n0, 0 ), RowBest( n0, -1 ), ColumnMax( n1, 0 ), ColumnBest( n1, -1 ) {}
+    };
+    CVotes votes[2] = { CVotes( n0, n1 ), CVotes( n0, n1 ) };
+    for( const auto& t0 : triangles0 ) {
+        const int u1 = uCell( t0.U + invariantTolerance );
+        const int v0 = vCell( t0.V - invariantTolerance );
+        const int v1 = vCell( t0.V + invariantTolerance );
+        for( int cu = uCell( t0.U - invariantTolerance ); cu <= u1; cu++ ) {
+            for( int i = cellStart[cu * vCells + v0]; i < cellStart[cu * vCells + v1 + 1]; i++ ) {
+                const CTriangle& t1 = triangles1[cellTriangles[i]];
+                if( std::abs( t0.U - t1.U ) < invariantTolerance && std::abs( t0.V - t1.V ) < invariantTolerance ) {
+                    CVotes& parityVotes = votes[t0.IsClockwise != t1.IsClockwise ? 1 : 0];
+                    for( int k = 0; k < 3; k++ ) {
+                        const int i0 = t0.Vertex[k];
+                        const int i1 = t1.Vertex[k];
+                        const unsigned short pairVotes = ++parityVotes.Pairs[i0 * n1 + i1];
+                        if( pairVotes > parityVotes.RowMax[i0] ) {
+                            parityVotes.RowMax[i0] = pairVotes;
+                            parityVotes.RowBest[i0] = i1;
+                        }
+                        if( pairVotes > parityVotes.ColumnMax[i1] ) {
+                            parityVotes.ColumnMax[i1] = pairVotes;
+                            parityVotes.ColumnBest[i1] = i0;
+                        }
+                        parityVotes.Max = std::max<int>( parityVotes.Max, pairVotes );
+                    }
+                }
+            }
+        }
+    }
+
+    // Mirrored lists flip all triangles
+    const bool isMirrored = votes[1].Max > votes[0].Max;
+    const CVotes& bestVotes = votes[isMirrored ? 1 : 0];
+    const std::vector<unsigned short>& pairVotes = bestVotes.Pairs;
+
+    // Candidate pairs are the best voted for both of their stars
+    std::vector<std::pair<int, int>> candidates;
+    for( int i = 0; i < n0; i++ ) {
+        const int j = bestVotes.RowBest[i];
+        if( j >= 0 && bestVotes.RowMax[i] >= 2 && bestVotes.ColumnBest[j] == i ) {
+            candidates.emplace_back( i, j );
+        }
+    }
+    std::sort( candidates.begin(), candidates.end(), [&]( const std::pair<int, int>& a, const std::pair<int, int>& b ) {
+        return pairVotes[a.first * n1 + a.second] > pairVotes[b.first * n1 + b.second];
+    } );
+
+    CPointGrid grid1;
+    grid1.Build( x1, y1, n1, matchRadius );
+    const double radiusSq = matchRadius * matchRadius;
+    // Stars of the first list matched by their position after the transform (one to one, the closer wins)
+    std::vector<std::pair<double, int>> closest( n1 );
+    auto matchByPosition = [&]( const CStarListTransform& transform, std::vector<std::pair<int, int>>& pairs ) {
+        std::fill( closest.begin(), closest.end(), std::make_pair( radiusSq, -1 ) );
+        for( int i = 0; i < n0; i++ ) {
+            double tx;
+            double ty;
+            transform.Apply( x0[i], y0[i], tx, ty );
+            double distanceSq;
+            const int j = grid1.Nearest( tx, ty, matchRadius, &distanceSq );
+            if( j >= 0 && distanceSq < closest[j].first ) {
+                closest[j] = std::make_pair( distanceSq, i );
+            }
+        }
+        pairs.clear();
+        for( int j = 0; j < n1; j++ ) {
+            if( closest[j].second >= 0 ) {
+                pairs.emplace_back( closest[j].second, j );
+            }
+        }
+    };
+
+    // Transforms from two of the best candidates, the one matching most stars wins
+    const int hypotheses = std::min<int>( 8, static_cast<int>( candidates.size() ) );
+    const int enoughMatches = 4 * std::min( n0, n1 ) / 5;
+    CStarListTransform best;
+    std::vector<std::pair<int, int>> bestPairs;
+    std::vector<std::pair<int, int>> pairs;
+    for( int a = 0; a < hypotheses && static_cast<int>( bestPairs.size() ) < enoughMatches; a++ ) {
+        for( int b = a + 1; b < hypotheses && static_cast<int>( bestPairs.size() ) < enoughMatches; b++ ) {
+            const auto& ca = candidates[a];
+            const auto& cb = candidates[b];
+            // Too close stars do not define the rotation (the radius is in pixels of the second list)
+            if( std::hypot( x1[ca.second] - x1[cb.second], y1[ca.second] - y1[cb.second] ) < 4 * matchRadius ) {
+                continue;
+            }
+            CStarListTransform transform;
+            if( not fitSimilarity( transform, { ca, cb }, isMirrored, x0, y0, x1, y1 ) ) {
+                continue;
+            }
+            matchByPosition( transform, pairs );
+            if( pairs.size() > bestPairs.size() ) {
+                best = transform;
+                bestPairs.swap( pairs );
+            }
+        }
+    }
+    if( static_cast<int>( bestPairs.size() ) < MinMatches ) {
+        qDebug() << "Star lists do not match" << n0 << n1 << "Candidates:" << candidates.size();
+        return result;
+    }
+
+    // Refined on all matched stars
+    for( int iteration = 0; iteration < 2; iteration++ ) {
+        CStarListTransform refined;
+        if( fitSimilarity( refined, bestPairs, isMirrored, x0, y0, x1, y1 ) ) {
+            matchByPosition( refined, pairs );
+            if( pairs.size() >= bestPairs.size() ) {
+                best = refined;
+                bestPairs.swap( pairs );
+            }
+        }
+    }
+
+    result.IsValid = true;
+    result.Transform = best;
+    std::sort( bestPairs.begin(), bestPairs.end() );
+    for( const auto& p : bestPairs ) {
+        double tx;
+        double ty;
+        best.Apply( x0[p.first], y0[p.first], tx, ty );
+        CStarMatch match;
+        match.Index0 = p.first;
+        match.Index1 = p.second;
+        match.Votes = pairVotes[p.first * n1 + p.second];
+        match.Distance = std::hypot( tx - x1[p.second], ty - y1[p.second] );
+        match.Score = ( 1 - match.Distance / matchRadius ) * ( match.Votes + 1 ) / ( match.Votes + 2 );
+        result.Matches.push_back( match );
+    }
+    return result;
+}
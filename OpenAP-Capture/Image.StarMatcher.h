@@ -0,0 +1,113 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <Image.Math.Advanced.h>
+
+#include <vector>
+
+// Points in a uniform grid for nearest neighbour queries. Stars are spread over the frame fairly evenly, so with cells
+// holding about one point on average a query looks into a few cells. Queries of one grid are not thread-safe
+class CPointGrid {
+public:
+    // Cells are at least minCellSize (e.g. the radius of the queries, so that they look into 2x2 cells at most)
+    void Build( const float* x, const float* y, int count, double minCellSize = 0 );
+    int Size() const { return static_cast<int>( points.size() ); }
+
+    // Index of the nearest point closer than the radius (-1 when there is none)
+    int Nearest( double x, double y, double radius, double* distanceSq = nullptr ) const;
+    // Indices of up to k nearest points, the nearest first. The point should be within the bounds of the points
+    void Nearest( double x, double y, int k, std::vector<int>& result ) const;
+
+private:
+    struct CPoint {
+        float X;
+        float Y;
+        int Index;
+    };
+    // Sorted by cells, the points of cell c are from cellStart[c] to cellStart[c + 1]
+    std::vector<CPoint> points;
+    std::vector<int> cellStart;
+    double left = 0;
+    double top = 0;
+    double cellSize = 1;
+    int columns = 0;
+    int rows = 0;
+    mutable std::vector<std::pair<double, int>> nearest;
+
+    int column( double x ) const;
+    int row( double y ) const;
+    int cell( double x, double y ) const { return row( y ) * columns + column( x ); }
+};
+
+// Similarity transform (rotation, scale and shift, mirrored when the lists are flipped) from the first list
+// of stars to the second one
+struct CStarListTransform {
+    double Scale = 1;
+    double Angle = 0; // Radians
+    bool IsMirrored = false;
+    double Dx = 0;
+    double Dy = 0;
+
+    void Apply( double x, double y, double& x1, double& y1 ) const;
+};
+
+struct CStarMatch {
+    int Index0;
+    int Index1;
+    // Triangles voting for the pair
+    int Votes;
+    // Between the transformed first star and the second one
+    double Distance;
+    // 0..1, higher for closer pairs with more votes
+    double Score;
+};
+
+struct CStarMatchResult {
+    bool IsValid = false;
+    CStarListTransform Transform;
+    // One to one, in the order of the first list
+    std::vector<CStarMatch> Matches;
+};
+
+// Geometric hashing of triangles. Each star forms triangles with pairs of its nearest neighbours (from a point grid).
+// Ratios of the sides of a triangle do not change with rotation, scale, mirroring and shift, so triangles of the first
+// list are looked up by their ratios in a hash grid of triangles of the second list. Vertices of similar triangles vote
+// for pairs of stars, a few best voted pairs give the transform, and all stars are matched by their positions.
+// Stars outside of the overlap of the lists simply stay unmatched
+class CStarMatcher {
+public:
+    static const int DefaultMaxStars = 200;
+    // Neighbours of each star forming triangles with it
+    static const int Neighbours = 5;
+    // Fewer matches are not reliable
+    static const int MinMatches = 4;
+
+    // Only the brightest stars are used (catalogs are sorted by brightness)
+    CStarMatcher( int _maxStars = DefaultMaxStars ) : maxStars( _maxStars ) {}
+
+    // Tolerance of side ratios of similar triangles
+    void SetInvariantTolerance( double value ) { invariantTolerance = value; }
+    // Distance between matched stars after the transform (pixels of the second list)
+    void SetMatchRadius( double value ) { matchRadius = value; }
+
+    CStarMatchResult Match( const CStarCatalog& catalog0, const CStarCatalog& catalog1 ) const;
+    CStarMatchResult Match( const float* x0, const float* y0, int count0, const float* x1, const float* y1, int count1 ) const;
+
+private:
+    const int maxStars;
+    double invariantTolerance = 0.005;
+    double matchRadius = 3;
+
+    struct CTriangle {
+        // Opposite to the longest, the middle and the shortest side
+        int Vertex[3];
+        // Middle and shortest sides relative to the longest one
+        float U;
+        float V;
+        // Sign of the turn from Vertex[0] to Vertex[1] to Vertex[2]
+        bool IsClockwise;
+    };
+    void triangles( const float* x, const float* y, int count, std::vector<CTriangle>& ) const;
+};
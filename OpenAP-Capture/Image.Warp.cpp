@@ -0,0 +1,301 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Image.Warp.h"
+
+#include <QtConcurrent/QtConcurrent>
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cmath>
+
+// Sums of the kernel are in double for double images (stacks), float is enough for the others
+template<typename T>
+struct CWarpSum {
+    typedef float Type;
+};
+
+template<>
+struct CWarpSum<double> {
+    typedef double Type;
+};
+
+static void setPixel( unsigned short& pixel, double value )
+{
+    // Bicubic and Lanczos kernels overshoot around stars
+    pixel = value <= 0 ? 0 : value >= USHRT_MAX ? USHRT_MAX : static_cast<unsigned short>( value + 0.5 );
+}
+
+static void setPixel( float& pixel, double value )
+{
+    pixel = static_cast<float>( value );
+}
+
+static void setPixel( double& pixel, double value )
+{
+    pixel = value;
+}
+
+CImageWarp::CImageWarp( TResamplingKernel _kernel ) :
+    kernel( _kernel )
+{
+    switch( kernel ) {
+        case RK_Bilinear:
+            taps = 2;
+            break;
+        case RK_Bicubic:
+            taps = 4;
+            break;
+        case RK_Lanczos3:
+            taps = 6;
+            break;
+        default:
+            assert( false );
+    }
+    // The sample at the phase f between the pixels 0 and 1 takes the pixels from 1 - taps / 2 to taps / 2.
+    // Weights are normalized, so a flat image stays flat (Lanczos weights do not add up to 1 exactly)
+    weights.resize( ( Phases + 1 ) * taps );
+    for( int phase = 0; phase <= Phases; phase++ ) {
+        const double f = static_cast<double>( phase ) / Phases;
+        float* w = weights.data() + phase * taps;
+        double sum = 0;
+        for( int i = 0; i < taps; i++ ) {
+            const double value = kernelValue( kernel, i - ( taps / 2 - 1 ) - f );
+            w[i] = static_cast<float>( value );
+            sum += value;
+        }
+        for( int i = 0; i < taps; i++ ) {
+            w[i] = static_cast<float>( w[i] / sum );
+        }
+    }
+}
+
+double CImageWarp::kernelValue( TResamplingKernel kernel, double x )
+{
+    x = std::abs( x );
+    switch( kernel ) {
+        case RK_Bilinear:
+            return std::max( 0.0, 1 - x );
+        case RK_Bicubic:
+        {
+            const double a = -0.5;
+            if( x < 1 ) {
+                return ( ( a + 2 ) * x - ( a + 3 ) ) * x * x + 1;
+            } else if( x < 2 ) {
+                return ( ( a * x - 5 * a ) * x + 8 * a ) * x - 4 * a;
+            }
+            return 0;
+        }
+        case RK_Lanczos3:
+            if( x < 1e-9 ) {
+                return 1;
+            } else if( x < 3 ) {
+                return 3 * std::sin( M_PI * x ) * std::sin( M_PI * x / 3 ) / ( M_PI * M_PI * x * x );
+            }
+            return 0;
+        default:
+            assert( false );
+            return 0;
+    }
+}
+
+void CImageWarp::SetAffineTransform( const CMatrix<double>& Ax, const CMatrix<double>& Ay )
+{
+    for( int i = 0; i < 3; i++ ) {
+        ax[i] = Ax[i][0];
+        ay[i] = Ay[i][0];
+    }
+}
+
+void CImageWarp::SetAffineTransform( const double* _ax, const double* _ay )
+{
+    std::copy( _ax, _ax + 3, ax );
+    std::copy( _ay, _ay + 3, ay );
+}
+
+void CImageWarp::SetTranslation( double dx, double dy )
+{
+    const double _ax[3] = { 1, 0, dx };
+    const double _ay[3] = { 0, 1, dy };
+    SetAffineTransform( _ax, _ay );
+}
+
+void CImageWarp::Warp( const CPixelBuffer<unsigned short>& src, CPixelBuffer<unsigned short>& dst, CGrayImage* coverage ) const
+{
+    warp( src, dst, coverage );
+}
+
+void CImageWarp::Warp( const CPixelBuffer<unsigned short, 3>& src, CPixelBuffer<unsigned short, 3>& dst, CGrayImage* coverage ) const
+{
+    warp( src, dst, coverage );
+}
+
+void CImageWarp::Warp( const CPixelBuffer<float>& src, CPixelBuffer<float>& dst, CGrayImage* coverage ) const
+{
+    warp( src, dst, coverage );
+}
+
+void CImageWarp::Warp( const CPixelBuffer<double>& src, CPixelBuffer<double>& dst, CGrayImage* coverage ) const
+{
+    warp( src, dst, coverage );
+}
+
+void CImageWarp::WarpCfa( const CPixelBuffer<unsigned short>& src, CPixelBuffer<unsigned short>& dst, CGrayImage* coverage ) const
+{
+    warpCfa( src, dst, coverage );
+}
+
+void CImageWarp::WarpCfa( const CPixelBuffer<double>& src, CPixelBuffer<double>& dst, CGrayImage* coverage ) const
+{
+    warpCfa( src, dst, coverage );
+}
+
+template<typename T, int numOfChannels>
+void CImageWarp::warp( const CPixelBuffer<T, numOfChannels>& src, CPixelBuffer<T, numOfChannels>& dst, CGrayImage* coverage ) const
+{
+    assert( coverage == nullptr || ( coverage->Width() == dst.Width() && coverage->Height() == dst.Height() ) );
+    std::vector<CPlaneWarp<T>> planes( numOfChannels );
+    for( int c = 0; c < numOfChannels; c++ ) {
+        CPlaneWarp<T>& plane = planes[c];
+        plane.Src = { src.Pixels() + c, src.Width(), src.Height(), numOfChannels, numOfChannels * src.Width() };
+        plane.Dst = { dst.Pixels() + c, dst.Width(), dst.Height(), numOfChannels, numOfChannels * dst.Width() };
+        // Channels share the coverage, the first one sets it
+        plane.Coverage = { c == 0 && coverage != nullptr ? coverage->Pixels() : nullptr, dst.Width(), dst.Height(), 1, dst.Width() };
+        std::copy( ax, ax + 3, plane.Ax );
+        std::copy( ay, ay + 3, plane.Ay );
+    }
+    warpPlanes( planes );
+}
+
+template<typename T>
+void CImageWarp::warpCfa( const CPixelBuffer<T>& src, CPixelBuffer<T>& dst, CGrayImage* coverage ) const
+{
+    assert( coverage == nullptr || ( coverage->Width() == dst.Width() && coverage->Height() == dst.Height() ) );
+    std::vector<CPlaneWarp<T>> planes( 4 );
+    for( int c = 0; c < 4; c++ ) {
+        const int ox = c & 1;
+        const int oy = c >> 1;
+        CPlaneWarp<T>& plane = planes[c];
+        plane.Src = { src.Pixels() + oy * src.Width() + ox, ( src.Width() - ox + 1 ) / 2, ( src.Height() - oy + 1 ) / 2, 2, 2 * src.Width() };
+        const int offset = oy * dst.Width() + ox;
+        const int width = ( dst.Width() - ox + 1 ) / 2;
+        const int height = ( dst.Height() - oy + 1 ) / 2;
+        plane.Dst = { dst.Pixels() + offset, width, height, 2, 2 * dst.Width() };
+        plane.Coverage = { coverage != nullptr ? coverage->Pixels() + offset : nullptr, width, height, 2, 2 * dst.Width() };
+        // The pixel u, v of the plane is at 2 * u + ox, 2 * v + oy of the mosaic, the same goes for the source
+        plane.Ax[0] = ax[0];
+        plane.Ax[1] = ax[1];
+        plane.Ax[2] = ( ax[0] * ox + ax[1] * oy + ax[2] - ox ) / 2;
+        plane.Ay[0] = ay[0];
+        plane.Ay[1] = ay[1];
+        plane.Ay[2] = ( ay[0] * ox + ay[1] * oy + ay[2] - oy ) / 2;
+    }
+    warpPlanes( planes );
+}
+
+template<typename T>
+void CImageWarp::warpPlanes( const std::vector<CPlaneWarp<T>>& planes ) const
+{
+    struct CTile {
+        int Plane;
+        int X0;
+        int Y0;
+        int X1;
+        int Y1;
+    };
+    std::vector<CTile> tiles;
+    for( size_t i = 0; i < planes.size(); i++ ) {
+        const auto& dst = planes[i].Dst;
+        for( int y = 0; y < dst.Height; y += TileSize ) {
+            for( int x = 0; x < dst.Width; x += TileSize ) {
+                tiles.push_back( { static_cast<int>( i ), x, y, std::min( dst.Width, x + TileSize ), std::min( dst.Height, y + TileSize ) } );
+            }
+        }
+    }
+    auto warpTiles = [&]( const CTile& tile ) {
+        const CPlaneWarp<T>& plane = planes[tile.Plane];
+        switch( taps ) {
+            case 2:
+                warpTile<T, 2>( plane, tile.X0, tile.Y0, tile.X1, tile.Y1 );
+                break;
+            case 4:
+                warpTile<T, 4>( plane, tile.X0, tile.Y0, tile.X1, tile.Y1 );
+                break;
+            case 6:
+                warpTile<T, 6>( plane, tile.X0, tile.Y0, tile.X1, tile.Y1 );
+                break;
+            default:
+                assert( false );
+        }
+    };
+    if( isParallel ) {
+        QtConcurrent::blockingMap( tiles, warpTiles );
+    } else {
+        std::for_each( tiles.begin(), tiles.end(), warpTiles );
+    }
+}
+
+// The number of taps is a constant, so the loops over the kernel are unrolled by the compiler
+template<typename T, int Taps>
+void CImageWarp::warpTile( const CPlaneWarp<T>& plane, int x0, int y0, int x1, int y1 ) const
+{
+    typedef typename CWarpSum<T>::Type Sum;
+    const CPlane<const T>& src = plane.Src;
+    const CPlane<T>& dst = plane.Dst;
+    const CPlane<unsigned char>& coverage = plane.Coverage;
+    const double maxX = src.Width - 0.5;
+    const double maxY = src.Height - 0.5;
+
+    for( int y = y0; y < y1; y++ ) {
+        double sx = plane.Ax[0] * x0 + plane.Ax[1] * y + plane.Ax[2];
+        double sy = plane.Ay[0] * x0 + plane.Ay[1] * y + plane.Ay[2];
+        T* out = dst.Pixels + y * dst.Stride + x0 * dst.Step;
+        unsigned char* covered = coverage.Pixels != nullptr ? coverage.Pixels + y * coverage.Stride + x0 * coverage.Step : nullptr;
+        for( int x = x0; x < x1; x++, sx += plane.Ax[0], sy += plane.Ay[0], out += dst.Step ) {
+            const bool isInside = sx >= -0.5 && sy >= -0.5 && sx <= maxX && sy <= maxY;
+            if( covered != nullptr ) {
+                *covered = isInside ? 1 : 0;
+                covered += coverage.Step;
+            }
+            if( not isInside ) {
+                setPixel( *out, fillValue );
+                continue;
+            }
+            // Truncation is the floor for coordinates from -0.5 up
+            const int ix = static_cast<int>( sx + 1 ) - 1;
+            const int iy = static_cast<int>( sy + 1 ) - 1;
+            const float* wx = weights.data() + static_cast<int>( ( sx - ix ) * Phases + 0.5 ) * Taps;
+            const float* wy = weights.data() + static_cast<int>( ( sy - iy ) * Phases + 0.5 ) * Taps;
+            const int bx = ix - ( Taps / 2 - 1 );
+            const int by = iy - ( Taps / 2 - 1 );
+
+            Sum sum = 0;
+            if( bx >= 0 && by >= 0 && bx + Taps <= src.Width && by + Taps <= src.Height ) {
+                const T* row = src.Pixels + by * src.Stride + bx * src.Step;
+                for( int j = 0; j < Taps; j++, row += src.Stride ) {
+                    Sum rowSum = 0;
+                    for( int i = 0; i < Taps; i++ ) {
+                        rowSum += wx[i] * row[i * src.Step];
+                    }
+                    sum += wy[j] * rowSum;
+                }
+            } else {
+                // Near the edges the pixels outside of the source repeat the nearest edge pixels
+                int columns[Taps];
+                for( int i = 0; i < Taps; i++ ) {
+                    columns[i] = std::min( std::max( bx + i, 0 ), src.Width - 1 ) * src.Step;
+                }
+                for( int j = 0; j < Taps; j++ ) {
+                    const T* row = src.Pixels + std::min( std::max( by + j, 0 ), src.Height - 1 ) * src.Stride;
+                    Sum rowSum = 0;
+                    for( int i = 0; i < Taps; i++ ) {
+                        rowSum += wx[i] * row[columns[i]];
+                    }
+                    sum += wy[j] * rowSum;
+                }
+            }
+            setPixel( *out, sum );
+        }
+    }
+}
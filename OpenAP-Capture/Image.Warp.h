@@ -0,0 +1,92 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <Image.Image.h>
+#include <Math.Matrix.h>
+
+#include <vector>
+
+enum TResamplingKernel {
+    RK_Bilinear, // 2x2 pixels
+    RK_Bicubic, // 4x4 pixels, Keys cubic convolution ( a = -0.5 )
+    RK_Lanczos3 // 6x6 pixels, sharpest, rings slightly around stars
+};
+
+// Resampling of images under an affine transform. The kernel is separable: weights for both axes come from one table
+// computed by the constructor for Phases subpixel positions, so a pixel costs Taps x Taps multiply-adds and two table
+// lookups. The output is processed by tiles on worker threads, so the source pixels of a tile stay in the cache
+// for any rotation. Pixels whose kernel reaches over the edge of the source repeat the edge pixels
+class CImageWarp {
+public:
+    // Subpixel positions of the weight tables. Rounding of positions shifts pixels by up to 1 / ( 2 * Phases )
+    static const int Phases = 256;
+    static const int TileSize = 64;
+
+    explicit CImageWarp( TResamplingKernel kernel = RK_Lanczos3 );
+
+    TResamplingKernel Kernel() const { return kernel; }
+    // Width of the kernel in pixels
+    int Taps() const { return taps; }
+    void SetParallel( bool _isParallel ) { isParallel = _isParallel; }
+
+    // The output pixel x, y is taken from the source at Ax[0] * x + Ax[1] * y + Ax[2], Ay[0] * x + Ay[1] * y + Ay[2].
+    // These are the 3x1 matrices of LeastSquaresAffineTransform fitted from the output (reference) coordinates
+    // to the source (frame) coordinates; InverseAffineTransform turns around a transform of the other direction
+    void SetAffineTransform( const CMatrix<double>& Ax, const CMatrix<double>& Ay );
+    void SetAffineTransform( const double* ax, const double* ay );
+    void SetTranslation( double dx, double dy );
+    // Value of the output pixels mapped outside of the source (0 by default)
+    void SetFillValue( double value ) { fillValue = value; }
+
+    // The output keeps its own size. Coverage (optional, the size of the output) is set to 1 for the pixels
+    // mapped inside of the source and to 0 for the others
+    void Warp( const CPixelBuffer<unsigned short>& src, CPixelBuffer<unsigned short>& dst, CGrayImage* coverage = nullptr ) const;
+    void Warp( const CPixelBuffer<unsigned short, 3>& src, CPixelBuffer<unsigned short, 3>& dst, CGrayImage* coverage = nullptr ) const;
+    void Warp( const CPixelBuffer<float>& src, CPixelBuffer<float>& dst, CGrayImage* coverage = nullptr ) const;
+    void Warp( const CPixelBuffer<double>& src, CPixelBuffer<double>& dst, CGrayImage* coverage = nullptr ) const;
+    // Bayer mosaics. Each pixel is interpolated from the pixels of its own color, so the 2x2 pattern stays in place
+    // and the output is debayered as the source
+    void WarpCfa( const CPixelBuffer<unsigned short>& src, CPixelBuffer<unsigned short>& dst, CGrayImage* coverage = nullptr ) const;
+    void WarpCfa( const CPixelBuffer<double>& src, CPixelBuffer<double>& dst, CGrayImage* coverage = nullptr ) const;
+
+private:
+    // Pixels of one channel: x, y is at Pixels[y * Stride + x * Step]
+    template<typename T>
+    struct CPlane {
+        T* Pixels;
+        int Width;
+        int Height;
+        int Step;
+        int Stride;
+    };
+    // Plane of the output with the transform to its source plane and the plane of the coverage (may be null)
+    template<typename T>
+    struct CPlaneWarp {
+        CPlane<const T> Src;
+        CPlane<T> Dst;
+        CPlane<unsigned char> Coverage;
+        double Ax[3];
+        double Ay[3];
+    };
+
+    TResamplingKernel kernel;
+    int taps;
+    // Taps weights for each of the Phases + 1 positions (from 0 to 1 inclusive) of the sample between pixels
+    std::vector<float> weights;
+    double ax[3] = { 1, 0, 0 };
+    double ay[3] = { 0, 1, 0 };
+    double fillValue = 0;
+    bool isParallel = true;
+
+    static double kernelValue( TResamplingKernel, double x );
+    template<typename T, int numOfChannels>
+    void warp( const CPixelBuffer<T, numOfChannels>& src, CPixelBuffer<T, numOfChannels>& dst, CGrayImage* coverage ) const;
+    template<typename T>
+    void warpCfa( const CPixelBuffer<T>& src, CPixelBuffer<T>& dst, CGrayImage* coverage ) const;
+    template<typename T>
+    void warpPlanes( const std::vector<CPlaneWarp<T>>& planes ) const;
+    template<typename T, int Taps>
+    void warpTile( const CPlaneWarp<T>& plane, int x0, int y0, int x1, int y1 ) const;
+};
@@ -2,6 +2,9 @@
 // GNU General Public License version 3. See <http://www.gnu.org/licenses/>
 
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QHostAddress>
 #include <QScreen>
 
 #include "MainFrame.h"
@@ -13,7 +16,43 @@ int main( int argc, char *argv[] )
     QCoreApplication::setOrganizationName( "aleksey-ka" );
     QCoreApplication::setApplicationName( "OpenAP-Capture" );
 
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption previewPortOption( "preview-port",
+        "Stream the live view to clients on the port (see --preview-address). Run with -platform offscreen to run without a display.", "port" );
+    parser.addOption( previewPortOption );
+    QCommandLineOption previewAddressOption( "preview-address",
+        "Address to listen on for the live view clients (127.0.0.1 by default, 0.0.0.0 for all interfaces). "
+        "There is no authentication, prefer an SSH tunnel to exposing the port.", "address", "127.0.0.1" );
+    parser.addOption( previewAddressOption );
+    QCommandLineOption badPixelsOption( "bad-pixels",
+        "Correct hot and dead pixels found in the master dark in each captured frame for viewing and analysis.", "file" );
+    parser.addOption( badPixelsOption );
+    QCommandLineOption saveCorrectedOption( "save-corrected",
+        "Save frames with bad pixels corrected (with --bad-pixels). Such frames are marked BAD_PIXELS_CORRECTED and must not be calibrated with darks." );
+    parser.addOption( saveCorrectedOption );
+    parser.process( a );
+
     MainFrame w;
+    if( parser.isSet( previewPortOption ) ) {
+        bool ok = false;
+        quint16 port = parser.value( previewPortOption ).toUShort( &ok );
+        if( not ok || port == 0 ) {
+            qCritical() << "Invalid preview port:" << parser.value( previewPortOption );
+            return 1;
+        }
+        QHostAddress address;
+        if( not address.setAddress( parser.value( previewAddressOption ) ) ) {
+            qCritical() << "Invalid preview address:" << parser.value( previewAddressOption );
+            return 1;
+        }
+        if( not w.StartPreviewServer( port, address ) ) {
+            return 1;
+        }
+    }
+    if( parser.isSet( badPixelsOption ) && not w.LoadBadPixelMap( parser.value( badPixelsOption ), parser.isSet( saveCorrectedOption ) ) ) {
+        return 1;
+    }
 
     // Center main frame on the screen
     QRect screenRect = a.screens().first()->geometry();
@@ -46,8 +46,9 @@ MainFrame::MainFrame( QWidget *parent ) :
     // TODO: In Qt 5.15 lambdas can be used in QShortcut constructor
     connect( new QShortcut( QKeySequence( Qt::CTRL + Qt::Key_T ), this ), &QShortcut::activated, [=]() { tools.Toggle<Tools::TargetCircle>(); } );
 
-    connect( &imageReadyWatcher, &QFutureWatcher<std::shared_ptr<CRawU16Image>>::finished, this, &MainFrame::imageReady );
+    connect( &imageReadyWatcher, &QFutureWatcher<CapturedFrame>::finished, this, &MainFrame::imageReady );
     connect( &imageSavedWatcher, &QFutureWatcher<QString>::finished, this, &MainFrame::imageSaved );
+    connect( &renderWatcher, &QFutureWatcher<RenderedFrame>::finished, this, &MainFrame::rendered );
 
     connect( &exposureTimer, &QTimer::timeout, [=]() { if( exposureRemainingTime > 0 ) exposureRemainingTime--; showCaptureStatus(); } );
 
@@ -211,6 +212,8 @@ MainFrame::MainFrame( QWidget *parent ) :
 
 MainFrame::~MainFrame()
 {
+    // The render worker uses the render buffers
+    renderWatcher.waitForFinished();
     if( camera != 0 ) {
         closeCamera();
     }
@@ -243,23 +246,6 @@ void MainFrame::resizeEvent( QResizeEvent* event )
     }
 }
 
-static QPixmap focusingHelperPixmap( TRenderingMethod rendering, const CRawU16Image* image, int x0, int y0, int w, int h )
-{
-    if( rendering == RM_HalfResolution ) {
-        int cx = x0 + w / 2;
-        int cy = y0 + h / 2;
-        x0 = cx - w;
-        y0 = cy - h;
-        x0 += x0 % 2;
-        y0 += y0 % 2;
-        w *= 2;
-        h *= 2;
-        return Qt::CreatePixmap( CRawU16( image ).StretchHalfRes( x0, y0, w, h ) );
-    } else {
-        return Qt::CreatePixmap( CRawU16( image ).Stretch( x0, y0, w, h ) );
-    }
-}
-
 static void drawTimeSeries( QPainter& painter, QColor color, int shift, double scale, int offset, const std::vector<double>& data )
 {
     QPen penB( color );
@@ -322,7 +308,7 @@ void MainFrame::showZoom( bool update )
                     focusingHelper->SetStackSize( ui->stackSizeSpinBox->value() );
                     pixmap = Qt::CreatePixmap( focusingHelper->GetStackedImage( ui->stretchCheckBox->isChecked(), ui->factorSpinBox->value() ) );
                 } else {
-                    pixmap = focusingHelperPixmap( rendering, currentImage.get(), c.x() - imageSize / 2, c.y() - imageSize / 2, imageSize, imageSize );
+                    pixmap = zoomTileCache.Render( currentImage, rendering, true, c.x(), c.y(), imageSize, imageSize );
                 }
 
                 QPainter painter( &pixmap );
@@ -385,13 +371,8 @@ void MainFrame::showZoom( bool update )
                 }
 
             } else {
-                // Not in focusing mode
-                if( ui->stretchCheckBox->isChecked() ) {
-                    pixmap = focusingHelperPixmap( rendering, currentImage.get(), c.x() - imageSize / 2, c.y() - imageSize / 2, imageSize, imageSize );
-                } else {
-                    Renderer renderer( currentImage->RawPixels(), currentImage->Width(), currentImage->Height(), currentImage->BitDepth() );
-                    pixmap = renderer.Render( rendering, c.x() - imageSize / 2, c.y() - imageSize / 2, imageSize, imageSize );
-                }
+                // Not in focusing mode (when panning over the same frame only newly exposed tiles are rendered)
+                pixmap = zoomTileCache.Render( currentImage, rendering, ui->stretchCheckBox->isChecked(), c.x(), c.y(), imageSize, imageSize );
             }
             if( scale > 1 ) {
                 pixmap = pixmap.scaled( imageSize * scale, imageSize * scale, Qt::IgnoreAspectRatio );
@@ -615,6 +596,7 @@ void MainFrame::on_captureButton_clicked()
         saveToPath.clear();
     }
     seriesId = std::chrono::system_clock::to_time_t( std::chrono::system_clock::now() );
+    isStretchResetPending = true;
 
     settings.setValue( "Exposure", ui->exposureSpinBox->value() * exposureSuffixToScale( ui->exposureSpinBox->suffix() ) );
     settings.setValue( "Gain", ui->gainSpinBox->value() );
@@ -663,6 +645,7 @@ std::shared_ptr<Hardware::CAMERA_INFO> MainFrame::openCamera( int index )
     }
 
     //camera->PrintDebugInfo();
+    isStretchResetPending = true;
 
     auto end = std::chrono::steady_clock::now();
     auto msec = std::chrono::duration_cast<std::chrono::milliseconds>( end - start ).count();
@@ -691,6 +674,13 @@ void MainFrame::startCapture()
     camera->SetWhiteBalanceB( useCameraWhiteBalance ? 95 : 50 );
     camera->SetOffset( offset );
 
+    // Stretch tracked over the previous frames does not fit after a change of the exposure, gain or filter
+    const auto captureSettings = std::make_tuple( exposure, gain, offset, useCameraWhiteBalance, ui->filterComboBox->currentText() );
+    if( captureSettings != stretchCaptureSettings ) {
+        stretchCaptureSettings = captureSettings;
+        isStretchResetPending = true;
+    }
+
     ImageInfo imageInfo;
     if( filterWheel != 0 ) {
         auto channel = ui->filterComboBox->currentText();
@@ -716,7 +706,7 @@ void MainFrame::startCapture()
         }
         previousTimestamp = timestamp;
 
-        auto result = camera->DoExposure();
+        auto result = correctBadPixels( camera->DoExposure() );
 
         auto msec = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - start ).count();
         qDebug() << "Captured in " << msec << "msec";
@@ -760,13 +750,31 @@ void MainFrame::imageReady()
 {
     exposureTimer.stop();
 
-    auto result = imageReadyWatcher.result();
+    auto frame = imageReadyWatcher.result();
+    auto result = frame.Image;
 
     int currentIndex = capturedFrames.fetchAndAddOrdered( 1 );
 
+    if( result != 0 && result->Info().Flags & IF_SERIES_END ) {
+        ui->continuousCaptureCheckBox->setChecked( false );
+    }
+
+    // Start the next exposure right away, so that the capture cadence does not depend on rendering
+    if( ui->continuousCaptureCheckBox->isChecked() ) {
+        ui->continuousCaptureCheckBox->setText( "Continuous capture (uncheck to stop)" );
+        startCapture();
+    } else {
+        capturedFrames = 0;
+        ui->continuousCaptureCheckBox->setText( "Continuous capture" );
+        ui->captureButton->setText( "Capture" );
+        ui->captureButton->setEnabled( true );
+        ui->saveToCheckBox->setEnabled( true );
+    }
+
     if( result != 0 ) {
+        auto saved = frame.Saved;
         imageSavedWatcher.setFuture( QtConcurrent::run( [=]() {
-            const auto& info = result->Info();
+            const auto& info = saved->Info();
             if( saveToPath.length() > 0 ) {
                 auto ext = ui->formatComboBox->currentText();
                 settings.setValue( "FileFormat", ext );
@@ -786,7 +794,7 @@ void MainFrame::imageReady()
                 auto name = nameTemplate.arg( QString::number( info.SeriesId, 16 ), QString::number( currentIndex ).rightJustified( 5, '0' ),
                     ( info.CFA.empty() ? "" : ".cfa" ), ( info.Channel.empty() ? "" : "." + info.Channel ).c_str(), ext );
 
-                result->SaveToFile( ( saveToPath + QDir::separator() + name ).toLocal8Bit().constData(), format );
+                saved->SaveToFile( ( saveToPath + QDir::separator() + name ).toLocal8Bit().constData(), format );
             }
 
             return formatImageInfo( info );
@@ -795,8 +803,7 @@ void MainFrame::imageReady()
 
         currentImage = result;
 
-        auto msec = render( result->RawPixels(), result->Width(), result->Height(), result->BitDepth() );
-        qDebug() << "Rendered in " << msec << "msec";
+        render( result );
 
         selectionStart = selectionEnd = -1;
 
@@ -816,7 +823,7 @@ void MainFrame::imageReady()
                     graphs.insert( "calibrated_delta", GraphData( "CDELTA", QColor::fromRgb( 0xA0, 0xA0, 0 ), 2 ) );
                 }
             }
-            graphImageInfo.append( currentImage->Info() );
+            graphImageInfo.append( saved->Info() );
 
             //auto h = pixels_histogram( result->RawPixels(), result->Count(), result->BitDepth() );
             //auto value = pixels_histogram_median( h, 0 );
@@ -854,10 +861,10 @@ void MainFrame::imageReady()
                 graphs.find( "calibrated_sigma" )->Values.emplace_back( sigma );
                 graphs.find( "calibrated_delta" )->Values.emplace_back( fabs( max - min ) );
 
-                CPixelBuffer<uint16_t> result( currentImage->Width(), currentImage->Height() );
-                pixels_set_round_limit( result.Pixels(), diff.Pixels(), diff.Count(), currentImage->BitDepth() );
+                auto calibrated = std::make_shared<CRawU16Image>( currentImage->Info() );
+                pixels_set_round_limit( calibrated->RawPixels(), diff.Pixels(), diff.Count(), currentImage->BitDepth() );
 
-                render( result.Pixels(), result.Width(), result.Height(), currentImage->BitDepth() );
+                render( calibrated );
             }
 
             ui->imageSeriesView->setVisible( true );
@@ -992,7 +999,7 @@ void MainFrame::imageReady()
                     view->update();
 
                     currentImage = CRawU16Image::LoadFromFile( graphImageInfo[selectionStart].FilePath.c_str() );
-                    render( currentImage->RawPixels(), currentImage->Width(), currentImage->Height(), currentImage->BitDepth() );
+                    render( currentImage );
                     ui->infoLabel->setText( formatImageInfo( currentImage->Info() ) );
                 }
             } );
@@ -1084,7 +1091,7 @@ void MainFrame::imageReady()
                         }
                         if( selectionStart >= 0 ) {
                             currentImage = CRawU16Image::LoadFromFile( graphImageInfo[selectionStart].FilePath.c_str() );
-                            render( currentImage->RawPixels(), currentImage->Width(), currentImage->Height(), currentImage->BitDepth() );
+                            render( currentImage );
                             ui->infoLabel->setText( formatImageInfo( currentImage->Info() ) );
                         }
                     }
@@ -1116,21 +1123,6 @@ void MainFrame::imageReady()
             } );
         }
     }
-
-    if( result->Info().Flags & IF_SERIES_END ) {
-        ui->continuousCaptureCheckBox->setChecked( false );
-    }
-
-    if( ui->continuousCaptureCheckBox->isChecked() ) {
-        ui->continuousCaptureCheckBox->setText( "Continuous capture (uncheck to stop)" );
-        startCapture();
-    } else {
-        capturedFrames = 0;
-        ui->continuousCaptureCheckBox->setText( "Continuous capture" );
-        ui->captureButton->setText( "Capture" );
-        ui->captureButton->setEnabled( true );
-        ui->saveToCheckBox->setEnabled( true );
-    }
 }
 
 void MainFrame::resetGraph()
@@ -1145,43 +1137,146 @@ void MainFrame::imageSaved()
     ui->infoLabel->setText( imageSavedWatcher.result() );
 }
 
-ulong MainFrame::render( const ushort* raw, int width, int height, int bitDepth )
+void MainFrame::render( std::shared_ptr<const CRawU16Image> frame )
 {
-    auto start = std::chrono::steady_clock::now();
-
+    // Zoom is small and tied to the tools (focusing helper), it is rendered right away
     if( zoom > 0 ) {
         showZoom();
     }
-    if( !ui->renderOffCheckBox->isChecked() ) {
-        QPixmap pixmap;
-        if( ui->stretchCheckBox->isChecked() ) {
-            CRawU16 rawU16( raw, width, height, bitDepth );
-            if( ui->showQuarterResolution->isChecked() ) {
-                pixmap = Qt::CreatePixmap( rawU16.StretchQuarterRes( 0, 0, width, height ) );
-            } else if( ui->showFullResolution->isChecked() ) {
-                pixmap = Qt::CreatePixmap( rawU16.Stretch( 0, 0, width, height ) );
+    if( ui->renderOffCheckBox->isChecked() ) {
+        ui->imageView->clear();
+        return;
+    }
+    if( renderWatcher.isRunning() ) {
+        // Render the latest frame when the worker is done (any older frame waiting there is dropped)
+        pendingRenderFrame = frame;
+        return;
+    }
+    startRender( frame );
+}
+
+void MainFrame::startRender( std::shared_ptr<const CRawU16Image> frame )
+{
+    // Settings are taken on the GUI thread
+    const bool stretch = ui->stretchCheckBox->isChecked();
+    TRenderingMethod method = RM_HalfResolution;
+    if( ui->showQuarterResolution->isChecked() ) {
+        method = RM_QuarterResolution;
+    } else if( ui->showFullResolution->isChecked() ) {
+        method = RM_FullResolution;
+    }
+
+    const bool resetStretch = isStretchResetPending;
+    isStretchResetPending = false;
+
+    renderWatcher.setFuture( QtConcurrent::run( [=]() {
+        auto start = std::chrono::steady_clock::now();
+        if( resetStretch ) {
+            stretchTracker.Reset();
+        }
+
+        const int width = frame->Width();
+        const int height = frame->Height();
+        RenderedFrame result;
+        if( stretch ) {
+            CRawU16 rawU16( frame.get() );
+            auto params = stretchTracker.Update( rawU16, 0, 0, width, height );
+            std::shared_ptr<CRgbImage> image;
+            if( method == RM_QuarterResolution ) {
+                image = renderBuffers.Get( width / 4, height / 4 );
+                rawU16.StretchBinned( params, 4, 0, 0, width, height, image.get(), renderBuffers.Scratch() );
+            } else if( method == RM_FullResolution ) {
+                image = renderBuffers.Get( width, height );
+                rawU16.Stretch( params, 0, 0, width, height, image.get(), renderBuffers.Scratch() );
             } else {
-                pixmap = Qt::CreatePixmap( rawU16.StretchHalfRes( 0, 0, width, height ) );
+                image = renderBuffers.Get( width / 2, height / 2 );
+                rawU16.StretchHalfRes( params, 0, 0, width, height, image.get() );
             }
+            result.Image = Qt::ShareImage( image );
         } else {
-            Renderer renderer( raw, width, height, bitDepth );
-            if( ui->showQuarterResolution->isChecked() ) {
-                pixmap = renderer.Render( RM_QuarterResolution );
-            } else if( ui->showFullResolution->isChecked() ) {
-                pixmap = renderer.Render(  RM_FullResolution );
-            } else {
-                pixmap = renderer.Render( RM_HalfResolution );
-            }
-            ui->histogramView->setPixmap( renderer.RenderHistogram() );
+            Renderer renderer( frame->RawPixels(), width, height, frame->BitDepth(), &renderBuffers );
+            result.Image = renderer.RenderImage( method );
+            result.Histogram = renderer.RenderHistogramImage();
         }
-        tools.Draw( pixmap );
-        ui->imageView->setPixmap( pixmap );
-    } else {
-        ui->imageView->clear();
+
+        auto end = std::chrono::steady_clock::now();
+        result.Msec = std::chrono::duration_cast<std::chrono::milliseconds>( end - start ).count();
+        return result;
+    } ) );
+}
+
+void MainFrame::rendered()
+{
+    auto result = renderWatcher.result();
+    qDebug() << "Rendered in " << result.Msec << "msec";
+
+    if( pendingRenderFrame != 0 ) {
+        // The displayed frame is already stale, go on with the latest one
+        startRender( pendingRenderFrame );
+        pendingRenderFrame.reset();
     }
 
-    auto end = std::chrono::steady_clock::now();
-    return std::chrono::duration_cast<std::chrono::milliseconds>( end - start ).count();
+    if( ui->renderOffCheckBox->isChecked() ) {
+        return;
+    }
+    QPixmap pixmap = QPixmap::fromImage( result.Image );
+    tools.Draw( pixmap );
+    ui->imageView->setPixmap( pixmap );
+    if( not result.Histogram.isNull() ) {
+        ui->histogramView->setPixmap( QPixmap::fromImage( result.Histogram ) );
+    }
+    if( previewServer.Clients() > 0 ) {
+        previewServer.Publish( pixmap.toImage(), result.Histogram );
+    }
+}
+
+bool MainFrame::StartPreviewServer( quint16 port, const QHostAddress& address )
+{
+    return previewServer.Listen( port, address );
+}
+
+bool MainFrame::LoadBadPixelMap( const QString& masterDarkPath, bool saveCorrected )
+{
+    auto dark = CRawU16Image::LoadFromFile( masterDarkPath.toLocal8Bit().constData() );
+    if( dark == 0 ) {
+        qWarning() << "Cannot load master dark" << masterDarkPath;
+        return false;
+    }
+    auto map = CBadPixelMap::FromMasterDark( *dark );
+    qDebug() << "Bad pixels:" << map->Count();
+    badPixelMap = map;
+    isSavingCorrectedFrames = saveCorrected;
+    return true;
+}
+
+MainFrame::CapturedFrame MainFrame::correctBadPixels( std::shared_ptr<const CRawU16Image> frame )
+{
+    if( frame == 0 || badPixelMap == 0 ) {
+        return { frame, frame };
+    }
+    if( frame->Width() != badPixelMap->Width() || frame->Height() != badPixelMap->Height() ) {
+        // Different ROI or binning than the master dark
+        if( not isBadPixelMapMismatchReported ) {
+            qWarning() << "Bad pixels are not corrected: the frame is" << frame->Width() << "x" << frame->Height()
+                << "and the master dark is" << badPixelMap->Width() << "x" << badPixelMap->Height();
+            isBadPixelMapMismatchReported = true;
+        }
+        return { frame, frame };
+    }
+
+    // The captured frame is kept intact for saving unless corrected frames are saved (calibration with a master dark
+    // would otherwise subtract hot pixels from the already corrected values)
+    auto start = std::chrono::steady_clock::now();
+    ImageInfo info = frame->Info();
+    if( isSavingCorrectedFrames ) {
+        info.Flags |= IF_BAD_PIXELS_CORRECTED;
+    }
+    auto corrected = std::make_shared<CRawU16Image>( info );
+    pixels_set( corrected->RawPixels(), frame->RawPixels(), frame->Count() );
+    badPixelMap->Apply( corrected.get() );
+    qDebug() << "Bad pixels corrected in" << std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count() << "usec";
+
+    return { corrected, isSavingCorrectedFrames ? corrected : frame };
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
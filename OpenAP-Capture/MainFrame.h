@@ -9,6 +9,8 @@
 #include <QTimer>
 #include <QSettings>
 
+#include <tuple>
+
 #include "ImageView.h"
 
 #include "Hardware.Camera.h"
@@ -16,6 +18,9 @@
 #include "Hardware.FilterWheel.h"
 
 #include "MainFrame.Tools.h"
+#include "Renderer.TileCache.h"
+#include "Preview.Server.h"
+#include "Image.BadPixels.h"
 
 namespace Ui {
     class MainFrame;
@@ -29,6 +34,12 @@ public:
     explicit MainFrame( QWidget *parent = nullptr );
     ~MainFrame();
 
+    // Streams the live view to remote clients (instead of VNC of the whole desktop)
+    bool StartPreviewServer( quint16 port, const QHostAddress& address );
+    // Defects found in the master dark are corrected in each captured frame for rendering and analysis. Frames are saved
+    // as captured unless saveCorrected is set (such frames are marked with IF_BAD_PIXELS_CORRECTED)
+    bool LoadBadPixelMap( const QString& masterDarkPath, bool saveCorrected = false );
+
 private slots:
     void on_closeButton_clicked();
 
@@ -86,11 +97,16 @@ private:
     void closeCamera();
 
     // Capture
-    QFutureWatcher<std::shared_ptr<const CRawU16Image>> imageReadyWatcher;
+    struct CapturedFrame {
+        std::shared_ptr<const CRawU16Image> Image; // Rendered and analyzed
+        std::shared_ptr<const CRawU16Image> Saved; // The same frame unless bad pixels are corrected only in the image
+    };
+    QFutureWatcher<CapturedFrame> imageReadyWatcher;
     QFutureWatcher<QString> imageSavedWatcher;
     std::shared_ptr<const CRawU16Image> currentImage;
     int zoom = 0;
     QPoint zoomCenter;
+    CZoomTileCache zoomTileCache;
     int exposureRemainingTime;
     uint64_t seriesId = 0;
     QAtomicInt capturedFrames = 0;
@@ -115,8 +131,30 @@ private:
 
     Tools tools;
 
-    // Rendering
-    ulong render( const ushort* raw, int width, int height, int bitDepth );
+    // Rendering (in the background, only the latest frame is rendered and stale frames are dropped)
+    struct RenderedFrame {
+        QImage Image;
+        QImage Histogram;
+        qint64 Msec = 0;
+    };
+    CRenderBuffers renderBuffers;
+    // Used by the render worker only
+    CStretchTracker stretchTracker;
+    // Set when the camera or the capture settings change, the next render resets the stretch tracker
+    bool isStretchResetPending = true;
+    std::tuple<int, int, int, bool, QString> stretchCaptureSettings;
+    QFutureWatcher<RenderedFrame> renderWatcher;
+    std::shared_ptr<const CRawU16Image> pendingRenderFrame;
+    void render( std::shared_ptr<const CRawU16Image> );
+    void startRender( std::shared_ptr<const CRawU16Image> );
+    void rendered();
+    CPreviewServer previewServer;
+    // Set once at startup, read by the capture worker
+    std::shared_ptr<const CBadPixelMap> badPixelMap;
+    bool isSavingCorrectedFrames = false;
+    // Used by the capture worker only
+    bool isBadPixelMapMismatchReported = false;
+    CapturedFrame correctBadPixels( std::shared_ptr<const CRawU16Image> );
     QString formatImageInfo( const ImageInfo& );
 
     // Series Graphs
@@ -0,0 +1,250 @@
+﻿// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include <Math.Fft.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+CFft::CFft( int _size ) :
+	size( _size )
+{
+	assert( IsPowerOfTwo( size ) );
+	// Factors of the stage combining transforms of the size half are at [half, 2 * half)
+	twiddles.resize( std::max( 1, size ) );
+	for( int half = 1; half < size; half *= 2 ) {
+		for( int k = 0; k < half; k++ ) {
+			const double angle = -M_PI * k / half;
+			twiddles[half + k] = std::complex<float>( static_cast<float>( std::cos( angle ) ), static_cast<float>( std::sin( angle ) ) );
+		}
+	}
+	int bits = 0;
+	while( ( 1 << bits ) < size ) {
+		bits++;
+	}
+	for( int i = 0; i < size; i++ ) {
+		int reversed = 0;
+		for( int b = 0; b < bits; b++ ) {
+			reversed |= ( ( i >> b ) & 1 ) << ( bits - 1 - b );
+		}
+		if( i < reversed ) {
+			swaps.emplace_back( i, reversed );
+		}
+	}
+}
+
+void CFft::transform( std::complex<float>* data, bool inverse ) const
+{
+	for( const auto& s : swaps ) {
+		std::swap( data[s.first], data[s.second] );
+	}
+	// Complex arithmetic on floats (std::complex multiplication checks for infinities and is much slower)
+	float* d = reinterpret_cast<float*>( data );
+	const float sign = inverse ? -1.0f : 1.0f;
+	// The first two stages have trivial twiddle factors
+	if( size >= 2 ) {
+		for( int i = 0; i < 2 * size; i += 4 ) {
+			const float re = d[i + 2];
+			const float im = d[i + 3];
+			d[i + 2] = d[i] - re;
+			d[i + 3] = d[i + 1] - im;
+			d[i] += re;
+			d[i + 1] += im;
+		}
+	}
+	if( size >= 4 ) {
+		for( int i = 0; i < 2 * size; i += 8 ) {
+			// Multiplication by -i (forward) or i (inverse)
+			const float re = sign * d[i + 7];
+			const float im = -sign * d[i + 6];
+			d[i + 6] = d[i + 2] - re;
+			d[i + 7] = d[i + 3] - im;
+			d[i + 2] += re;
+			d[i + 3] += im;
+			const float re0 = d[i + 4];
+			const float im0 = d[i + 5];
+			d[i + 4] = d[i] - re0;
+			d[i + 5] = d[i + 1] - im0;
+			d[i] += re0;
+			d[i + 1] += im0;
+		}
+	}
+	// Pairs of the following stages are done in one pass over the data (four points with their twiddle factors at once)
+	int half = 4;
+	for( ; 2 * half < size; half *= 4 ) {
+		const float* w1 = reinterpret_cast<const float*>( twiddles.data() + half );
+		const float* w2 = reinterpret_cast<const float*>( twiddles.data() + 2 * half );
+		for( int start = 0; start < size; start += 4 * half ) {
+			float* p0 = d + 2 * start;
+			float* p1 = p0 + 2 * half;
+			float* p2 = p1 + 2 * half;
+			float* p3 = p2 + 2 * half;
+			for( int k = 0; k < 2 * half; k += 2 ) {
+				// The first stage: ( p0, p1 ) and ( p2, p3 ) with the factor of the half
+				const float wr = w1[k];
+				const float wi = sign * w1[k + 1];
+				const float r1 = p1[k] * wr - p1[k + 1] * wi;
+				const float i1 = p1[k] * wi + p1[k + 1] * wr;
+				const float r3 = p3[k] * wr - p3[k + 1] * wi;
+				const float i3 = p3[k] * wi + p3[k + 1] * wr;
+				const float b0r = p0[k] + r1;
+				const float b0i = p0[k + 1] + i1;
+				const float b1r = p0[k] - r1;
+				const float b1i = p0[k + 1] - i1;
+				const float b2r = p2[k] + r3;
+				const float b2i = p2[k + 1] + i3;
+				const float b3r = p2[k] - r3;
+				const float b3i = p2[k + 1] - i3;
+				// The second stage: ( b0, b2 ) with the factor of the double half and ( b1, b3 ) with the same factor
+				// multiplied by -i (forward) or i (inverse)
+				const float vr = w2[k];
+				const float vi = sign * w2[k + 1];
+				const float r2 = b2r * vr - b2i * vi;
+				const float i2 = b2r * vi + b2i * vr;
+				const float tr = b3r * vr - b3i * vi;
+				const float ti = b3r * vi + b3i * vr;
+				const float r4 = sign * ti;
+				const float i4 = -sign * tr;
+				p0[k] = b0r + r2;
+				p0[k + 1] = b0i + i2;
+				p2[k] = b0r - r2;
+				p2[k + 1] = b0i - i2;
+				p1[k] = b1r + r4;
+				p1[k + 1] = b1i + i4;
+				p3[k] = b1r - r4;
+				p3[k + 1] = b1i - i4;
+			}
+		}
+	}
+	// The last stage when the number of the remaining stages is odd
+	if( half < size ) {
+		const float* w = reinterpret_cast<const float*>( twiddles.data() + half );
+		float* a = d;
+		float* b = a + 2 * half;
+		for( int k = 0; k < 2 * half; k += 2 ) {
+			const float wr = w[k];
+			const float wi = sign * w[k + 1];
+			const float re = b[k] * wr - b[k + 1] * wi;
+			const float im = b[k] * wi + b[k + 1] * wr;
+			b[k] = a[k] - re;
+			b[k + 1] = a[k + 1] - im;
+			a[k] += re;
+			a[k + 1] += im;
+		}
+	}
+}
+
+CRealFft2D::CRealFft2D( int _width, int _height ) :
+	width( _width ),
+	height( _height ),
+	rowFft( _width / 2 ),
+	columnFft( _height )
+{
+	assert( CFft::IsPowerOfTwo( width ) && width >= 2 && CFft::IsPowerOfTwo( height ) );
+	rowTwiddles.resize( width / 2 + 1 );
+	for( int k = 0; k <= width / 2; k++ ) {
+		const double angle = -2 * M_PI * k / width;
+		rowTwiddles[k] = std::complex<float>( static_cast<float>( std::cos( angle ) ), static_cast<float>( std::sin( angle ) ) );
+	}
+	buffer.resize( std::max( width / 2, ColumnBlock * columnStride() ) );
+}
+
+void CRealFft2D::Forward( const float* image, std::complex<float>* spectrum ) const
+{
+	const int half = width / 2;
+	const int spectrumWidth = SpectrumWidth();
+	// Separate floats (mixing them with std::complex makes the compiler pass values through the stack)
+	const float* t = reinterpret_cast<const float*>( rowTwiddles.data() );
+	for( int y = 0; y < height; y++ ) {
+		// Even and odd pixels as the real and imaginary parts
+		std::copy( image + y * width, image + ( y + 1 ) * width, reinterpret_cast<float*>( buffer.data() ) );
+		rowFft.Forward( buffer.data() );
+		// Spectra of the even and odd pixels from the symmetries of the transforms of real sequences
+		const float* z = reinterpret_cast<const float*>( buffer.data() );
+		float* dst = reinterpret_cast<float*>( spectrum + y * spectrumWidth );
+		dst[0] = z[0] + z[1];
+		dst[1] = 0;
+		dst[2 * half] = z[0] - z[1];
+		dst[2 * half + 1] = 0;
+		for( int k = 1; k < half; k++ ) {
+			// z[k] and conj( z[half - k] )
+			const float zr = z[2 * k];
+			const float zi = z[2 * k + 1];
+			const float cr = z[2 * ( half - k )];
+			const float ci = -z[2 * ( half - k ) + 1];
+			const float er = 0.5f * ( zr + cr );
+			const float ei = 0.5f * ( zi + ci );
+			// ( z[k] - conj( z[half - k] ) ) / 2i
+			const float orr = 0.5f * ( zi - ci );
+			const float oi = -0.5f * ( zr - cr );
+			dst[2 * k] = er + orr * t[2 * k] - oi * t[2 * k + 1];
+			dst[2 * k + 1] = ei + orr * t[2 * k + 1] + oi * t[2 * k];
+		}
+	}
+	transformColumns( spectrum, false );
+}
+
+void CRealFft2D::Inverse( std::complex<float>* spectrum, float* image ) const
+{
+	transformColumns( spectrum, true );
+	const int half = width / 2;
+	const int spectrumWidth = SpectrumWidth();
+	const float scale = 1.0f / ( half * height );
+	const float* t = reinterpret_cast<const float*>( rowTwiddles.data() );
+	for( int y = 0; y < height; y++ ) {
+		const float* src = reinterpret_cast<const float*>( spectrum + y * spectrumWidth );
+		float* z = reinterpret_cast<float*>( buffer.data() );
+		for( int k = 0; k < half; k++ ) {
+			// x[k] and conj( x[half - k] )
+			const float xr = src[2 * k];
+			const float xi = src[2 * k + 1];
+			const float cr = src[2 * ( half - k )];
+			const float ci = -src[2 * ( half - k ) + 1];
+			const float er = 0.5f * ( xr + cr );
+			const float ei = 0.5f * ( xi + ci );
+			const float dr = 0.5f * ( xr - cr );
+			const float di = 0.5f * ( xi - ci );
+			// Odd part multiplied by the conjugate twiddle factor, then by i
+			const float orr = dr * t[2 * k] + di * t[2 * k + 1];
+			const float oi = di * t[2 * k] - dr * t[2 * k + 1];
+			z[2 * k] = er - oi;
+			z[2 * k + 1] = ei + orr;
+		}
+		rowFft.Inverse( buffer.data() );
+		float* dst = image + y * width;
+		for( int n = 0; n < width; n++ ) {
+			dst[n] = scale * z[n];
+		}
+	}
+}
+
+void CRealFft2D::transformColumns( std::complex<float>* spectrum, bool inverse ) const
+{
+	// Blocks of columns are copied to the buffer, so the rows of the spectrum are read and written sequentially
+	const int spectrumWidth = SpectrumWidth();
+	const int stride = columnStride();
+	for( int x0 = 0; x0 < spectrumWidth; x0 += ColumnBlock ) {
+		const int count = std::min( ColumnBlock, spectrumWidth - x0 );
+		std::complex<float>* columns = buffer.data();
+		for( int y = 0; y < height; y++ ) {
+			const std::complex<float>* src = spectrum + y * spectrumWidth + x0;
+			for( int c = 0; c < count; c++ ) {
+				columns[c * stride + y] = src[c];
+			}
+		}
+		for( int c = 0; c < count; c++ ) {
+			if( inverse ) {
+				columnFft.Inverse( columns + c * stride );
+			} else {
+				columnFft.Forward( columns + c * stride );
+			}
+		}
+		for( int y = 0; y < height; y++ ) {
+			std::complex<float>* dst = spectrum + y * spectrumWidth + x0;
+			for( int c = 0; c < count; c++ ) {
+				dst[c] = columns[c * stride + y];
+			}
+		}
+	}
+}
@@ -0,0 +1,62 @@
+﻿// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <complex>
+#include <vector>
+
+// Complex FFT of a power of two size. Twiddle factors and the bit reversal permutation are computed once by the
+// constructor (the plan), so one object serves any number of transforms of its size
+class CFft {
+public:
+	explicit CFft( int size );
+
+	int Size() const { return size; }
+
+	// In place, not normalized
+	void Forward( std::complex<float>* data ) const { transform( data, false ); }
+	void Inverse( std::complex<float>* data ) const { transform( data, true ); }
+
+	static bool IsPowerOfTwo( int value ) { return value > 0 && ( value & ( value - 1 ) ) == 0; }
+
+private:
+	int size;
+	// exp( -pi * i * k / half ) for k < half of each stage
+	std::vector<std::complex<float>> twiddles;
+	// Pairs of indices swapped by the bit reversal
+	std::vector<std::pair<int, int>> swaps;
+
+	void transform( std::complex<float>* data, bool inverse ) const;
+};
+
+// FFT of a real image of power of two width and height (as a complex FFT of half the width for the rows).
+// The spectrum keeps the width / 2 + 1 non-redundant columns of each row. Transforms use a buffer of the object,
+// so one object must not be used by several threads at once
+class CRealFft2D {
+public:
+	CRealFft2D( int width, int height );
+
+	int Width() const { return width; }
+	int Height() const { return height; }
+	int SpectrumWidth() const { return width / 2 + 1; }
+
+	void Forward( const float* image, std::complex<float>* spectrum ) const;
+	// Overwrites the spectrum. Normalized, so the inverse of the forward transform gives the image back
+	void Inverse( std::complex<float>* spectrum, float* image ) const;
+
+private:
+	int width;
+	int height;
+	CFft rowFft;
+	CFft columnFft;
+	// exp( -2 * pi * i * k / width ) for k <= width / 2, combine the half width transform of a row into its spectrum
+	std::vector<std::complex<float>> rowTwiddles;
+	mutable std::vector<std::complex<float>> buffer;
+
+	// Columns transformed together
+	static const int ColumnBlock = 16;
+	// Padded, so that the columns of a block do not fall into the same cache sets
+	int columnStride() const { return height + 8; }
+	void transformColumns( std::complex<float>* spectrum, bool inverse ) const;
+};
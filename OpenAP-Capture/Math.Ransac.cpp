@@ -0,0 +1,384 @@
+﻿// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include <Math.Ransac.h>
+#include <Math.LinearAlgebra.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <random>
+
+void CPlaneTransform::Apply( double x, double y, double& x1, double& y1 ) const
+{
+	const double w = H[2][0] * x + H[2][1] * y + H[2][2];
+	x1 = ( H[0][0] * x + H[0][1] * y + H[0][2] ) / w;
+	y1 = ( H[1][0] * x + H[1][1] * y + H[1][2] ) / w;
+}
+
+void CPlaneTransform::GetAffine( CMatrix<double>& Ax, CMatrix<double>& Ay ) const
+{
+	Ax.SetSize( 3, 1 );
+	Ay.SetSize( 3, 1 );
+	for( int i = 0; i < 3; i++ ) {
+		Ax[i][0] = H[0][i] / H[2][2];
+		Ay[i][0] = H[1][i] / H[2][2];
+	}
+}
+
+int CRansac::MinimalSampleSize( TTransformModel model )
+{
+	switch( model ) {
+		case TM_Translation: return 1;
+		case TM_Similarity: return 2;
+		case TM_Affine: return 3;
+		case TM_Homography: return 4;
+	}
+	assert( false );
+	return 0;
+}
+
+struct CPointPairs {
+	const double* X1;
+	const double* Y1;
+	const double* X2;
+	const double* Y2;
+	int Count;
+};
+
+// Least squares transforms for the selected pairs (exact for minimal samples). Return false for degenerate samples
+static bool fitTranslation( CPlaneTransform& t, const CPointPairs& p, const int* indices, int count )
+{
+	double dx = 0;
+	double dy = 0;
+	for( int i = 0; i < count; i++ ) {
+		dx += p.X2[indices[i]] - p.X1[indices[i]];
+		dy += p.Y2[indices[i]] - p.Y1[indices[i]];
+	}
+	t.H[0][2] = dx / count;
+	t.H[1][2] = dy / count;
+	return true;
+}
+
+static void centroids( double* c, const CPointPairs& p, const int* indices, int count )
+{
+	c[0] = c[1] = c[2] = c[3] = 0;
+	for( int i = 0; i < count; i++ ) {
+		c[0] += p.X1[indices[i]];
+		c[1] += p.Y1[indices[i]];
+		c[2] += p.X2[indices[i]];
+		c[3] += p.Y2[indices[i]];
+	}
+	for( int i = 0; i < 4; i++ ) {
+		c[i] /= count;
+	}
+}
+
+static bool fitSimilarity( CPlaneTransform& t, const CPointPairs& p, const int* indices, int count )
+{
+	double c[4];
+	centroids( c, p, indices, count );
+	double sumDot = 0;
+	double sumCross = 0;
+	double sumNorm = 0;
+	for( int i = 0; i < count; i++ ) {
+		const double dx1 = p.X1[indices[i]] - c[0];
+		const double dy1 = p.Y1[indices[i]] - c[1];
+		const double dx2 = p.X2[indices[i]] - c[2];
+		const double dy2 = p.Y2[indices[i]] - c[3];
+		sumDot += dx1 * dx2 + dy1 * dy2;
+		sumCross += dx1 * dy2 - dy1 * dx2;
+		sumNorm += dx1 * dx1 + dy1 * dy1;
+	}
+	// Coinciding points do not define the rotation
+	if( sumNorm < 1e-6 ) {
+		return false;
+	}
+	const double a = sumDot / sumNorm;
+	const double b = sumCross / sumNorm;
+	t.H[0][0] = a;
+	t.H[0][1] = -b;
+	t.H[0][2] = c[2] - ( a * c[0] - b * c[1] );
+	t.H[1][0] = b;
+	t.H[1][1] = a;
+	t.H[1][2] = c[3] - ( b * c[0] + a * c[1] );
+	return true;
+}
+
+static bool fitAffine( CPlaneTransform& t, const CPointPairs& p, const int* indices, int count )
+{
+	// Normal equations in coordinates relative to the centroids
+	double c[4];
+	centroids( c, p, indices, count );
+	double sxx = 0;
+	double sxy = 0;
+	double syy = 0;
+	double sxu = 0;
+	double syu = 0;
+	double sxv = 0;
+	double syv = 0;
+	for( int i = 0; i < count; i++ ) {
+		const double dx1 = p.X1[indices[i]] - c[0];
+		const double dy1 = p.Y1[indices[i]] - c[1];
+		const double dx2 = p.X2[indices[i]] - c[2];
+		const double dy2 = p.Y2[indices[i]] - c[3];
+		sxx += dx1 * dx1;
+		sxy += dx1 * dy1;
+		syy += dy1 * dy1;
+		sxu += dx1 * dx2;
+		syu += dy1 * dx2;
+		sxv += dx1 * dy2;
+		syv += dy1 * dy2;
+	}
+	// Collinear points do not define the transform
+	if( sxx * syy - sxy * sxy < 1e-9 * ( sxx + syy ) * ( sxx + syy ) ) {
+		return false;
+	}
+	double a[2];
+	double b[2];
+	if( not SolveSystemOfTwoLinearEquations( a, sxx, sxy, -sxu, sxy, syy, -syu ) ||
+		not SolveSystemOfTwoLinearEquations( b, sxx, sxy, -sxv, sxy, syy, -syv ) )
+	{
+		return false;
+	}
+	t.H[0][0] = a[0];
+	t.H[0][1] = a[1];
+	t.H[0][2] = c[2] - ( a[0] * c[0] + a[1] * c[1] );
+	t.H[1][0] = b[0];
+	t.H[1][1] = b[1];
+	t.H[1][2] = c[3] - ( b[0] * c[0] + b[1] * c[1] );
+	return true;
+}
+
+// Shift to the centroid and scale to the average distance of sqrt( 2 ) from it (keeps the linear system well conditioned)
+static void normalization( double* n, const double* x, const double* y, const int* indices, int count )
+{
+	double cx = 0;
+	double cy = 0;
+	for( int i = 0; i < count; i++ ) {
+		cx += x[indices[i]];
+		cy += y[indices[i]];
+	}
+	cx /= count;
+	cy /= count;
+	double distance = 0;
+	for( int i = 0; i < count; i++ ) {
+		distance += std::hypot( x[indices[i]] - cx, y[indices[i]] - cy );
+	}
+	distance /= count;
+	n[0] = distance > 0 ? std::sqrt( 2.0 ) / distance : 1;
+	n[1] = cx;
+	n[2] = cy;
+}
+
+static bool hasCollinearTriple( const double* x, const double* y, const double* n )
+{
+	for( int i = 0; i < 4; i++ ) {
+		const int a = ( i + 1 ) % 4;
+		const int b = ( i + 2 ) % 4;
+		const int c = ( i + 3 ) % 4;
+		const double cross = ( x[b] - x[a] ) * ( y[c] - y[a] ) - ( y[b] - y[a] ) * ( x[c] - x[a] );
+		if( std::abs( cross ) * n[0] * n[0] < 1e-3 ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool fitHomography( CPlaneTransform& t, const CPointPairs& p, const int* indices, int count )
+{
+	double n1[3];
+	double n2[3];
+	normalization( n1, p.X1, p.Y1, indices, count );
+	normalization( n2, p.X2, p.Y2, indices, count );
+	if( count == 4 ) {
+		double x1[4], y1[4], x2[4], y2[4];
+		for( int i = 0; i < 4; i++ ) {
+			x1[i] = p.X1[indices[i]];
+			y1[i] = p.Y1[indices[i]];
+			x2[i] = p.X2[indices[i]];
+			y2[i] = p.Y2[indices[i]];
+		}
+		if( hasCollinearTriple( x1, y1, n1 ) || hasCollinearTriple( x2, y2, n2 ) ) {
+			return false;
+		}
+	}
+
+	// Two equations for each pair with H[2][2] = 1:
+	// h00 * x + h01 * y + h02 - h20 * x * u - h21 * y * u = u and the same for v with the second row
+	CMatrix<double> M( 2 * count, 8 );
+	CMatrix<double> Y( 2 * count, 1 );
+	for( int i = 0; i < count; i++ ) {
+		const double x = ( p.X1[indices[i]] - n1[1] ) * n1[0];
+		const double y = ( p.Y1[indices[i]] - n1[2] ) * n1[0];
+		const double u = ( p.X2[indices[i]] - n2[1] ) * n2[0];
+		const double v = ( p.Y2[indices[i]] - n2[2] ) * n2[0];
+		double* row = M[2 * i];
+		row[0] = x; row[1] = y; row[2] = 1; row[3] = 0; row[4] = 0; row[5] = 0; row[6] = -x * u; row[7] = -y * u;
+		row = M[2 * i + 1];
+		row[0] = 0; row[1] = 0; row[2] = 0; row[3] = x; row[4] = y; row[5] = 1; row[6] = -x * v; row[7] = -y * v;
+		Y[2 * i][0] = u;
+		Y[2 * i + 1][0] = v;
+	}
+	CMatrix<double> h;
+	if( not ( count == 4 ? SolveSystemOfLinearEquations( h, M, Y ) : SolveLeastSquares( h, M, Y ) ) ) {
+		return false;
+	}
+
+	// H = N2^-1 * Hn * N1 with N = [ s 0 -s*cx; 0 s -s*cy; 0 0 1 ]
+	const double hn[3][3] = { { h[0][0], h[1][0], h[2][0] }, { h[3][0], h[4][0], h[5][0] }, { h[6][0], h[7][0], 1 } };
+	const double N1[3][3] = { { n1[0], 0, -n1[0] * n1[1] }, { 0, n1[0], -n1[0] * n1[2] }, { 0, 0, 1 } };
+	const double invN2[3][3] = { { 1 / n2[0], 0, n2[1] }, { 0, 1 / n2[0], n2[2] }, { 0, 0, 1 } };
+	double hN1[3][3];
+	for( int i = 0; i < 3; i++ ) {
+		for( int j = 0; j < 3; j++ ) {
+			hN1[i][j] = hn[i][0] * N1[0][j] + hn[i][1] * N1[1][j] + hn[i][2] * N1[2][j];
+		}
+	}
+	for( int i = 0; i < 3; i++ ) {
+		for( int j = 0; j < 3; j++ ) {
+			t.H[i][j] = invN2[i][0] * hN1[0][j] + invN2[i][1] * hN1[1][j] + invN2[i][2] * hN1[2][j];
+		}
+	}
+	if( std::abs( t.H[2][2] ) < std::numeric_limits<double>::epsilon() ) {
+		return false;
+	}
+	for( int i = 0; i < 3; i++ ) {
+		for( int j = 0; j < 3; j++ ) {
+			t.H[i][j] /= t.H[2][2];
+		}
+	}
+	return true;
+}
+
+static bool fit( CPlaneTransform& t, TTransformModel model, const CPointPairs& p, const int* indices, int count )
+{
+	t = CPlaneTransform();
+	t.Model = model;
+	switch( model ) {
+		case TM_Translation: return fitTranslation( t, p, indices, count );
+		case TM_Similarity: return fitSimilarity( t, p, indices, count );
+		case TM_Affine: return fitAffine( t, p, indices, count );
+		case TM_Homography: return fitHomography( t, p, indices, count );
+	}
+	return false;
+}
+
+// Sum of squared residuals truncated at the threshold (MSAC), lower is better
+static double score( const CPlaneTransform& t, const CPointPairs& p, double thresholdSq, std::vector<int>& inliers )
+{
+	inliers.clear();
+	double cost = 0;
+	for( int i = 0; i < p.Count; i++ ) {
+		const double w = t.H[2][0] * p.X1[i] + t.H[2][1] * p.Y1[i] + t.H[2][2];
+		double residualSq = thresholdSq;
+		// Points mapped through the infinity are outliers
+		if( w > 0 ) {
+			const double dx = ( t.H[0][0] * p.X1[i] + t.H[0][1] * p.Y1[i] + t.H[0][2] ) / w - p.X2[i];
+			const double dy = ( t.H[1][0] * p.X1[i] + t.H[1][1] * p.Y1[i] + t.H[1][2] ) / w - p.Y2[i];
+			residualSq = dx * dx + dy * dy;
+		}
+		if( residualSq < thresholdSq ) {
+			inliers.push_back( i );
+			cost += residualSq;
+		} else {
+			cost += thresholdSq;
+		}
+	}
+	return cost;
+}
+
+// Samples needed to draw an all-inlier sample with the confidence
+static int requiredIterations( int inliers, int count, int sampleSize, double confidence, int maxIterations )
+{
+	const double allInliers = std::pow( static_cast<double>( inliers ) / count, sampleSize );
+	if( allInliers >= 1 ) {
+		return 0;
+	}
+	if( allInliers <= 0 ) {
+		return maxIterations;
+	}
+	const double iterations = std::ceil( std::log( 1 - confidence ) / std::log( 1 - allInliers ) );
+	return iterations < maxIterations ? static_cast<int>( iterations ) : maxIterations;
+}
+
+CRansacResult CRansac::Estimate( const std::vector<double>& x1, const std::vector<double>& y1,
+	const std::vector<double>& x2, const std::vector<double>& y2 ) const
+{
+	assert( x1.size() == y1.size() && x1.size() == x2.size() && x1.size() == y2.size() );
+	CRansacResult result;
+	const CPointPairs pairs = { x1.data(), y1.data(), x2.data(), y2.data(), static_cast<int>( x1.size() ) };
+	const int sampleSize = MinimalSampleSize( model );
+	if( pairs.Count <= sampleSize ) {
+		return result;
+	}
+	const double thresholdSq = threshold * threshold;
+
+	std::mt19937 random( seed );
+	std::uniform_int_distribution<int> anyPair( 0, pairs.Count - 1 );
+	int sample[4];
+	CPlaneTransform hypothesis;
+	CPlaneTransform refined;
+	std::vector<int> inliers;
+	std::vector<int> refinedInliers;
+	double bestCost = std::numeric_limits<double>::max();
+	int iterations = maxIterations;
+	int iteration = 0;
+	for( ; iteration < iterations; iteration++ ) {
+		for( int i = 0; i < sampleSize; i++ ) {
+			do {
+				sample[i] = anyPair( random );
+			} while( std::find( sample, sample + i, sample[i] ) != sample + i );
+		}
+		if( not fit( hypothesis, model, pairs, sample, sampleSize ) ) {
+			continue;
+		}
+		double cost = score( hypothesis, pairs, thresholdSq, inliers );
+		if( cost >= bestCost ) {
+			continue;
+		}
+		// Local optimization: least squares on the inliers while it lowers the cost
+		for( int i = 0; i < LocalIterations && static_cast<int>( inliers.size() ) > sampleSize; i++ ) {
+			if( not fit( refined, model, pairs, inliers.data(), static_cast<int>( inliers.size() ) ) ) {
+				break;
+			}
+			const double refinedCost = score( refined, pairs, thresholdSq, refinedInliers );
+			if( refinedCost >= cost ) {
+				break;
+			}
+			hypothesis = refined;
+			cost = refinedCost;
+			inliers.swap( refinedInliers );
+		}
+		bestCost = cost;
+		result.Transform = hypothesis;
+		result.Inliers = inliers;
+		iterations = requiredIterations( static_cast<int>( inliers.size() ), pairs.Count, sampleSize, confidence, maxIterations );
+	}
+	result.Iterations = iteration;
+
+	// Final least squares on all inliers
+	if( static_cast<int>( result.Inliers.size() ) > sampleSize &&
+		fit( refined, model, pairs, result.Inliers.data(), static_cast<int>( result.Inliers.size() ) ) &&
+		score( refined, pairs, thresholdSq, refinedInliers ) <= bestCost )
+	{
+		result.Transform = refined;
+		result.Inliers.swap( refinedInliers );
+	}
+	if( static_cast<int>( result.Inliers.size() ) <= sampleSize ) {
+		result.Inliers.clear();
+		return result;
+	}
+
+	double sumSq = 0;
+	for( int i : result.Inliers ) {
+		double x;
+		double y;
+		result.Transform.Apply( x1[i], y1[i], x, y );
+		sumSq += ( x - x2[i] ) * ( x - x2[i] ) + ( y - y2[i] ) * ( y - y2[i] );
+	}
+	result.Rms = std::sqrt( sumSq / result.Inliers.size() );
+	result.IsValid = true;
+	return result;
+}
@@ -0,0 +1,71 @@
+﻿// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <Math.Matrix.h>
+
+#include <vector>
+
+enum TTransformModel {
+	TM_Translation, // Shift only
+	TM_Similarity, // Rotation, uniform scale and shift
+	TM_Affine,
+	TM_Homography
+};
+
+// Transform of the plane as a 3x3 matrix of homogeneous coordinates. The last row is ( 0, 0, 1 ) for all models
+// except homographies
+struct CPlaneTransform {
+	TTransformModel Model = TM_Translation;
+	double H[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+
+	void Apply( double x, double y, double& x1, double& y1 ) const;
+	// The first two rows as the 3x1 columns of LeastSquaresAffineTransform
+	void GetAffine( CMatrix<double>& Ax, CMatrix<double>& Ay ) const;
+};
+
+struct CRansacResult {
+	bool IsValid = false;
+	CPlaneTransform Transform;
+	// Indices of the pairs within the threshold of the transform, ascending
+	std::vector<int> Inliers;
+	// Residual of the inliers
+	double Rms = 0;
+	// Samples drawn
+	int Iterations = 0;
+};
+
+// Robust estimation of the transform from the first points of the pairs to the second ones (LO-RANSAC).
+// Random minimal samples give hypotheses scored by the truncated squared residuals of all pairs (MSAC). Each new best
+// hypothesis is refined by least squares on its inliers, and sampling stops as soon as the chance of missing a better
+// sample drops below 1 - confidence. The result is refined by least squares on all of its inliers
+class CRansac {
+public:
+	// Pixels
+	static constexpr double DefaultThreshold = 2;
+	static constexpr double DefaultConfidence = 0.999;
+	static const int DefaultMaxIterations = 2000;
+	// Least squares steps of the local optimization
+	static const int LocalIterations = 4;
+
+	CRansac( TTransformModel _model, double _threshold = DefaultThreshold ) : model( _model ), threshold( _threshold ) {}
+
+	void SetConfidence( double value ) { confidence = value; }
+	void SetMaxIterations( int value ) { maxIterations = value; }
+	// Samples are pseudo-random, the same seed gives the same result
+	void SetSeed( unsigned int value ) { seed = value; }
+
+	// Pairs defining a transform of the model
+	static int MinimalSampleSize( TTransformModel );
+
+	CRansacResult Estimate( const std::vector<double>& x1, const std::vector<double>& y1,
+		const std::vector<double>& x2, const std::vector<double>& y2 ) const;
+
+private:
+	const TTransformModel model;
+	const double threshold;
+	double confidence = DefaultConfidence;
+	int maxIterations = DefaultMaxIterations;
+	unsigned int seed = 0;
+};
@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-QT += core gui serialport
+QT += core gui serialport network concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -22,23 +22,38 @@ SOURCES += \
         Hardware.Focuser.cpp \
         Hardware.Focuser.DIYFocuser.cpp \
         Hardware.Focuser.ZWO.EAFocuser.cpp \
+        Image.BadPixels.cpp \
+        Image.Background.cpp \
+        Image.Debayer.Binned.cpp \
         Image.Debayer.CFA.cpp \
         Image.Debayer.HalfRes.cpp \
         Image.Debayer.HQLinear.cpp \
         Image.Formats.cpp \
+        Image.Labeling.cpp \
 		Image.Image.cpp \
         Image.Math.cpp \
 		Image.Math.Advanced.cpp \
+        Image.PhaseCorrelation.cpp \
+        Image.PsfFitting.cpp \
+        Image.RadialProfile.cpp \
+        Image.StarMatcher.cpp \
         Image.RawImage.cpp \
 		Image.Stack.cpp \
+        Image.Warp.cpp \
         ImageView.cpp \
+        Math.Fft.cpp \
         Math.Geometry.cpp \
         Math.LinearAlgebra.cpp \
+        Math.Ransac.cpp \
         Main.cpp \
         MainFrame.cpp \
         MainFrame.Tools.cpp \
         PaintView.cpp \
+        Preview.Client.cpp \
+        Preview.Protocol.cpp \
+        Preview.Server.cpp \
         Renderer.cpp \
+        Renderer.TileCache.cpp \
 
 HEADERS += \
         Hardware.Camera.h \
@@ -49,25 +64,40 @@ HEADERS += \
         Hardware.Focuser.h \
         Hardware.Focuser.DIYFocuser.h \
         Hardware.Focuser.ZWO.EAFocuser.h \
+        Image.BadPixels.h \
+        Image.Background.h \
         Image.Debayer.h \
+        Image.Debayer.Binned.h \
         Image.Debayer.CFA.h \
         Image.Debayer.HalfRes.h \
         Image.Debayer.HQLinear.h \
         Image.Formats.h \
+        Image.Labeling.h \
 		Image.Image.h \
         Image.Math.h \
 		Image.Math.Advanced.h \
+        Image.PhaseCorrelation.h \
+        Image.PsfFitting.h \
+        Image.RadialProfile.h \
+        Image.StarMatcher.h \
         Image.RawImage.h \
 		Image.Stack.h \
+        Image.Warp.h \
         Image.Qt.h \
         ImageView.h \
+        Math.Fft.h \
         Math.Geometry.h \
         Math.LinearAlgebra.h \
+        Math.Ransac.h \
         Math.Matrix.h \
         MainFrame.h \
         MainFrame.Tools.h \
         PaintView.h \
-        Renderer.h
+        Preview.Client.h \
+        Preview.Protocol.h \
+        Preview.Server.h \
+        Renderer.h \
+        Renderer.TileCache.h
 
 FORMS += \
         MainFrame.ui
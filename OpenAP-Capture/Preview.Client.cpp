@@ -0,0 +1,39 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Preview.Client.h"
+
+CPreviewClient::CPreviewClient( QObject* parent ) :
+    QObject( parent )
+{
+    connect( &socket, &QTcpSocket::readyRead, this, &CPreviewClient::readyRead );
+    connect( &socket, &QTcpSocket::connected, this, &CPreviewClient::connected );
+    connect( &socket, &QTcpSocket::disconnected, this, &CPreviewClient::disconnected );
+}
+
+void CPreviewClient::ConnectToServer( const QString& host, quint16 port )
+{
+    decoder = CPreviewDecoder();
+    socket.connectToHost( host, port );
+}
+
+void CPreviewClient::readyRead()
+{
+    QByteArray data = socket.readAll();
+    bytesReceived += data.size();
+
+    int histograms = decoder.ReceivedHistograms();
+    int frames = decoder.Append( data );
+    if( not decoder.IsValid() ) {
+        socket.disconnectFromHost();
+        emit streamError();
+        return;
+    }
+    if( decoder.ReceivedHistograms() != histograms ) {
+        emit histogramReceived();
+    }
+    // Intermediate frames (if several arrived at once) are not interesting
+    if( frames > 0 ) {
+        emit frameReceived( decoder.FrameId() );
+    }
+}
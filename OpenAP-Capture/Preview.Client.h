@@ -0,0 +1,43 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <QObject>
+#include <QTcpSocket>
+
+#include "Preview.Protocol.h"
+
+// Receives the preview stream of CPreviewServer (OpenAP-Viewer or a loopback check of the server)
+class CPreviewClient : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CPreviewClient( QObject* parent = nullptr );
+
+    // The stream starts over (the server sends whole frames to new connections)
+    void ConnectToServer( const QString& host, quint16 port );
+    void Disconnect() { socket.disconnectFromHost(); }
+    bool IsConnected() const { return socket.state() == QAbstractSocket::ConnectedState; }
+    // Neither connected nor connecting
+    bool IsIdle() const { return socket.state() == QAbstractSocket::UnconnectedState; }
+
+    const QImage& Image() const { return decoder.Image(); }
+    const QImage& Histogram() const { return decoder.Histogram(); }
+    const CPreviewDecoder& Decoder() const { return decoder; }
+    qint64 BytesReceived() const { return bytesReceived; }
+
+signals:
+    void frameReceived( quint32 frameId );
+    void histogramReceived();
+    void streamError();
+    void connected();
+    void disconnected();
+
+private:
+    QTcpSocket socket;
+    CPreviewDecoder decoder;
+    qint64 bytesReceived = 0;
+
+    void readyRead();
+};
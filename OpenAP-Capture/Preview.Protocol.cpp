@@ -0,0 +1,250 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Preview.Protocol.h"
+
+#include <QBuffer>
+#include <QDataStream>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+static void appendMessage( QByteArray& stream, quint8 type, const QByteArray& payload )
+{
+    QDataStream out( &stream, QIODevice::WriteOnly | QIODevice::Append );
+    out.setByteOrder( QDataStream::LittleEndian );
+    out << PreviewMagic << type << quint32( payload.size() );
+    out.writeRawData( payload.constData(), payload.size() );
+}
+
+CPreviewEncoder::CPreviewEncoder( TTileEncoding _encoding, int _jpegQuality, int _changeThreshold ) :
+    encoding( _encoding ), jpegQuality( _jpegQuality ), changeThreshold( _changeThreshold )
+{
+}
+
+QByteArray CPreviewEncoder::EncodeFrame( const QImage& _frame, QImage& reference, quint32 frameId ) const
+{
+    const QImage frame = _frame.format() == QImage::Format_RGB888 ? _frame : _frame.convertToFormat( QImage::Format_RGB888 );
+    const int width = frame.width();
+    const int height = frame.height();
+    if( reference.width() != width || reference.height() != height || reference.format() != QImage::Format_RGB888 ) {
+        // The client starts the new size from a black image
+        reference = QImage( width, height, QImage::Format_RGB888 );
+        reference.fill( Qt::black );
+    }
+
+    QByteArray stream;
+    {
+        QByteArray payload;
+        QDataStream out( &payload, QIODevice::WriteOnly );
+        out.setByteOrder( QDataStream::LittleEndian );
+        out << frameId << quint32( width ) << quint32( height );
+        appendMessage( stream, PM_FrameBegin, payload );
+    }
+    for( int y = 0; y < height; y += PreviewTileSize ) {
+        const int h = std::min( PreviewTileSize, height - y );
+        for( int x = 0; x < width; x += PreviewTileSize ) {
+            const int w = std::min( PreviewTileSize, width - x );
+            if( not isChanged( frame, reference, x, y, w, h ) ) {
+                continue;
+            }
+            QByteArray payload;
+            QDataStream out( &payload, QIODevice::WriteOnly );
+            out.setByteOrder( QDataStream::LittleEndian );
+            out << quint16( x ) << quint16( y ) << quint16( w ) << quint16( h ) << quint8( encoding );
+            QByteArray data = encodeTile( frame, reference, x, y, w, h );
+            out.writeRawData( data.constData(), data.size() );
+            appendMessage( stream, PM_Tile, payload );
+
+            // The client now has this tile. For JPEG it is an approximation, but the tile is replaced entirely next time
+            for( int i = 0; i < h; i++ ) {
+                std::memcpy( reference.scanLine( y + i ) + 3 * x, frame.constScanLine( y + i ) + 3 * x, 3 * w );
+            }
+        }
+    }
+    {
+        QByteArray payload;
+        QDataStream out( &payload, QIODevice::WriteOnly );
+        out.setByteOrder( QDataStream::LittleEndian );
+        out << frameId;
+        appendMessage( stream, PM_FrameEnd, payload );
+    }
+    return stream;
+}
+
+QByteArray CPreviewEncoder::EncodeHistogram( const QImage& histogram )
+{
+    QByteArray data;
+    QBuffer buffer( &data );
+    buffer.open( QIODevice::WriteOnly );
+    histogram.save( &buffer, "PNG" );
+
+    QByteArray stream;
+    appendMessage( stream, PM_Histogram, data );
+    return stream;
+}
+
+bool CPreviewEncoder::isChanged( const QImage& frame, const QImage& reference, int x, int y, int w, int h ) const
+{
+    for( int i = 0; i < h; i++ ) {
+        const uchar* p = frame.constScanLine( y + i ) + 3 * x;
+        const uchar* r = reference.constScanLine( y + i ) + 3 * x;
+        if( changeThreshold == 0 ) {
+            if( std::memcmp( p, r, 3 * w ) != 0 ) {
+                return true;
+            }
+            continue;
+        }
+        int maxDiff = 0;
+        for( int j = 0; j < 3 * w; j++ ) {
+            maxDiff = std::max( maxDiff, std::abs( p[j] - r[j] ) );
+        }
+        if( maxDiff > changeThreshold ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QByteArray CPreviewEncoder::encodeTile( const QImage& frame, const QImage& reference, int x, int y, int w, int h ) const
+{
+    if( encoding == TE_Jpeg ) {
+        QByteArray data;
+        QBuffer buffer( &data );
+        buffer.open( QIODevice::WriteOnly );
+        frame.copy( x, y, w, h ).save( &buffer, "JPG", jpegQuality );
+        return data;
+    }
+
+    assert( encoding == TE_Delta );
+    // Mostly zeros for slowly changing parts of the frame, compresses well
+    QByteArray delta( 3 * w * h, 0 );
+    uchar* d = reinterpret_cast<uchar*>( delta.data() );
+    for( int i = 0; i < h; i++ ) {
+        const uchar* p = frame.constScanLine( y + i ) + 3 * x;
+        const uchar* r = reference.constScanLine( y + i ) + 3 * x;
+        for( int j = 0; j < 3 * w; j++ ) {
+            *d++ = uchar( p[j] - r[j] );
+        }
+    }
+    return qCompress( delta, 1 );
+}
+
+int CPreviewDecoder::Append( const QByteArray& data )
+{
+    int completedFrames = 0;
+    if( not isValid ) {
+        return completedFrames;
+    }
+    buffer.append( data );
+
+    int pos = 0;
+    while( buffer.size() - pos >= PreviewHeaderSize ) {
+        QDataStream in( buffer.mid( pos, PreviewHeaderSize ) );
+        in.setByteOrder( QDataStream::LittleEndian );
+        quint32 magic;
+        quint8 type;
+        quint32 size;
+        in >> magic >> type >> size;
+        if( magic != PreviewMagic || size > PreviewMaxPayloadSize ) {
+            isValid = false;
+            break;
+        }
+        if( buffer.size() - pos - PreviewHeaderSize < int( size ) ) {
+            break;
+        }
+        if( not process( type, buffer.mid( pos + PreviewHeaderSize, size ), completedFrames ) ) {
+            isValid = false;
+            break;
+        }
+        pos += PreviewHeaderSize + size;
+    }
+    buffer.remove( 0, pos );
+    return completedFrames;
+}
+
+bool CPreviewDecoder::process( quint8 type, const QByteArray& payload, int& completedFrames )
+{
+    QDataStream in( payload );
+    in.setByteOrder( QDataStream::LittleEndian );
+    switch( type ) {
+        case PM_FrameBegin:
+        {
+            quint32 id, width, height;
+            in >> id >> width >> height;
+            if( in.status() != QDataStream::Ok ) {
+                return false;
+            }
+            if( width == 0 || height == 0 || width > PreviewMaxFrameSize || height > PreviewMaxFrameSize ) {
+                return false;
+            }
+            if( current.width() != int( width ) || current.height() != int( height ) ) {
+                current = QImage( width, height, QImage::Format_RGB888 );
+                if( current.isNull() ) {
+                    // Out of memory
+                    return false;
+                }
+                current.fill( Qt::black );
+            }
+            return true;
+        }
+        case PM_Tile:
+            receivedTiles++;
+            return applyTile( payload );
+        case PM_FrameEnd:
+            in >> frameId;
+            // Deep copy, the next frame is applied to the current one
+            image = current.copy();
+            completedFrames++;
+            return in.status() == QDataStream::Ok;
+        case PM_Histogram:
+            histogram = QImage::fromData( payload, "PNG" );
+            receivedHistograms++;
+            return true;
+        default:
+            // Unknown messages are skipped for compatibility with newer servers
+            return true;
+    }
+}
+
+bool CPreviewDecoder::applyTile( const QByteArray& payload )
+{
+    const int tileHeaderSize = 9;
+    QDataStream in( payload );
+    in.setByteOrder( QDataStream::LittleEndian );
+    quint16 x, y, w, h;
+    quint8 encoding;
+    in >> x >> y >> w >> h >> encoding;
+    if( in.status() != QDataStream::Ok || x + w > current.width() || y + h > current.height() ) {
+        return false;
+    }
+    const QByteArray data = QByteArray::fromRawData( payload.constData() + tileHeaderSize, payload.size() - tileHeaderSize );
+
+    if( encoding == TE_Jpeg ) {
+        QImage tile = QImage::fromData( data, "JPG" );
+        if( tile.width() != w || tile.height() != h ) {
+            return false;
+        }
+        tile = tile.convertToFormat( QImage::Format_RGB888 );
+        for( int i = 0; i < h; i++ ) {
+            std::memcpy( current.scanLine( y + i ) + 3 * x, tile.constScanLine( i ), 3 * w );
+        }
+        return true;
+    } else if( encoding == TE_Delta ) {
+        const QByteArray delta = qUncompress( data );
+        if( delta.size() != 3 * w * h ) {
+            return false;
+        }
+        const uchar* d = reinterpret_cast<const uchar*>( delta.constData() );
+        for( int i = 0; i < h; i++ ) {
+            uchar* p = current.scanLine( y + i ) + 3 * x;
+            for( int j = 0; j < 3 * w; j++ ) {
+                p[j] = uchar( p[j] + *d++ );
+            }
+        }
+        return true;
+    }
+    return false;
+}
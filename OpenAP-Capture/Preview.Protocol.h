@@ -0,0 +1,82 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <QByteArray>
+#include <QImage>
+
+// Preview stream is a sequence of messages. Each message is a header (magic, type, payload size) followed
+// by the payload. All numbers are little-endian. A frame is sent as FrameBegin, tiles that changed since
+// the previous frame sent to the client, FrameEnd
+enum TPreviewMessage : quint8 {
+    PM_FrameBegin = 1, // Frame id, width, height
+    PM_Tile = 2, // x, y, width, height, encoding, encoded pixels
+    PM_FrameEnd = 3, // Frame id
+    PM_Histogram = 4 // PNG
+};
+
+enum TTileEncoding : quint8 {
+    TE_Jpeg = 1, // Replaces the tile
+    TE_Delta = 2 // Lossless, zlib-compressed bytewise difference to the tile of the previous frame
+};
+
+const quint32 PreviewMagic = 0x5650414F; // "OAPV"
+const int PreviewHeaderSize = 9;
+const int PreviewTileSize = 64;
+// Protects the client from allocating garbage sizes on a broken stream
+const quint32 PreviewMaxPayloadSize = 64 * 1024 * 1024;
+// The same for the size of the frame (the server downscales frames long before this)
+const quint32 PreviewMaxFrameSize = 16384;
+
+// Encodes tiles of a frame that differ from the reference (what the client shows) and updates the reference
+class CPreviewEncoder {
+public:
+    // Tiles where no pixel differs by more than changeThreshold are not sent
+    CPreviewEncoder( TTileEncoding encoding = TE_Jpeg, int jpegQuality = 75, int changeThreshold = 0 );
+
+    TTileEncoding Encoding() const { return encoding; }
+
+    // The frame is converted to RGB888. The reference is reset when the frame size changes
+    QByteArray EncodeFrame( const QImage& frame, QImage& reference, quint32 frameId ) const;
+    static QByteArray EncodeHistogram( const QImage& histogram );
+
+private:
+    TTileEncoding encoding;
+    int jpegQuality;
+    int changeThreshold;
+
+    bool isChanged( const QImage& frame, const QImage& reference, int x, int y, int w, int h ) const;
+    QByteArray encodeTile( const QImage& frame, const QImage& reference, int x, int y, int w, int h ) const;
+};
+
+// Restores frames from the stream. Data is appended as it is received, incomplete messages are kept until the rest arrives
+class CPreviewDecoder {
+public:
+    // Returns the number of frames completed by the data
+    int Append( const QByteArray& data );
+
+    // False after a protocol error (the rest of the stream is ignored)
+    bool IsValid() const { return isValid; }
+
+    // The last completed frame
+    const QImage& Image() const { return image; }
+    quint32 FrameId() const { return frameId; }
+    const QImage& Histogram() const { return histogram; }
+    int ReceivedHistograms() const { return receivedHistograms; }
+    int ReceivedTiles() const { return receivedTiles; }
+
+private:
+    QByteArray buffer;
+    bool isValid = true;
+    // Frame being received (tiles are applied to it directly, tiles of the previous frame are kept)
+    QImage current;
+    QImage image;
+    quint32 frameId = 0;
+    QImage histogram;
+    int receivedHistograms = 0;
+    int receivedTiles = 0;
+
+    bool process( quint8 type, const QByteArray& payload, int& completedFrames );
+    bool applyTile( const QByteArray& payload );
+};
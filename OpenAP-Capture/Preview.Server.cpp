@@ -0,0 +1,98 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Preview.Server.h"
+
+#include <QDebug>
+
+CPreviewServer::CPreviewServer( QObject* parent ) :
+    QObject( parent )
+{
+    connect( &server, &QTcpServer::newConnection, this, &CPreviewServer::newConnection );
+}
+
+bool CPreviewServer::Listen( quint16 port, const QHostAddress& address )
+{
+    if( not server.listen( address, port ) ) {
+        qDebug() << "Preview server:" << server.errorString();
+        return false;
+    }
+    qDebug() << "Preview server is listening on" << server.serverAddress().toString() << "port" << server.serverPort();
+    return true;
+}
+
+void CPreviewServer::Publish( const QImage& _frame, const QImage& _histogram )
+{
+    if( clients.empty() ) {
+        return;
+    }
+    // Downscaled once for all clients
+    if( maxSize > 0 && ( _frame.width() > maxSize || _frame.height() > maxSize ) ) {
+        frame = _frame.scaled( maxSize, maxSize, Qt::KeepAspectRatio, Qt::FastTransformation );
+    } else {
+        frame = _frame;
+    }
+    frameId++;
+    if( not _histogram.isNull() ) {
+        histogram = _histogram;
+        histogramId++;
+    }
+
+    for( auto& client : clients ) {
+        send( client.first );
+    }
+}
+
+void CPreviewServer::newConnection()
+{
+    while( server.hasPendingConnections() ) {
+        QTcpSocket* socket = server.nextPendingConnection();
+        qDebug() << "Preview client connected from" << socket->peerAddress().toString();
+        clients[socket].Timer.start();
+
+        // The next frame goes out when the client has taken the previous one
+        connect( socket, &QTcpSocket::bytesWritten, this, [this, socket]() {
+            if( socket->bytesToWrite() == 0 ) {
+                send( socket );
+            }
+        } );
+        connect( socket, &QTcpSocket::disconnected, this, [this, socket]() {
+            qDebug() << "Preview client disconnected";
+            clients.erase( socket );
+            socket->deleteLater();
+        } );
+
+        // Show the latest frame right away
+        send( socket );
+    }
+}
+
+void CPreviewServer::send( QTcpSocket* socket )
+{
+    auto found = clients.find( socket );
+    if( found == clients.end() || socket->bytesToWrite() > 0 ) {
+        return;
+    }
+    auto& client = found->second;
+    QByteArray stream;
+    if( client.HistogramId != histogramId ) {
+        stream += CPreviewEncoder::EncodeHistogram( histogram );
+        client.HistogramId = histogramId;
+    }
+    if( client.FrameId != frameId && not frame.isNull() ) {
+        stream += encoder.EncodeFrame( frame, client.Reference, frameId );
+        client.FrameId = frameId;
+    }
+    if( stream.isEmpty() ) {
+        return;
+    }
+    socket->write( stream );
+    client.BytesSent += stream.size();
+
+    qint64 msec = client.Timer.elapsed();
+    if( msec > 10000 ) {
+        qDebug() << "Preview client" << socket->peerAddress().toString() << client.BytesSent * 1000 / msec / 1024 << "KB/s";
+        client.Timer.restart();
+        client.BytesSent = 0;
+    }
+}
@@ -0,0 +1,61 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <QObject>
+#include <QHostAddress>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QElapsedTimer>
+
+#include <map>
+
+#include "Preview.Protocol.h"
+
+// Streams the live view (downscaled rendered frames and the histogram) to remote clients. Only changed tiles are
+// sent. Each client is paced by its own bandwidth: a new frame is encoded for a client only when the previous
+// one has been written to the socket, frames published in between are dropped for that client (latest frame wins)
+class CPreviewServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CPreviewServer( QObject* parent = nullptr );
+
+    // There is no authentication, so only local clients are accepted by default (remote ones can tunnel over SSH)
+    bool Listen( quint16 port, const QHostAddress& address = QHostAddress::LocalHost );
+    quint16 Port() const { return server.serverPort(); }
+    bool IsListening() const { return server.isListening(); }
+
+    // Frames larger than maxSize x maxSize are downscaled before sending (0 - no downscaling)
+    void SetMaxSize( int _maxSize ) { maxSize = _maxSize; }
+    void SetEncoder( const CPreviewEncoder& _encoder ) { encoder = _encoder; }
+
+    // Can be called for every rendered frame, the frame is encoded only for clients that are ready for it
+    void Publish( const QImage& frame, const QImage& histogram = QImage() );
+
+    int Clients() const { return static_cast<int>( clients.size() ); }
+
+private:
+    struct CClient {
+        QImage Reference; // What the client shows
+        quint32 FrameId = 0;
+        quint32 HistogramId = 0;
+        // Measured bandwidth (bytes per second) for logging
+        QElapsedTimer Timer;
+        qint64 BytesSent = 0;
+    };
+
+    QTcpServer server;
+    CPreviewEncoder encoder;
+    int maxSize = 1280;
+    std::map<QTcpSocket*, CClient> clients;
+
+    QImage frame;
+    quint32 frameId = 0;
+    QImage histogram;
+    quint32 histogramId = 0;
+
+    void newConnection();
+    void send( QTcpSocket* );
+};
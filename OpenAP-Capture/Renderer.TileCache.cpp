@@ -0,0 +1,127 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Renderer.TileCache.h"
+
+#include <Image.Debayer.HalfRes.h>
+#include <Image.Debayer.HQLinear.h>
+#include <Image.Debayer.CFA.h>
+
+#include <cassert>
+#include <cstring>
+
+// Rounds towards negative infinity (the view can be partially outside the frame)
+static int floorDiv( int a, int b )
+{
+    return a >= 0 ? a / b : -( ( -a + b - 1 ) / b );
+}
+
+void CZoomTileCache::Clear()
+{
+    frame.reset();
+    tiles.clear();
+}
+
+QPixmap CZoomTileCache::Render( const std::shared_ptr<const CRawU16Image>& image, TRenderingMethod _method, bool _stretch,
+    int cx, int cy, int w, int h )
+{
+    assert( _method == RM_FullResolution || _method == RM_HalfResolution || _method == RM_CFA );
+    const int factor = _method == RM_HalfResolution ? 2 : 1;
+
+    // View rect in the output resolution
+    const int u0 = cx / factor - w / 2;
+    const int v0 = cy / factor - h / 2;
+
+    // The view is small, its statistics are cheap compared to rendering
+    const CStretchParams _params = _stretch ? CRawU16( image.get() ).StretchParams( factor * u0, factor * v0, factor * w, factor * h )
+        : CStretchParams{};
+    if( frame.lock() != image || method != _method || stretch != _stretch || params != _params ) {
+        frame = image;
+        method = _method;
+        stretch = _stretch;
+        params = _params;
+        tiles.clear();
+    }
+
+    const int outWidth = image->Width() / factor;
+    const int outHeight = image->Height() / factor;
+
+    QImage result( w, h, QImage::Format_RGB888 );
+    result.fill( Qt::black );
+
+    renderedTiles = 0;
+    const int i0 = floorDiv( u0, tileSize );
+    const int i1 = floorDiv( u0 + w - 1, tileSize );
+    const int j0 = floorDiv( v0, tileSize );
+    const int j1 = floorDiv( v0 + h - 1, tileSize );
+    for( int j = j0; j <= j1; j++ ) {
+        for( int i = i0; i <= i1; i++ ) {
+            if( i < 0 || j < 0 || i * tileSize >= outWidth || j * tileSize >= outHeight ) {
+                // Outside of the frame
+                continue;
+            }
+            auto& tile = tiles[std::make_pair( i, j )];
+            if( tile == 0 ) {
+                tile = renderTile( image.get(), i, j );
+                renderedTiles++;
+            }
+
+            // Copy the visible part of the tile
+            int x0 = std::max( u0, i * tileSize );
+            int x1 = std::min( u0 + w, ( i + 1 ) * tileSize );
+            int y0 = std::max( v0, j * tileSize );
+            int y1 = std::min( v0 + h, ( j + 1 ) * tileSize );
+            for( int y = y0; y < y1; y++ ) {
+                const uchar* src = tile->ScanLine( y - j * tileSize ) + 3 * ( x0 - i * tileSize );
+                uchar* dst = result.scanLine( y - v0 ) + 3 * ( x0 - u0 );
+                memcpy( dst, src, 3 * ( x1 - x0 ) );
+            }
+        }
+    }
+
+    if( tiles.size() > maxTiles ) {
+        // Keep only the tiles of the current view
+        for( auto it = tiles.begin(); it != tiles.end(); ) {
+            int i = it->first.first;
+            int j = it->first.second;
+            if( i < i0 || i > i1 || j < j0 || j > j1 ) {
+                it = tiles.erase( it );
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    return QPixmap::fromImage( result );
+}
+
+std::shared_ptr<const CRgbImage> CZoomTileCache::renderTile( const CRawU16Image* image, int i, int j ) const
+{
+    const int x = i * tileSize;
+    const int y = j * tileSize;
+
+    if( stretch ) {
+        CRawU16 raw( image );
+        if( method == RM_HalfResolution ) {
+            return raw.StretchHalfRes( params, 2 * x, 2 * y, 2 * tileSize, 2 * tileSize );
+        } else {
+            return raw.Stretch( params, x, y, tileSize, tileSize );
+        }
+    }
+
+    // Histograms are not used for the zoom
+    std::vector<uint> histR( 256 ), histG( 256 ), histB( 256 );
+    auto tile = std::make_shared<CRgbImage>( tileSize, tileSize );
+    const ushort* raw = image->RawPixels();
+    if( method == RM_HalfResolution ) {
+        CDebayer_RawU16_HalfRes debayer( raw, image->Width(), image->Height(), image->BitDepth() );
+        debayer.ToRgbU8( tile->RgbPixels(), tile->ByteWidth(), 2 * x, 2 * y, tileSize, tileSize, histR.data(), histG.data(), histB.data() );
+    } else if( method == RM_FullResolution ) {
+        CDebayer_RawU16_HQLinear debayer( raw, image->Width(), image->Height(), image->BitDepth() );
+        debayer.ToRgbU8( tile->RgbPixels(), tile->ByteWidth(), x, y, tileSize, tileSize, histR.data(), histG.data(), histB.data() );
+    } else {
+        CDebayer_RawU16_CFA debayer( raw, image->Width(), image->Height(), image->BitDepth() );
+        debayer.ToRgbU8( tile->RgbPixels(), tile->ByteWidth(), x, y, tileSize, tileSize, histR.data(), histG.data(), histB.data() );
+    }
+    return tile;
+}
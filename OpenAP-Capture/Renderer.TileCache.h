@@ -0,0 +1,40 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include "Renderer.h"
+
+#include <Image.RawImage.h>
+#include <Image.Math.Advanced.h>
+
+#include <map>
+#include <memory>
+
+// Cache of rendered 8-bit zoom tiles. The tiles are kept while the frame, the rendering method and the stretch
+// parameters stay the same, so panning the zoom view over the same frame renders only newly exposed tiles
+class CZoomTileCache {
+public:
+    // Renders w x h pixels centered at cx, cy (frame coordinates). The result is in the resolution of the rendering method
+    // (half of the frame resolution for RM_HalfResolution). With stretch on, the stretch parameters are calculated
+    // for the visible rect on each call (as without the cache), the tiles are dropped when they change
+    QPixmap Render( const std::shared_ptr<const CRawU16Image>& frame, TRenderingMethod, bool stretch, int cx, int cy, int w, int h );
+
+    void Clear();
+
+    // Number of tiles rendered (not taken from the cache) by the last call
+    int RenderedTiles() const { return renderedTiles; }
+
+private:
+    static const int tileSize = 64;
+    static const size_t maxTiles = 512;
+
+    std::weak_ptr<const CRawU16Image> frame;
+    TRenderingMethod method = RM_FullResolution;
+    bool stretch = false;
+    CStretchParams params = {};
+    std::map<std::pair<int, int>, std::shared_ptr<const CRgbImage>> tiles;
+    int renderedTiles = 0;
+
+    std::shared_ptr<const CRgbImage> renderTile( const CRawU16Image*, int i, int j ) const;
+};
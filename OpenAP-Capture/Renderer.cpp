@@ -5,18 +5,79 @@
 
 #include <Image.Qt.h>
 #include <Image.Debayer.HalfRes.h>
+#include <Image.Debayer.Binned.h>
 #include <Image.Debayer.HQLinear.h>
 #include <Image.Debayer.CFA.h>
 
 #include <QPainter>
 
-Renderer::Renderer( const ushort* _raw, int _width, int _height, int _bitDepth ) :
-    raw( _raw ), width( _width ), height( _height ), bitDepth( _bitDepth )
+std::shared_ptr<CRgbImage> CRenderBuffers::Get( int width, int height )
+{
+    for( const auto& buffer : buffers ) {
+        if( buffer.use_count() == 1 && buffer->Width() == width && buffer->Height() == height ) {
+            return buffer;
+        }
+    }
+    // No free buffer of this size, replace a free buffer of a different size (or add a new one)
+    auto buffer = std::make_shared<CRgbImage>( width, height );
+    for( auto& b : buffers ) {
+        if( b.use_count() == 1 ) {
+            b = buffer;
+            return buffer;
+        }
+    }
+    if( buffers.size() < maxBuffers ) {
+        buffers.push_back( buffer );
+    }
+    return buffer;
+}
+
+Renderer::Renderer( const ushort* _raw, int _width, int _height, int _bitDepth, CRenderBuffers* _buffers ) :
+    raw( _raw ), width( _width ), height( _height ), bitDepth( _bitDepth ), buffers( _buffers != 0 ? _buffers : &ownBuffers )
 {
 
 }
 
+// Reused buffers keep pixels of the previous frames. Debayering skips pixels outside of the frame, so they must be cleared
+static void clearOutside( CRgbImage* image, int x, int y, int w, int h, int width, int height )
+{
+    if( x < 0 || y < 0 || x + w > width || y + h > height ) {
+        std::fill( image->RgbPixels(), image->RgbPixels() + image->ByteWidth() * image->Height(), 0 );
+    }
+}
+
+QImage Renderer::RenderBinnedImage( int factor, int x, int y, int W, int H )
+{
+    // Initialize histogram
+    const int hSize = 256;
+    histR.resize( hSize );
+    histG.resize( hSize );
+    histB.resize( hSize );
+
+    // Bins start on CFA quads
+    x -= x & 1;
+    y -= y & 1;
+    int w = W > 0 ? W : width / factor;
+    int h = H > 0 ? H : height / factor;
+    auto image = buffers->Get( w, h );
+    clearOutside( image.get(), x, y, factor * w, factor * h, width, height );
+
+    CDebayer_RawU16_Binned debayer( raw, width, height, bitDepth, factor );
+    debayer.ToRgbU8( image->RgbPixels(), image->ByteWidth(), x, y, w, h, histR.data(), histG.data(), histB.data() );
+    maxValue = debayer.MaxValue;
+    maxCount = debayer.MaxCount;
+    minValue = debayer.MinValue;
+    minCount = debayer.MinCount;
+
+    return Qt::ShareImage( image );
+}
+
 QPixmap Renderer::Render( TRenderingMethod method, int x, int y, int W, int H )
+{
+    return QPixmap::fromImage( RenderImage( method, x, y, W, H ) );
+}
+
+QImage Renderer::RenderImage( TRenderingMethod method, int x, int y, int W, int H )
 {
     // Initialize histogram
     const int hSize = 256;
@@ -24,77 +85,57 @@ QPixmap Renderer::Render( TRenderingMethod method, int x, int y, int W, int H )
     histG.resize( hSize );
     histB.resize( hSize );
 
-    if( method == RM_HalfResolution || method == RM_QuarterResolution) {
+    if( method == RM_HalfResolution ) {
         x -= W / 2;
         y -= H / 2;
         int w = W > 0 ? W : width / 2;
         int h = H > 0 ? H : height / 2;
-        size_t byteWidth = 3 * w;
-        std::vector<uchar> pixels( byteWidth * h );   
-        uchar* rgb = pixels.data();
+        auto image = buffers->Get( w, h );
+        clearOutside( image.get(), x, y, 2 * w, 2 * h, width, height );
 
         CDebayer_RawU16_HalfRes debayer( raw, width, height, bitDepth );
-        debayer.ToRgbU8( rgb, byteWidth, x, y, w, h, histR.data(), histG.data(), histB.data() );
+        debayer.ToRgbU8( image->RgbPixels(), image->ByteWidth(), x, y, w, h, histR.data(), histG.data(), histB.data() );
         maxValue = debayer.MaxValue;
         maxCount = debayer.MaxCount;
         minValue = debayer.MinValue;
         minCount = debayer.MinCount;
 
-        if( method == RM_HalfResolution ) {
-            return Qt::CreatePixmap( rgb, w, h, byteWidth );
-        } else {
-            // Downscale twice
-            size_t byteWidth2 = byteWidth / 2;
-            std::vector<uchar> pixels2( byteWidth2 * h / 2);
-            uchar* rgb2 = pixels.data();
-            for( int i = 0; i < h / 2; i++ ) {
-                const uchar* ptr = rgb + 2 * i * byteWidth;
-                uchar* ptr2 = rgb2 + i * byteWidth2;
-                for( int j = 0; j < w / 2; j++ ) {
-                    const uchar* p = ptr + 6 * j;
-                    uchar* p2 = ptr2 + 3 * j;
-                    p2[0] = ( p[0] + p[3] + p[byteWidth] + p[byteWidth + 3] ) / 4;
-                    p2[1] = ( p[1] + p[4] + p[byteWidth + 1] + p[byteWidth + 4] ) / 4;
-                    p2[2] = ( p[2] + p[5] + p[byteWidth + 2] + p[byteWidth + 5] ) / 4;
-                }
-            }
-
-            return Qt::CreatePixmap( rgb2, w / 2, h / 2, byteWidth2 );
-        }
+        return Qt::ShareImage( image );
+    } else if( method == RM_QuarterResolution ) {
+        // The same area as for the half resolution, with twice smaller output
+        return RenderBinnedImage( 4, x - W / 2, y - H / 2, W / 2, H / 2 );
     } else if( method == RM_FullResolution ) {
         assert( method == RM_FullResolution );
 
-        size_t w = W > 0 ? W : width;
-        size_t h = H > 0 ? H : height;
-        size_t byteWidth = 3 * w;
-        std::vector<uchar> pixels( byteWidth * h );
-        uchar* rgb = pixels.data();
+        int w = W > 0 ? W : width;
+        int h = H > 0 ? H : height;
+        auto image = buffers->Get( w, h );
+        clearOutside( image.get(), x, y, w, h, width, height );
 
         CDebayer_RawU16_HQLinear debayer( raw, width, height, bitDepth );
-        debayer.ToRgbU8( rgb, byteWidth, x, y, w, h, histR.data(), histG.data(), histB.data() );
+        debayer.ToRgbU8( image->RgbPixels(), image->ByteWidth(), x, y, w, h, histR.data(), histG.data(), histB.data() );
         maxValue = debayer.MaxValue;
         maxCount = debayer.MaxCount;
         minValue = debayer.MinValue;
         minCount = debayer.MinCount;
 
-        return Qt::CreatePixmap( rgb, w, h, byteWidth );
+        return Qt::ShareImage( image );
     } else {
         assert( method == RM_CFA );
 
-        size_t w = W > 0 ? W : width;
-        size_t h = H > 0 ? H : height;
-        size_t byteWidth = 3 * w;
-        std::vector<uchar> pixels( byteWidth * h );
-        uchar* rgb = pixels.data();
+        int w = W > 0 ? W : width;
+        int h = H > 0 ? H : height;
+        auto image = buffers->Get( w, h );
+        clearOutside( image.get(), x, y, w, h, width, height );
 
         CDebayer_RawU16_CFA debayer( raw, width, height, bitDepth );
-        debayer.ToRgbU8( rgb, byteWidth, x, y, w, h, histR.data(), histG.data(), histB.data() );
+        debayer.ToRgbU8( image->RgbPixels(), image->ByteWidth(), x, y, w, h, histR.data(), histG.data(), histB.data() );
         maxValue = debayer.MaxValue;
         maxCount = debayer.MaxCount;
         minValue = debayer.MinValue;
         minCount = debayer.MinCount;
 
-        return Qt::CreatePixmap( rgb, w, h, byteWidth );
+        return Qt::ShareImage( image );
     }
 }
 
@@ -119,6 +160,11 @@ static QString collapseNumber( uint n )
 }
 
 QPixmap Renderer::RenderHistogram()
+{
+    return QPixmap::fromImage( RenderHistogramImage() );
+}
+
+QImage Renderer::RenderHistogramImage()
 {
     const uint* r = histR.data();
     const uint* g = histG.data();
@@ -187,10 +233,10 @@ QPixmap Renderer::RenderHistogram()
         }
     }
 
-    auto pixmap = Qt::CreatePixmap( p, size, h );
+    auto image = Qt::CreateImage( p, size, h ).convertToFormat( QImage::Format_RGB32 );
 
     // Add basic statistics (min/max etc)
-    QPainter painter( &pixmap );
+    QPainter painter( &image );
     QPen pen( QColor::fromRgb( 0x40, 0x80, 0x40 ) );
     painter.setPen( pen );
     QFont font( "Consolas" );
@@ -210,5 +256,5 @@ QPixmap Renderer::RenderHistogram()
     );
     painter.end();
 
-    return pixmap;
+    return image;
 }
@@ -6,6 +6,11 @@
 #include <QImage>
 #include <QPixmap>
 
+#include <Image.Image.h>
+
+#include <memory>
+#include <vector>
+
 enum TRenderingMethod {
     RM_QuarterResolution,
     RM_HalfResolution,
@@ -13,12 +18,34 @@ enum TRenderingMethod {
     RM_CFA
 };
 
+// Output images reused across frames. A buffer is reused only when nobody else holds it (e.g. the QImage of the
+// previous frame that is still on the way to the screen), so rendering is double-buffered and there are
+// no allocations in the steady state
+class CRenderBuffers {
+public:
+    std::shared_ptr<CRgbImage> Get( int width, int height );
+    // Intermediate 16-bit rows of stretching (CRawU16::Stretch and StretchBinned)
+    std::vector<ushort>& Scratch() { return scratch; }
+
+private:
+    static const size_t maxBuffers = 4;
+    std::vector<std::shared_ptr<CRgbImage>> buffers;
+    std::vector<ushort> scratch;
+};
+
 class Renderer {
 public:
-    Renderer( const ushort* raw, int width, int height, int bitDepth );
+    Renderer( const ushort* raw, int width, int height, int bitDepth, CRenderBuffers* buffers = 0 );
 
+    // The QImage references the render buffer directly (no copy), the buffer is returned to the pool when the QImage is destroyed
+    QImage RenderImage( TRenderingMethod, int x = 0, int y = 0, int w = 0, int h = 0 );
     QPixmap Render( TRenderingMethod, int x = 0, int y = 0, int w = 0, int h = 0 );
+    // Binned preview reading each raw pixel once (factor 2, 4, 8 etc). x, y is the top left corner in the frame,
+    // w, h is the size of the result (the whole frame by default)
+    QImage RenderBinnedImage( int factor, int x = 0, int y = 0, int w = 0, int h = 0 );
     QPixmap RenderHistogram();
+    // Can be called outside of the GUI thread
+    QImage RenderHistogramImage();
 
 private:
     const ushort* raw;
@@ -26,6 +53,9 @@ private:
     int height;
     int bitDepth;
 
+    CRenderBuffers ownBuffers;
+    CRenderBuffers* buffers;
+
     // Histogram data
     std::vector<uint> histR;
     std::vector<uint> histG;
@@ -0,0 +1,9 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include <QtTest>
+
+#include "Tests.h"
+
+// No windows, images are only encoded and decoded
+QTEST_GUILESS_MAIN( CTests )
@@ -0,0 +1,46 @@
+#-------------------------------------------------
+#
+# Unit tests of the image, math and preview code ("make check" runs them)
+#
+#-------------------------------------------------
+
+QT += core gui concurrent testlib
+
+TARGET = OpenAP-Tests
+TEMPLATE = app
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+CAPTURE = ../OpenAP-Capture
+INCLUDEPATH += $$CAPTURE
+
+SOURCES += \
+        Main.cpp \
+        Tests.Math.cpp \
+        Tests.Preview.cpp \
+        Tests.StarMatcher.cpp \
+        $$CAPTURE/Image.Background.cpp \
+        $$CAPTURE/Image.Debayer.Binned.cpp \
+        $$CAPTURE/Image.Debayer.CFA.cpp \
+        $$CAPTURE/Image.Debayer.HalfRes.cpp \
+        $$CAPTURE/Image.Debayer.HQLinear.cpp \
+        $$CAPTURE/Image.Image.cpp \
+        $$CAPTURE/Image.Labeling.cpp \
+        $$CAPTURE/Image.Math.cpp \
+        $$CAPTURE/Image.Math.Advanced.cpp \
+        $$CAPTURE/Image.RadialProfile.cpp \
+        $$CAPTURE/Image.RawImage.cpp \
+        $$CAPTURE/Image.StarMatcher.cpp \
+        $$CAPTURE/Math.Fft.cpp \
+        $$CAPTURE/Math.Geometry.cpp \
+        $$CAPTURE/Math.LinearAlgebra.cpp \
+        $$CAPTURE/Math.Ransac.cpp \
+        $$CAPTURE/Preview.Protocol.cpp \
+
+HEADERS += \
+        Tests.h \
+
+unix: {
+    QMAKE_CXXFLAGS += -std=c++17 #CONFIG alone does not work with neither gcc nor clang
+}
@@ -0,0 +1,158 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Tests.h"
+
+#include <QtTest>
+
+#include <cmath>
+#include <complex>
+#include <random>
+#include <vector>
+
+#include <Math.Fft.h>
+#include <Math.Ransac.h>
+
+// X[k] = sum of x[n] * exp( -2 * pi * i * k * n / N ) in double precision
+static std::vector<std::complex<double>> naiveDft( const std::vector<std::complex<double>>& x, bool inverse )
+{
+    const int n = static_cast<int>( x.size() );
+    const double sign = inverse ? 1 : -1;
+    std::vector<std::complex<double>> result( n );
+    for( int k = 0; k < n; k++ ) {
+        for( int j = 0; j < n; j++ ) {
+            result[k] += x[j] * std::polar( 1.0, sign * 2 * M_PI * ( static_cast<long long>( k ) * j % n ) / n );
+        }
+    }
+    return result;
+}
+
+void CTests::fftMatchesNaiveDft()
+{
+    std::mt19937 random( 1 );
+    std::uniform_real_distribution<float> value( -1, 1 );
+    for( int size : { 1, 2, 4, 8, 64, 512 } ) {
+        std::vector<std::complex<float>> data( size );
+        std::vector<std::complex<double>> input( size );
+        for( int i = 0; i < size; i++ ) {
+            data[i] = { value( random ), value( random ) };
+            input[i] = data[i];
+        }
+
+        CFft fft( size );
+        fft.Forward( data.data() );
+        auto expected = naiveDft( input, false );
+        // Float rounding grows with log( size ) relative to the magnitude of the spectrum (about sqrt( size ))
+        const double tolerance = 1e-5 * std::sqrt( size ) * ( 1 + std::log2( size ) );
+        for( int k = 0; k < size; k++ ) {
+            QVERIFY2( std::abs( std::complex<double>( data[k] ) - expected[k] ) < tolerance,
+                qPrintable( QString( "forward size %1 bin %2" ).arg( size ).arg( k ) ) );
+        }
+
+        fft.Inverse( data.data() );
+        for( int k = 0; k < size; k++ ) {
+            QVERIFY2( std::abs( std::complex<double>( data[k] ) / double( size ) - input[k] ) < tolerance,
+                qPrintable( QString( "inverse size %1 bin %2" ).arg( size ).arg( k ) ) );
+        }
+    }
+}
+
+void CTests::realFft2DMatchesNaiveDft()
+{
+    const int width = 16;
+    const int height = 8;
+    std::mt19937 random( 2 );
+    std::uniform_real_distribution<float> value( 0, 1000 );
+    std::vector<float> image( width * height );
+    for( auto& v : image ) {
+        v = value( random );
+    }
+
+    CRealFft2D fft( width, height );
+    std::vector<std::complex<float>> spectrum( fft.SpectrumWidth() * height );
+    fft.Forward( image.data(), spectrum.data() );
+
+    // Rows, then columns of the full complex spectrum
+    std::vector<std::complex<double>> full( width * height );
+    for( int y = 0; y < height; y++ ) {
+        auto row = naiveDft( std::vector<std::complex<double>>( image.begin() + y * width, image.begin() + ( y + 1 ) * width ), false );
+        std::copy( row.begin(), row.end(), full.begin() + y * width );
+    }
+    for( int x = 0; x < width; x++ ) {
+        std::vector<std::complex<double>> column( height );
+        for( int y = 0; y < height; y++ ) {
+            column[y] = full[y * width + x];
+        }
+        column = naiveDft( column, false );
+        for( int y = 0; y < height; y++ ) {
+            full[y * width + x] = column[y];
+        }
+    }
+
+    const double tolerance = 1e-5 * 1000 * width * height;
+    for( int y = 0; y < height; y++ ) {
+        for( int x = 0; x < fft.SpectrumWidth(); x++ ) {
+            QVERIFY2( std::abs( std::complex<double>( spectrum[y * fft.SpectrumWidth() + x] ) - full[y * width + x] ) < tolerance,
+                qPrintable( QString( "bin %1, %2" ).arg( x ).arg( y ) ) );
+        }
+    }
+
+    std::vector<float> restored( width * height );
+    fft.Inverse( spectrum.data(), restored.data() );
+    for( int i = 0; i < width * height; i++ ) {
+        QVERIFY( std::abs( restored[i] - image[i] ) < 1e-2 );
+    }
+}
+
+void CTests::ransacRejectsOutliers()
+{
+    // Rotation by 0.3 radians, scale 1.1 and shift, positions measured with 0.1 pixel noise. Every third pair is
+    // replaced with a random point
+    const double angle = 0.3;
+    const double scale = 1.1;
+    const double dx = 40;
+    const double dy = -25;
+    auto transform = [&]( double x, double y, double& x1, double& y1 ) {
+        x1 = scale * ( std::cos( angle ) * x - std::sin( angle ) * y ) + dx;
+        y1 = scale * ( std::sin( angle ) * x + std::cos( angle ) * y ) + dy;
+    };
+
+    std::mt19937 random( 3 );
+    std::uniform_real_distribution<double> position( 0, 2000 );
+    std::normal_distribution<double> noise( 0, 0.1 );
+    std::vector<double> x1, y1, x2, y2;
+    std::vector<int> expectedInliers;
+    for( int i = 0; i < 90; i++ ) {
+        const double x = position( random );
+        const double y = position( random );
+        double tx, ty;
+        transform( x, y, tx, ty );
+        x1.push_back( x );
+        y1.push_back( y );
+        if( i % 3 == 2 ) {
+            x2.push_back( position( random ) );
+            y2.push_back( position( random ) );
+        } else {
+            x2.push_back( tx + noise( random ) );
+            y2.push_back( ty + noise( random ) );
+            expectedInliers.push_back( i );
+        }
+    }
+
+    for( TTransformModel model : { TM_Similarity, TM_Affine, TM_Homography } ) {
+        CRansac ransac( model );
+        ransac.SetSeed( 1 );
+        const CRansacResult result = ransac.Estimate( x1, y1, x2, y2 );
+        QVERIFY( result.IsValid );
+        QCOMPARE( result.Inliers, expectedInliers );
+        QVERIFY( result.Rms < 0.3 );
+        for( double x : { 0.0, 1000.0, 2000.0 } ) {
+            for( double y : { 0.0, 1000.0, 2000.0 } ) {
+                double ex, ey, rx, ry;
+                transform( x, y, ex, ey );
+                result.Transform.Apply( x, y, rx, ry );
+                QVERIFY2( std::hypot( rx - ex, ry - ey ) < 0.5, qPrintable( QString( "model %1 at %2, %3" ).arg( model ).arg( x ).arg( y ) ) );
+            }
+        }
+    }
+}
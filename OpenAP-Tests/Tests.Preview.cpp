@@ -0,0 +1,123 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Tests.h"
+
+#include <QtTest>
+#include <QDataStream>
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+
+#include <Preview.Protocol.h>
+
+// Smooth gradient with noise, the size is not a multiple of the tile size
+static QImage testFrame( int width, int height, unsigned int seed )
+{
+    std::mt19937 random( seed );
+    QImage frame( width, height, QImage::Format_RGB888 );
+    for( int y = 0; y < height; y++ ) {
+        uchar* p = frame.scanLine( y );
+        for( int x = 0; x < width; x++ ) {
+            p[3 * x] = uchar( x / 2 + random() % 8 );
+            p[3 * x + 1] = uchar( y / 2 + random() % 8 );
+            p[3 * x + 2] = uchar( ( x + y ) / 4 + random() % 8 );
+        }
+    }
+    return frame;
+}
+
+// Largest difference of the channels of two frames of the same size
+static int maxDifference( const QImage& a, const QImage& b )
+{
+    int result = 0;
+    for( int y = 0; y < a.height(); y++ ) {
+        const uchar* p = a.constScanLine( y );
+        const uchar* q = b.constScanLine( y );
+        for( int x = 0; x < 3 * a.width(); x++ ) {
+            result = std::max( result, std::abs( p[x] - q[x] ) );
+        }
+    }
+    return result;
+}
+
+void CTests::previewDeltaRoundTrip()
+{
+    const int width = 300;
+    const int height = 200;
+    // 5 x 4 tiles
+    const int tiles = 20;
+    CPreviewEncoder encoder( TE_Delta );
+    CPreviewDecoder decoder;
+    QImage reference;
+
+    QImage frame = testFrame( width, height, 1 );
+    QCOMPARE( decoder.Append( encoder.EncodeFrame( frame, reference, 1 ) ), 1 );
+    QVERIFY( decoder.IsValid() );
+    QCOMPARE( decoder.FrameId(), quint32( 1 ) );
+    QCOMPARE( decoder.Image(), frame );
+    QCOMPARE( decoder.ReceivedTiles(), tiles );
+
+    // Only the tile with the changed pixel is sent
+    frame.scanLine( 130 )[3 * 70] ^= 0xFF;
+    QCOMPARE( decoder.Append( encoder.EncodeFrame( frame, reference, 2 ) ), 1 );
+    QCOMPARE( decoder.Image(), frame );
+    QCOMPARE( decoder.ReceivedTiles(), tiles + 1 );
+
+    // The stream arrives in pieces that split the messages
+    frame = testFrame( width, height, 2 );
+    const QByteArray stream = encoder.EncodeFrame( frame, reference, 3 ) + CPreviewEncoder::EncodeHistogram( testFrame( 64, 32, 3 ) );
+    int completedFrames = 0;
+    for( int i = 0; i < stream.size(); i += 7 ) {
+        completedFrames += decoder.Append( stream.mid( i, 7 ) );
+    }
+    QCOMPARE( completedFrames, 1 );
+    QVERIFY( decoder.IsValid() );
+    QCOMPARE( decoder.FrameId(), quint32( 3 ) );
+    QCOMPARE( decoder.Image(), frame );
+    QCOMPARE( decoder.ReceivedHistograms(), 1 );
+    QCOMPARE( decoder.Histogram().size(), QSize( 64, 32 ) );
+}
+
+void CTests::previewJpegRoundTrip()
+{
+    CPreviewEncoder encoder( TE_Jpeg, 90 );
+    CPreviewDecoder decoder;
+    QImage reference;
+
+    const QImage frame = testFrame( 130, 70, 4 );
+    QCOMPARE( decoder.Append( encoder.EncodeFrame( frame, reference, 1 ) ), 1 );
+    QVERIFY( decoder.IsValid() );
+    QCOMPARE( decoder.Image().size(), frame.size() );
+    QVERIFY( maxDifference( decoder.Image(), frame ) < 32 );
+
+    // The same frame again sends no tiles
+    const int tiles = decoder.ReceivedTiles();
+    QCOMPARE( decoder.Append( encoder.EncodeFrame( frame, reference, 2 ) ), 1 );
+    QCOMPARE( decoder.ReceivedTiles(), tiles );
+}
+
+// FrameBegin with the given size
+static QByteArray frameBegin( quint32 width, quint32 height )
+{
+    QByteArray stream;
+    QDataStream out( &stream, QIODevice::WriteOnly );
+    out.setByteOrder( QDataStream::LittleEndian );
+    out << PreviewMagic << quint8( PM_FrameBegin ) << quint32( 12 ) << quint32( 1 ) << width << height;
+    return stream;
+}
+
+void CTests::previewRejectsBrokenFrames()
+{
+    for( auto size : { QSize( 0, 100 ), QSize( 100, 0 ), QSize( int( PreviewMaxFrameSize ) + 1, 100 ),
+        QSize( 100, int( PreviewMaxFrameSize ) + 1 ) } ) {
+        CPreviewDecoder decoder;
+        QCOMPARE( decoder.Append( frameBegin( size.width(), size.height() ) ), 0 );
+        QVERIFY( not decoder.IsValid() );
+    }
+
+    CPreviewDecoder decoder;
+    decoder.Append( QByteArray( "GET / HTTP/1.1\r\n\r\n" ) );
+    QVERIFY( not decoder.IsValid() );
+}
@@ -0,0 +1,72 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Tests.h"
+
+#include <QtTest>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <Image.StarMatcher.h>
+
+// The second list is the first one transformed, with 0.3 pixel noise. Every tenth star of the first list is missing
+// in the second one, and the second list has 20 stars of its own at the end
+static void checkMatch( double angle, double scale, bool isMirrored )
+{
+    const int count = 200;
+    std::mt19937 random( 7 );
+    std::uniform_real_distribution<float> position( 0, 3000 );
+    std::normal_distribution<float> noise( 0, 0.3f );
+    std::vector<float> x0( count ), y0( count ), x1, y1;
+    for( int i = 0; i < count; i++ ) {
+        x0[i] = position( random );
+        y0[i] = 0.7f * position( random );
+    }
+    const double dx = 40;
+    const double dy = -25;
+    std::vector<int> expected( count, -1 );
+    for( int i = 0; i < count; i++ ) {
+        if( i % 10 == 3 ) {
+            continue;
+        }
+        const double x = x0[i];
+        const double y = isMirrored ? -y0[i] : y0[i];
+        expected[i] = static_cast<int>( x1.size() );
+        x1.push_back( static_cast<float>( scale * ( std::cos( angle ) * x - std::sin( angle ) * y ) + dx + noise( random ) ) );
+        y1.push_back( static_cast<float>( scale * ( std::sin( angle ) * x + std::cos( angle ) * y ) + dy + noise( random ) ) );
+    }
+    for( int i = 0; i < 20; i++ ) {
+        x1.push_back( position( random ) );
+        y1.push_back( 0.7f * position( random ) );
+    }
+
+    CStarMatcher matcher;
+    const CStarMatchResult result = matcher.Match( x0.data(), y0.data(), count, x1.data(), y1.data(), static_cast<int>( x1.size() ) );
+    QVERIFY( result.IsValid );
+    QCOMPARE( result.Transform.IsMirrored, isMirrored );
+    QVERIFY( std::abs( result.Transform.Scale - scale ) < 1e-3 );
+    QVERIFY( std::abs( std::remainder( result.Transform.Angle - angle, 2 * M_PI ) ) < 1e-3 );
+
+    // Every star present in both lists is matched to itself, and nothing else is matched
+    int matched = 0;
+    for( const auto& match : result.Matches ) {
+        QCOMPARE( match.Index1, expected[match.Index0] );
+        matched++;
+    }
+    QCOMPARE( matched, count - count / 10 );
+}
+
+void CTests::starMatcherRotated()
+{
+    checkMatch( 0.3, 1, false );
+    checkMatch( -2.5, 1.5, false );
+    checkMatch( M_PI, 0.5, false );
+}
+
+void CTests::starMatcherMirrored()
+{
+    checkMatch( 0.3, 1, true );
+    checkMatch( 1.2, 1.5, true );
+}
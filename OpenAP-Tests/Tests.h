@@ -0,0 +1,27 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <QObject>
+
+// Unit tests on synthetic data with fixed seeds, so that every run checks exactly the same cases
+class CTests : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    // Tests.Math.cpp
+    void fftMatchesNaiveDft();
+    void realFft2DMatchesNaiveDft();
+    void ransacRejectsOutliers();
+
+    // Tests.StarMatcher.cpp
+    void starMatcherRotated();
+    void starMatcherMirrored();
+
+    // Tests.Preview.cpp
+    void previewDeltaRoundTrip();
+    void previewJpegRoundTrip();
+    void previewRejectsBrokenFrames();
+};
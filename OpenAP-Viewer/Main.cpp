@@ -0,0 +1,41 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+
+#include "Viewer.h"
+
+int main( int argc, char *argv[] )
+{
+    QApplication a( argc, argv );
+
+    QCoreApplication::setOrganizationName( "aleksey-ka" );
+    QCoreApplication::setApplicationName( "OpenAP-Viewer" );
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription( "Shows the live view of OpenAP-Capture started with --preview-port. "
+        "The server accepts local clients by default, connect through an SSH tunnel (ssh -L port:127.0.0.1:port host)." );
+    parser.addHelpOption();
+    parser.addPositionalArgument( "host", "Host of OpenAP-Capture (127.0.0.1 for a tunnel)" );
+    parser.addPositionalArgument( "port", "Preview port" );
+    parser.process( a );
+
+    const QStringList args = parser.positionalArguments();
+    if( args.size() != 2 ) {
+        parser.showHelp( 1 );
+    }
+    bool ok = false;
+    quint16 port = args[1].toUShort( &ok );
+    if( not ok || port == 0 ) {
+        qCritical() << "Invalid port:" << args[1];
+        return 1;
+    }
+
+    CViewer w( args[0], port );
+    w.resize( 1280, 900 );
+    w.show();
+
+    return a.exec();
+}
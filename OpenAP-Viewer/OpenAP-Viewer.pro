@@ -0,0 +1,29 @@
+#-------------------------------------------------
+#
+# Remote viewer of the live view streamed by OpenAP-Capture (--preview-port)
+#
+#-------------------------------------------------
+
+QT += core gui widgets network
+
+TARGET = OpenAP-Viewer
+TEMPLATE = app
+
+CONFIG += c++17
+
+CAPTURE = ../OpenAP-Capture
+INCLUDEPATH += $$CAPTURE
+
+SOURCES += \
+        Main.cpp \
+        Viewer.cpp \
+        $$CAPTURE/Preview.Client.cpp \
+        $$CAPTURE/Preview.Protocol.cpp \
+
+HEADERS += \
+        Viewer.h \
+        $$CAPTURE/Preview.Client.h \
+
+unix: {
+    QMAKE_CXXFLAGS += -std=c++17 #CONFIG alone does not work with neither gcc nor clang
+}
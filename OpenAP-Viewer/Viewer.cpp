@@ -0,0 +1,76 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#include "Viewer.h"
+
+#include <QVBoxLayout>
+#include <QHBoxLayout>
+#include <QPixmap>
+
+CViewer::CViewer( const QString& _host, quint16 _port, QWidget* parent ) :
+    QWidget( parent ),
+    host( _host ),
+    port( _port )
+{
+    setWindowTitle( QString( "OpenAP-Viewer %1:%2" ).arg( host ).arg( port ) );
+
+    imageView = new QLabel( this );
+    imageView->setAlignment( Qt::AlignCenter );
+    imageView->setMinimumSize( 320, 240 );
+    imageView->setSizePolicy( QSizePolicy::Ignored, QSizePolicy::Ignored );
+    imageView->setStyleSheet( "background-color: black;" );
+    histogramView = new QLabel( this );
+    statusView = new QLabel( this );
+
+    auto bottom = new QHBoxLayout();
+    bottom->addWidget( histogramView );
+    bottom->addWidget( statusView, 1 );
+    auto layout = new QVBoxLayout( this );
+    layout->addWidget( imageView, 1 );
+    layout->addLayout( bottom );
+
+    connect( &client, &CPreviewClient::frameReceived, this, &CViewer::showFrame );
+    connect( &client, &CPreviewClient::histogramReceived, this, &CViewer::showHistogram );
+    connect( &client, &CPreviewClient::connected, this, [this]() { showStatus( "Connected, waiting for frames" ); } );
+    connect( &client, &CPreviewClient::disconnected, this, [this]() { showStatus( "Disconnected" ); } );
+    connect( &client, &CPreviewClient::streamError, this, [this]() { showStatus( "Broken stream" ); } );
+
+    // Checks the connection every few seconds and connects again when it is lost
+    connect( &reconnectTimer, &QTimer::timeout, this, &CViewer::connectToServer );
+    reconnectTimer.start( 3000 );
+    connectToServer();
+}
+
+void CViewer::connectToServer()
+{
+    if( client.IsIdle() ) {
+        showStatus( QString( "Connecting to %1:%2" ).arg( host ).arg( port ) );
+        client.ConnectToServer( host, port );
+    }
+}
+
+void CViewer::showFrame( quint32 frameId )
+{
+    const QImage& image = client.Image();
+    imageView->setPixmap( QPixmap::fromImage( image ).scaled( imageView->size(), Qt::KeepAspectRatio, Qt::SmoothTransformation ) );
+    showStatus( QString( "Frame %1 (%2x%3), %4 MB received" ).arg( frameId ).arg( image.width() ).arg( image.height() )
+        .arg( client.BytesReceived() / 1048576.0, 0, 'f', 1 ) );
+}
+
+void CViewer::showHistogram()
+{
+    histogramView->setPixmap( QPixmap::fromImage( client.Histogram() ) );
+}
+
+void CViewer::showStatus( const QString& status )
+{
+    statusView->setText( status );
+}
+
+void CViewer::resizeEvent( QResizeEvent* event )
+{
+    QWidget::resizeEvent( event );
+    if( not client.Image().isNull() ) {
+        showFrame( client.Decoder().FrameId() );
+    }
+}
@@ -0,0 +1,37 @@
+// Copyright (C) 2021 Aleksey Kalyuzhny. Released under the terms of the
+// GNU General Public License version 3. See <http://www.gnu.org/licenses/>
+
+#pragma once
+
+#include <QWidget>
+#include <QLabel>
+#include <QTimer>
+
+#include <Preview.Client.h>
+
+// Window with the frames and the histogram received from the preview server. The connection is retried
+// while the server is not available (e.g. OpenAP-Capture is restarted)
+class CViewer : public QWidget
+{
+    Q_OBJECT
+public:
+    CViewer( const QString& host, quint16 port, QWidget* parent = nullptr );
+
+protected:
+    void resizeEvent( QResizeEvent* ) override;
+
+private:
+    const QString host;
+    const quint16 port;
+    CPreviewClient client;
+    QTimer reconnectTimer;
+
+    QLabel* imageView;
+    QLabel* histogramView;
+    QLabel* statusView;
+
+    void connectToServer();
+    void showFrame( quint32 frameId );
+    void showHistogram();
+    void showStatus( const QString& );
+};
@@ -1,4 +1,7 @@
 TEMPLATE = subdirs
 
 SUBDIRS += \
-    OpenAP-Capture
+    OpenAP-Capture \
+    OpenAP-Benchmark \
+    OpenAP-Viewer \
+    OpenAP-Tests